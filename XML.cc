@@ -5,6 +5,10 @@
 
 #include <iostream>
 #include <map>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <xercesc/util/PlatformUtils.hpp>
 
@@ -365,6 +369,453 @@ namespace domx
   }
 
 
+  namespace
+  {
+    /**
+     * Return the entity for the character @p c, or null if it can be
+     * written as is.  Quotes only need escaping in attribute values.
+     **/
+    inline const char*
+    entity (unsigned int c, bool attr)
+    {
+      switch (c)
+      {
+      case '&': return "&amp;";
+      case '<': return "&lt;";
+      case '>': return "&gt;";
+      case '\'': return attr ? "&apos;" : 0;
+      case '"': return attr ? "&quot;" : 0;
+      }
+      return 0;
+    }
+
+    void
+    appendEscaped (std::string& buf, const char* s, std::string::size_type n,
+		   bool attr)
+    {
+      // Copy runs of plain characters in one append.
+      const char* run = s;
+      const char* end = s + n;
+      for (const char* p = s; p < end; ++p)
+      {
+	const char* e = entity ((unsigned char)*p, attr);
+	if (e)
+	{
+	  buf.append (run, p - run);
+	  buf += e;
+	  run = p + 1;
+	}
+      }
+      buf.append (run, end - run);
+    }
+
+    /**
+     * Append the UTF-16 string @p s encoded as UTF-8 and escaped, and
+     * return the encoded length before escaping.  Unpaired surrogates
+     * become the replacement character.
+     **/
+    std::string::size_type
+    appendEscaped (std::string& buf, const XMLCh* s, bool attr)
+    {
+      std::string::size_type length = 0;
+      for ( ; s && *s; ++s)
+      {
+	unsigned int c = *s;
+	if (c < 0x80)
+	{
+	  const char* e = entity (c, attr);
+	  if (e)
+	    buf += e;
+	  else
+	    buf += char(c);
+	  ++length;
+	  continue;
+	}
+	if (c >= 0xD800 && c < 0xDC00 && s[1] >= 0xDC00 && s[1] < 0xE000)
+	{
+	  c = 0x10000 + ((c - 0xD800) << 10) + (s[1] - 0xDC00);
+	  ++s;
+	}
+	length += appendUtf8 (buf, c);
+      }
+      return length;
+    }
+  }
+
+
+  std::string::size_type
+  appendUtf8 (std::string& buf, unsigned int c)
+  {
+    if (c < 0x80)
+    {
+      buf += char(c);
+      return 1;
+    }
+    if ((c >= 0xD800 && c < 0xE000) || c > 0x10FFFF)
+      c = 0xFFFD;
+    char out[4];
+    int n;
+    if (c < 0x800)
+    {
+      out[0] = char(0xC0 | (c >> 6));
+      n = 2;
+    }
+    else if (c < 0x10000)
+    {
+      out[0] = char(0xE0 | (c >> 12));
+      out[1] = char(0x80 | ((c >> 6) & 0x3F));
+      n = 3;
+    }
+    else
+    {
+      out[0] = char(0xF0 | (c >> 18));
+      out[1] = char(0x80 | ((c >> 12) & 0x3F));
+      out[2] = char(0x80 | ((c >> 6) & 0x3F));
+      n = 4;
+    }
+    out[n-1] = char(0x80 | (c & 0x3F));
+    buf.append (out, n);
+    return n;
+  }
+
+
+  std::string
+  unescapeText (const std::string& value)
+  {
+    static const char* entities[][2] = {
+      { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" },
+      { "&apos;", "'" }, { "&quot;", "\"" }
+    };
+    std::string text;
+    std::string::size_type i = 0;
+    while (i < value.length())
+    {
+      std::string::size_type amp = value.find ('&', i);
+      if (amp == std::string::npos)
+	amp = value.length();
+      text.append (value, i, amp - i);
+      if (amp == value.length())
+	break;
+      i = amp;
+      unsigned int e = 0;
+      while (e < 5 && value.compare (i, strlen (entities[e][0]),
+				     entities[e][0]) != 0)
+	++e;
+      std::string::size_type semi = value.find (';', i);
+      if (e < 5)
+      {
+	text += entities[e][1];
+	i += strlen (entities[e][0]);
+      }
+      else if (value.compare (i, 2, "&#") == 0 && semi != std::string::npos)
+      {
+	// A numeric character reference, in decimal or hex.
+	bool hex = (i + 2 < value.length() && value[i+2] == 'x');
+	std::string digits = value.substr (i + 2 + hex, semi - i - 2 - hex);
+	char* end = 0;
+	unsigned long c = strtoul (digits.c_str(), &end, hex ? 16 : 10);
+	if (digits.empty() || *end)
+	{
+	  text += value[i++];
+	  continue;
+	}
+	appendUtf8 (text, c);
+	i = semi + 1;
+      }
+      else
+	text += value[i++];
+    }
+    return text;
+  }
+
+
+  XmlWriter::
+  XmlWriter (std::string& out) :
+    _string (&out),
+    _stream (0),
+    _fd (-1),
+    _depth (0),
+    _pending (false),
+    _inline (false),
+    _error (false)
+  {
+  }
+
+
+  XmlWriter::
+  XmlWriter (std::ostream& out) :
+    _string (0),
+    _stream (&out),
+    _fd (-1),
+    _depth (0),
+    _pending (false),
+    _inline (false),
+    _error (false)
+  {
+    _block.reserve (BLOCK_SIZE);
+  }
+
+
+  XmlWriter::
+  XmlWriter (int fd) :
+    _string (0),
+    _stream (0),
+    _fd (fd),
+    _depth (0),
+    _pending (false),
+    _inline (false),
+    _error (false)
+  {
+    _block.reserve (BLOCK_SIZE);
+  }
+
+
+  XmlWriter::
+  ~XmlWriter ()
+  {
+    flush();
+  }
+
+
+  std::string&
+  XmlWriter::
+  nameSlot ()
+  {
+    if (_open.size() <= _depth)
+      _open.resize (_depth + 1);
+    return _open[_depth];
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  openElement ()
+  {
+    std::string& buf = buffer();
+    if (_pending)
+      buf += ">\n";
+    indent (buf, _depth);
+    buf += '<';
+    buf += _open[_depth];
+    ++_depth;
+    _pending = true;
+    _inline = false;
+    return *this;
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  startElement (const std::string& name)
+  {
+    nameSlot().assign (name);
+    return openElement();
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  startElement (const XMLCh* name)
+  {
+    std::string& slot = nameSlot();
+    slot.clear();
+    appendEscaped (slot, name, false);
+    return openElement();
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  attribute (const std::string& name, const std::string& value)
+  {
+    if (! _pending)
+    {
+      _error = true;
+      return *this;
+    }
+    std::string& buf = buffer();
+    buf += ' ';
+    buf += name;
+    buf += "='";
+    appendEscaped (buf, value.data(), value.length(), true);
+    buf += '\'';
+    return *this;
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  attribute (const XMLCh* name, const XMLCh* value)
+  {
+    if (! _pending)
+    {
+      _error = true;
+      return *this;
+    }
+    std::string& buf = buffer();
+    buf += ' ';
+    appendEscaped (buf, name, false);
+    buf += "='";
+    appendEscaped (buf, value, true);
+    buf += '\'';
+    return *this;
+  }
+
+
+  void
+  XmlWriter::
+  indent (std::string& buf, unsigned int depth)
+  {
+    buf.append (2*depth, ' ');
+  }
+
+
+  void
+  XmlWriter::
+  finishText (std::string::size_type start, std::string::size_type length)
+  {
+    // Long text goes on its own line between the element tags, the same
+    // test domToStream() makes.
+    unsigned int depth = _depth ? _depth - 1 : 0;
+    if (length + 2*depth > 72)
+    {
+      std::string& buf = buffer();
+      buf.insert (start, 1, '\n');
+      buf.insert (start + 1, 2*depth, ' ');
+      buf += '\n';
+      _inline = false;
+    }
+    else
+    {
+      _inline = true;
+    }
+    checkBlock();
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  text (const std::string& text)
+  {
+    std::string& buf = buffer();
+    if (_pending)
+      buf += '>';
+    _pending = false;
+    std::string::size_type start = buf.length();
+    appendEscaped (buf, text.data(), text.length(), false);
+    finishText (start, text.length());
+    return *this;
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  text (const XMLCh* text)
+  {
+    std::string& buf = buffer();
+    if (_pending)
+      buf += '>';
+    _pending = false;
+    std::string::size_type start = buf.length();
+    finishText (start, appendEscaped (buf, text, false));
+    return *this;
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  endElement ()
+  {
+    if (_depth == 0)
+    {
+      _error = true;
+      return *this;
+    }
+    --_depth;
+    std::string& buf = buffer();
+    if (_pending)
+    {
+      buf += "/>\n";
+    }
+    else
+    {
+      if (! _inline)
+	indent (buf, _depth);
+      buf += "</";
+      buf += _open[_depth];
+      buf += ">\n";
+    }
+    _pending = false;
+    _inline = false;
+    checkBlock();
+    return *this;
+  }
+
+
+  XmlWriter&
+  XmlWriter::
+  node (DOMNode* element)
+  {
+    if (element && element->getNodeType() == DOMNode::DOCUMENT_NODE)
+      element = static_cast<DOMDocument*>(element)->getDocumentElement();
+    if (! element)
+      return *this;
+
+    startElement (element->getNodeName());
+    xercesc::DOMNamedNodeMap* attmap = element->getAttributes();
+    for (XMLSize_t i = 0; attmap != 0 && i < attmap->getLength(); ++i)
+    {
+      DOMNode* attnode = attmap->item (i);
+      attribute (attnode->getNodeName(), attnode->getNodeValue());
+    }
+    DOMNode* child = element->getFirstChild();
+    for ( ; child; child = child->getNextSibling())
+    {
+      short type = child->getNodeType();
+      if (type == DOMNode::TEXT_NODE || type == DOMNode::CDATA_SECTION_NODE)
+	text (child->getNodeValue());
+      else if (type == DOMNode::ELEMENT_NODE)
+	node (child);
+    }
+    return endElement();
+  }
+
+
+  bool
+  XmlWriter::
+  flush ()
+  {
+    if (_string || _block.empty())
+      return ! _error;
+    if (_stream)
+    {
+      if (! _stream->write (_block.data(), _block.length()))
+	_error = true;
+    }
+    else
+    {
+      const char* p = _block.data();
+      std::string::size_type left = _block.length();
+      while (left > 0 && ! _error)
+      {
+	ssize_t n = ::write (_fd, p, left);
+	if (n < 0 && errno == EINTR)
+	  continue;
+	if (n <= 0)
+	{
+	  _error = true;
+	  break;
+	}
+	p += n;
+	left -= n;
+      }
+    }
+    _block.clear();
+    return ! _error;
+  }
+
+
+
   string 
   ErrorFormatter::warning(const SAXParseException& toCatch)
   {
@@ -2,20 +2,10 @@
 // $Id$
 //
 
-#include "domx/XmlObjectCatalog.h"
-#include "domx/XmlObjectNode.h"
+#include "XmlObjectCatalogP.h"
 
 #include "logx/Logging.h"
 #include "logx/system_error.h"
-#include "logx/EventSource.h"
-#include <stdio.h>
-#include <unistd.h>    // for unlink()
-#include <sys/errno.h>
-#include <sys/types.h>
-#include <dirent.h>
-
-#include <fstream>
-#include <sstream>
 
 LOGGING("XmlObjectCatalog");
 
@@ -24,84 +14,71 @@ using std::string;
 
 using logx::system_error;
 
+
 namespace domx
 {
-
-  struct XmlObjectCatalogP : public XmlObjectInterface
+  /**
+   * The state of an XmlObjectCatalogIterator.  The reader thread loads the
+   * keys in order onto @c ready, staying at most @c window objects ahead
+   * of next(), which has taken the first @c delivered.  The lock protects
+   * everything but the keys, and the condition signals any change.
+   **/
+  struct XmlObjectCatalogIteratorP
   {
-    XmlObjectNode* _xi;
-    XmlObjectMember<string> _name;
-    XmlObjectMember<string> _path;
-    XmlObjectCatalog* _that;
-
-    // Note that root is not preserved, so that root can change as the
-    // catalog is migrated between systems, and since specifying root would
-    // be superfluous, as its already known by the time the catalog is
-    // opened.
-    string _root;
-    logx::EventSource<XmlObjectCatalogP> failures;
-
-    // Current state, which determines which operations are allowed.
-    enum { CLOSED, OPEN } _state;
-
-    XmlObjectCatalogP (XmlObjectCatalog* that) :
-      _xi (newNode("xmlobjectcatalog")),
-      _name (_xi, "name"),
-      _path (_xi, "path"),
-      _that (that),
-      failures (this, &XmlObjectCatalogP::fail)
+    struct Slot
     {
-      _state = CLOSED;
-    }
+      string key;
+      XmlObjectInterface object;
+      bool loaded;
+    };
+
+    XmlObjectCatalogP* cp;
+    std::vector<string> keys;
+    unsigned int fetched;
+    unsigned int delivered;
+    unsigned int window;
+    std::list<Slot*> ready;
+    bool threaded;
+    bool stopping;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    Slot*
+    load (unsigned int i);
+
+    static void*
+    readMain (void* arg);
+  };
 
-    void
-    setPath (const std::string& path)
-    {
-      // Keep the fully qualified path as the name.
-      _path = path;
-      _name = path;
-      _root = XmlObjectCatalog::rootCatalogDirectory();
-    }
+  /**
+   * The state of an XmlObjectCatalogWatch: the inotify descriptor, the
+   * directory each watch descriptor is on, relative to the catalog
+   * directory, and the keys known to exist as of the changes reported so
+   * far.
+   **/
+  struct XmlObjectCatalogWatchP
+  {
+    XmlObjectCatalog* catalog;
+    XmlObjectCatalogP* cp;
+    int fd;
+    std::map<int, string> dirs;
+    XmlObjectCatalog::key_set_t keys;
+
+    XmlObjectCatalogWatchP () :
+      catalog (0),
+      cp (0),
+      fd (-1)
+    {}
 
     bool
-    isOpen ()
-    {
-      return _state == OPEN;
-    }
-
-    void
-    fail (const std::string& msg)
-    {
-      // For now we only log the failure and queue it.  Someday
-      // we could enable exceptions on failures.
-      //
-      ELOG << msg;
-      if (_errors.size() >= _that->MAX_PENDING_ERRORS)
-      {
-	std::vector<string>::iterator it =_errors.begin();
-	_errors.erase (it, it+(_errors.size()-_that->MAX_PENDING_ERRORS)+1);
-      }
-      _errors.push_back (msg);
-    }
+    addWatch (const std::string& dir);
 
     bool
-    verifyDirectory ();
-
-    string
-    objectPath(const std::string& id)
-    {
-      return getDirectory() + "/" + id + ".xml";
-    }
-
-    string
-    getDirectory()
-    {
-      return _root + "/" + _path();
-    }
-
-    // Error queue.
-    std::vector<string> _errors;
+    resync (std::map<string, bool>& present);
 
+    void
+    close ();
   };
 
 }
@@ -110,6 +87,85 @@ namespace domx
 namespace
 {
   std::string ROOT_DIRECTORY;
+
+  // Catalog directories which have already been verified or created,
+  // keyed by full path.  Each has descriptors which stay open as long as
+  // the path names that directory or a catalog still uses them, and are
+  // shared by every catalog opened on that directory, so reopening a
+  // catalog is just a lookup and a stat of the path.
+  typedef std::map<std::string, CatalogDirectory*> directory_cache_t;
+  directory_cache_t DIRECTORY_CACHE;
+  pthread_mutex_t DIRECTORY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+  // The objects of the memory catalogs, keyed by catalog name, which last
+  // as long as the process.  The directory lock protects the map.
+  typedef std::map<std::string, MemoryStore*> memory_cache_t;
+  memory_cache_t MEMORY_CACHE;
+
+  LoadCache LOAD_CACHE;
+
+  // How many files each io_uring submission covers, and whether bulk
+  // reads go through io_uring at all.
+  const unsigned int URING_BATCH = 64;
+#ifdef DOMX_HAVE_LIBURING
+  bool URING_ENABLED = true;
+#endif
+
+  // Close every descriptor of a cache entry and delete it.
+  void
+  freeDirectory (CatalogDirectory* cd)
+  {
+    close (cd->fd);
+    for (unsigned int i = 0; i < cd->shards.size(); ++i)
+    {
+      close (cd->shards[i]);
+    }
+    std::map<string, int>::iterator pt;
+    for (pt = cd->partitions.begin(); pt != cd->partitions.end(); ++pt)
+    {
+      close (pt->second);
+    }
+    for (unsigned int i = 0; i < cd->retired.size(); ++i)
+    {
+      close (cd->retired[i]);
+    }
+    delete cd;
+  }
+
+  // Give up one use of @p cd, freeing it if that was the last and the
+  // directory has left the cache.  The lock must be held.
+  void
+  releaseDirectory (CatalogDirectory* cd)
+  {
+    if (--cd->users == 0 && ! cd->cached)
+      freeDirectory (cd);
+  }
+
+  // Return the cache entry for @p dir, or null if there is none or the
+  // path no longer names the directory which was cached, such as when it
+  // has been removed and created again or something has been mounted
+  // over it.  The lock must be held.
+  CatalogDirectory*
+  cachedDirectory (const std::string& dir)
+  {
+    directory_cache_t::iterator it = DIRECTORY_CACHE.find (dir);
+    if (it == DIRECTORY_CACHE.end())
+      return 0;
+    CatalogDirectory* cd = it->second;
+    struct stat cached, current;
+    if (fstat (cd->fd, &cached) == 0 && stat (dir.c_str(), &current) == 0 &&
+	cached.st_dev == current.st_dev && cached.st_ino == current.st_ino)
+    {
+      return cd;
+    }
+    // Forget the stale directory, and free it now unless catalogs still
+    // hold its descriptors.
+    DIRECTORY_CACHE.erase (it);
+    cd->cached = false;
+    if (cd->users == 0)
+      freeDirectory (cd);
+    return 0;
+  }
 }
 
 
@@ -151,32 +207,28 @@ bool
 XmlObjectCatalog::
 open(const std::string& path)
 {
-  // Make sure the parent catalogs can be opened or created.
-  string::size_type slash = path.rfind ('/');
-  if (slash != string::npos)
-  {
-    XmlObjectCatalog parent;
-    string pname = path.substr(0, slash);
-    if (!parent.open (pname))
-    {
-      _mp->failures() << "could not open " 
-		      << pname << ": " << parent.lastError();
-      return false;
-    }
-  }
+  // Reopening replaces the directory descriptor, which the background
+  // sync thread must not be using meanwhile.
+  _mp->_state = XmlObjectCatalogP::CLOSED;
+  _mp->stopWriter();
+  _mp->stopSyncer();
+  _mp->stopCompactor();
+  _mp->stopFolder();
+  _mp->stopMerger();
+  _mp->closeDirectory();
   _mp->setPath (path);
 
-  // Try to create this directory or verify that the
-  // directory exists, but only this once.  If it doesn't
-  // exist after this, then all other operations on the
-  // catalog will fail.
+  // Find or create this directory and any parent catalog directories,
+  // but only this once.  If it doesn't exist after this, then all other
+  // operations on the catalog will fail.
   //
-  if (_mp->verifyDirectory())
-  {
-    _mp->_state = XmlObjectCatalogP::OPEN;
-    return true;
-  }
-  return false;
+  if (! _mp->openDirectory())
+    return false;
+
+  _mp->_state = XmlObjectCatalogP::OPEN;
+  if (_mp->_durability == SYNC_PERIODIC)
+    _mp->startSyncer();
+  return true;
 }
 
 
@@ -193,7 +245,33 @@ open (XmlObjectCatalog& parent, const std::string& name)
   }
   // Append the given name to the parent's path to get the full path
   // of the catalog being opened.
-  return open (parent._mp->_path() + "/" + name);
+  return open (parent._mp->_path + "/" + name);
+}
+
+
+bool
+XmlObjectCatalog::
+openMemory (const std::string& name)
+{
+  _mp->_state = XmlObjectCatalogP::CLOSED;
+  _mp->stopSyncer();
+  _mp->stopCompactor();
+  _mp->stopFolder();
+  _mp->stopMerger();
+  _mp->closeDirectory();
+  _mp->setPath (name);
+  // There is no directory, but the name still identifies the catalog in
+  // messages and in the load() cache.
+  _mp->_directory = "memory:" + name;
+
+  pthread_mutex_lock (&DIRECTORY_LOCK);
+  MemoryStore*& store = MEMORY_CACHE[name];
+  if (! store)
+    store = new MemoryStore;
+  pthread_mutex_unlock (&DIRECTORY_LOCK);
+  _mp->_backend = new CatalogMemory (_mp, store);
+  _mp->_state = XmlObjectCatalogP::OPEN;
+  return true;
 }
 
 
@@ -209,7 +287,10 @@ registerCatalog()
 		    << syscat.lastError();
     return false;
   }
-  if (! syscat.insert (dotName(), _mp))
+  XmlObjectCatalogEntry entry;
+  entry.Name = _mp->_name;
+  entry.Path = _mp->_path;
+  if (! syscat.insert (dotName(), &entry))
   {
     _mp->failures() << "registering " << name()
 		    << ": insert failed: " << syscat.lastError();
@@ -224,7 +305,7 @@ std::string
 XmlObjectCatalog::
 name()
 {
-  return _mp->_path();
+  return _mp->_path;
 }
 
 
@@ -250,226 +331,3070 @@ isOpen()
 }
 
 
-bool
-XmlObjectCatalogP::
-verifyDirectory ()
+void
+XmlObjectCatalog::
+setDurability (EnumDurability mode, unsigned int seconds)
 {
-  string spath(getDirectory());
-  const char* path = spath.c_str();
-  struct stat sbuf;
-  int result = ::mkdir (path, 0775);
-  if (result == 0)
-  {
-    DLOG << "created directory: " << path;
-  }
-  else if (errno != EEXIST)
-  {
-    failures() << system_error("creating directory", path);
-    return false;
-  }
-  // Make sure the entry that exists is a directory
-  if (stat (path, &sbuf) < 0)
+  _mp->flushInserts();
+  if (mode != SYNC_PERIODIC)
   {
-    failures() << system_error("checking with stat()", path);
-    return false;
+    _mp->stopSyncer();
   }
-  if (! S_ISDIR(sbuf.st_mode))
+  _mp->_durability = mode;
+  if (mode == SYNC_PERIODIC)
   {
-    failures() << path << " is not a directory!";
-    return false;
+    pthread_mutex_lock (&_mp->_sync_lock);
+    _mp->_sync_period = (seconds > 0) ? seconds : 1;
+    pthread_mutex_unlock (&_mp->_sync_lock);
+    // The thread needs the catalog directory, so a closed catalog starts
+    // it when it is opened.
+    if (isOpen())
+      _mp->startSyncer();
   }
-  return true;
 }
 
 
+void
+XmlObjectCatalog::
+setSkipUnchanged (bool enable)
+{
+  _mp->flushInserts();
+  _mp->_skip_unchanged = enable;
+}
+
+
+void
+XmlObjectCatalog::
+setAsyncInsert (unsigned int window_ms)
+{
+  if (window_ms == 0)
+    _mp->stopWriter();
+  pthread_mutex_lock (&_mp->_insert_lock);
+  _mp->_async_window = window_ms;
+  pthread_mutex_unlock (&_mp->_insert_lock);
+}
+
 
 bool
 XmlObjectCatalog::
-insert (const std::string& id, XmlObjectInterface* object)
+flush ()
 {
-  if (! isOpen())
-    return false;
+  return _mp->flushInserts();
+}
 
-  if (id.length() == 0)
+
+XmlObjectCatalog::EnumDurability
+XmlObjectCatalog::
+durability()
+{
+  return _mp->_durability;
+}
+
+
+bool
+XmlObjectCatalogP::
+openDirectory ()
+{
+  std::vector<string> parts;
+  string::size_type start = 0;
+  while (start <= _path.length())
   {
-    _mp->failures() << "Cannot insert an object with an empty name.";
-    return false;
+    string::size_type slash = _path.find ('/', start);
+    if (slash == string::npos)
+      slash = _path.length();
+    if (slash > start)
+      parts.push_back (_path.substr (start, slash - start));
+    start = slash + 1;
   }
 
-  // Assemble two file names for this object from our path
-  // and from the name: one is the final name and one is the
-  // temporary name.
-  string filepath = _mp->objectPath(id);
-  string tmpfilepath = filepath + "-temp";
-
-  std::ofstream out (tmpfilepath.c_str());
+  pthread_mutex_lock (&DIRECTORY_LOCK);
 
-  if (! out)
+  // Start from the deepest directory along the path which is already
+  // known, usually the catalog directory itself.
+  std::vector<string> dirs (1, _root);
+  for (unsigned int i = 0; i < parts.size(); ++i)
   {
-    _mp->failures() << system_error("opening", tmpfilepath);
-    return false;
+    dirs.push_back (dirs.back() + "/" + parts[i]);
+  }
+  int level = parts.size();
+  CatalogDirectory* cd = 0;
+  for ( ; level >= 0 && !cd; --level)
+  {
+    cd = cachedDirectory (dirs[level]);
+  }
+  ++level;
+  int fd = cd ? cd->fd : -1;
+  if (fd < 0)
+  {
+    level = 0;
+    fd = ::open (_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      pthread_mutex_unlock (&DIRECTORY_LOCK);
+      failures() << system_error("opening catalog root", _root);
+      return false;
+    }
+    cd = new CatalogDirectory (fd);
+    DIRECTORY_CACHE[_root] = cd;
   }
-  object->toXML (out);
-  out.close();
 
-  // Now we can 'insert' the temporary file into the catalog
-  // with the atomic rename() function.
-  int result = rename (tmpfilepath.c_str(), filepath.c_str());
-  if (result < 0)
+  // Create or verify the rest of the path one level at a time, relative
+  // to the level above, like mkdir -p.
+  for ( ; level < (int)parts.size(); ++level)
   {
-    _mp->failures() << system_error("renaming", tmpfilepath);
-    unlink (tmpfilepath.c_str());
-    return false;
+    const char* name = parts[level].c_str();
+    const char* path = dirs[level+1].c_str();
+    if (mkdirat (fd, name, 0775) == 0)
+    {
+      DLOG << "created directory: " << path;
+    }
+    else if (errno != EEXIST)
+    {
+      pthread_mutex_unlock (&DIRECTORY_LOCK);
+      failures() << system_error("creating directory", path);
+      return false;
+    }
+    // Make sure the entry that exists is a directory
+    fd = openat (fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      pthread_mutex_unlock (&DIRECTORY_LOCK);
+      if (errno == ENOTDIR)
+	failures() << path << " is not a directory!";
+      else
+	failures() << system_error("opening directory", path);
+      return false;
+    }
+    cd = new CatalogDirectory (fd);
+    DIRECTORY_CACHE[dirs[level+1]] = cd;
   }
-  return true;
+  _dirfd = fd;
+  bool ok = loadLayout (cd);
+  if (ok)
+  {
+    _cache = cd;
+    ++cd->users;
+    _shards = cd->shards;
+    _partitioning = cd->partitioning;
+  }
+  bool segmented = ok && cd->segmented;
+  pthread_mutex_unlock (&DIRECTORY_LOCK);
+  if (segmented)
+  {
+    _segments = new CatalogSegments (this, _dirfd, _directory);
+    _backend = _segments;
+    ok = _segments->open();
+  }
+  else if (ok)
+  {
+    _backend = new CatalogFiles (this);
+  }
+  ok = ok && openJournal() && openSummary() && openIndexes (false);
+  if (! ok)
+    closeDirectory();
+  return ok;
 }
 
 
+void
+XmlObjectCatalogP::
+closeDirectory ()
+{
+  // The descriptors stay open in the directory cache, unless this was
+  // the last use of a directory which has since been removed.
+  delete _backend;
+  _backend = 0;
+  _segments = 0;
+  if (_journal_fd >= 0)
+    close (_journal_fd);
+  _journal_fd = -1;
+  if (_summary_fd >= 0)
+    close (_summary_fd);
+  _summary_fd = -1;
+  closeIndexes();
+  if (_index_fd >= 0)
+    close (_index_fd);
+  _index_fd = -1;
+  if (_cache)
+  {
+    pthread_mutex_lock (&DIRECTORY_LOCK);
+    releaseDirectory (_cache);
+    pthread_mutex_unlock (&DIRECTORY_LOCK);
+  }
+  _dirfd = -1;
+  _shards.clear();
+  _partitioning = XmlObjectCatalog::PARTITION_NONE;
+  _cache = 0;
+}
+
 
 bool
-XmlObjectCatalog::
-remove (const std::string& id)
+XmlObjectCatalogP::
+loadLayout (CatalogDirectory* cd)
 {
-  if (! isOpen())
+  // A catalog is flat unless a layout file says how many shards it has
+  // or how it is partitioned.  The directory lock must be held.
+  if (cd->layout)
     return true;
-
-  string path = _mp->objectPath(id);
-  int result = unlink (path.c_str());
-  if (result < 0 && errno != ENOENT)
+  struct stat sbuf;
+  string text;
+  cd->segmented = (fstatat (cd->fd, SEGMENT_FILE, &sbuf, 0) == 0);
+  if (fstatat (cd->fd, PARTITION_FILE, &sbuf, 0) == 0 || errno != ENOENT)
+  {
+    if (! readFile (cd->fd, PARTITION_FILE, text, 0))
+      return false;
+    if (text == "day\n")
+      cd->partitioning = XmlObjectCatalog::PARTITION_DAY;
+    else if (text == "hour\n")
+      cd->partitioning = XmlObjectCatalog::PARTITION_HOUR;
+    else
+    {
+      failures() << "bad partitioning in " << fullPath(PARTITION_FILE);
+      return false;
+    }
+  }
+  if (fstatat (cd->fd, SHARD_FILE, &sbuf, 0) < 0 && errno == ENOENT)
   {
-    _mp->failures() << system_error("unlink", path);
+    cd->layout = true;
+    return true;
+  }
+  if (! readFile (cd->fd, SHARD_FILE, text, 0))
+    return false;
+  unsigned int nshards = 0;
+  std::istringstream in (text);
+  if (! (in >> nshards))
+  {
+    failures() << "bad shard count in " << fullPath(SHARD_FILE);
     return false;
   }
+  if (! openShards (cd->fd, nshards, cd->shards))
+    return false;
+  cd->layout = true;
   return true;
 }
 
 
-#ifdef notdef
-bool
-XmlObjectCatalog::
-move (const std::string& id, XmlObjectCatalog* dest)
+int
+XmlObjectCatalogP::
+partitionDir (const std::string& name, bool create)
 {
-  if (! isOpen())
-    return false;
-
-  if (! dest->isOpen())
+  bool created = false;
+  pthread_mutex_lock (&DIRECTORY_LOCK);
+  std::map<string, int>& parts = _cache->partitions;
+  std::map<string, int>::iterator it = parts.find (name);
+  int fd = -1;
+  if (it != parts.end())
   {
-    _mp->failures() << "move: destination catalog '" 
-		    << dest->name() << "' is not open.";
-    return false;
+    fd = it->second;
+  }
+  else
+  {
+    fd = openat (_dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && create)
+    {
+      created = (mkdirat (_dirfd, name.c_str(), 0775) == 0);
+      if (created || errno == EEXIST)
+	fd = openat (_dirfd, name.c_str(),
+		     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd >= 0)
+      parts[name] = fd;
+    else if (errno != ENOENT || create)
+      failures() << system_error("opening partition", fullPath(name));
   }
+  pthread_mutex_unlock (&DIRECTORY_LOCK);
 
-  return true;
+  // A new partition is only durable once the catalog directory is synced.
+  if (created && _durability == XmlObjectCatalog::SYNC_FULL &&
+      ! syncDirectory (_dirfd))
+  {
+    return -1;
+  }
+  return fd;
 }
-#endif
 
 
 bool
-XmlObjectCatalog::
-load (const std::string& id, XmlObjectInterface* object)
+XmlObjectCatalogP::
+partitionDirs (const std::string& from, const std::string& to,
+	       std::vector<int>& dirs)
 {
-  if (! isOpen())
+  // A partition holds every key which starts with its prefix, so it can
+  // only hold keys in [from, to) if the prefix is below @p to and not
+  // below the same length prefix of @p from.
+  std::vector<string> names;
+  if (! listEntries (_dirfd, ".part-", names))
     return false;
-
-  // Just try to open the file.  If we can't then maybe it's just not there.
-  string opath = _mp->objectPath(id);
-  std::ifstream in (opath.c_str());
-  if (! in)
+  for (unsigned int i = 0; i < names.size(); ++i)
   {
-    if (errno == ENOENT)
-      return false;
-    _mp->failures() << system_error("loading ", opath);
-    return false;
+    string prefix = names[i].substr (6);
+    if (prefix < from.substr (0, prefix.length()))
+      continue;
+    if (to.length() && prefix >= to)
+      continue;
+    int fd = partitionDir (names[i], false);
+    if (fd >= 0)
+      dirs.push_back (fd);
   }
-  // Now just load it up.
-  std::ostringstream buffer;
-  buffer << in.rdbuf();
-  return object->fromXML (buffer.str());
+  return true;
 }
 
 
 bool
-XmlObjectCatalog::
-keys(key_set_t& kset)
+XmlObjectCatalogP::
+listEntries (int dirfd, const std::string& prefix,
+	     std::vector<std::string>& names)
 {
-  kset.erase (kset.begin(), kset.end());
-  if (! isOpen())
-    return false;
-
-  string path = _mp->getDirectory();
-  DIR* dir = opendir (path.c_str());
+  int fd = openat (dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR* dir = (fd >= 0) ? fdopendir (fd) : 0;
   if (! dir)
   {
-    _mp->failures() << system_error("keys(): opening catalog directory", path);
+    failures() << system_error("opening catalog directory", dirPath(dirfd));
+    if (fd >= 0)
+      close (fd);
     return false;
   }
-
   struct dirent* entry;
   while ((entry = readdir(dir)) != 0)
   {
-    // Only match ?*.xml entries.
     string dname(entry->d_name);
-    if (dname.length() > 4 && dname.substr(dname.length()-4) == ".xml")
-      kset.insert(dname.substr(0, dname.length()-4));
+    if (dname.compare (0, prefix.length(), prefix) == 0)
+      names.push_back (dname);
   }
-  closedir(dir);
+  closedir (dir);
   return true;
 }
 
 
-#ifdef notdef
 bool
-XmlObjectCatalog::
-exists (const std::string& name)
+XmlObjectCatalogP::
+openShards (int dirfd, unsigned int nshards, std::vector<int>& shards)
 {
-  if (! isOpen())
-    return false;
-
-  return false;
+  std::vector<int> fds;
+  for (unsigned int i = 0; i < nshards; ++i)
+  {
+    string name = shardName(i);
+    int fd = -1;
+    if (mkdirat (dirfd, name.c_str(), 0775) == 0 || errno == EEXIST)
+      fd = openat (dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      failures() << system_error("opening shard", fullPath(name));
+      for (unsigned int j = 0; j < fds.size(); ++j)
+	close (fds[j]);
+      return false;
+    }
+    fds.push_back (fd);
+  }
+  shards.swap (fds);
+  return true;
 }
-#endif
 
 
-int
-XmlObjectCatalog::
-errorsPending()
+
+bool
+XmlObjectCatalogP::
+serialize (const std::string& id, XmlObjectInterface* object,
+	   std::string& text)
 {
-  return _mp->_errors.size();
+  text.clear();
+  XmlWriter out (text);
+  if (! object->toXML (out))
+  {
+    failures() << "could not serialize object " << id;
+    return false;
+  }
+  return true;
 }
 
 
-std::vector<std::string>
-XmlObjectCatalog::
-getErrors()
+bool
+XmlObjectCatalogP::
+putObjects (const XmlObjectCatalog::object_list_t& objects, bool batch,
+	    bool absent, const XmlObjectCatalog::ObjectVersion* expected)
 {
-  return _mp->_errors;
+  // Serialize the whole object first so it can be stored with a single
+  // write().
+  CatalogBackend::text_list_t texts (objects.size());
+  for (unsigned int i = 0; i < objects.size(); ++i)
+  {
+    texts[i].first = objects[i].first;
+    if (objects[i].first.length() == 0)
+    {
+      failures() << "Cannot insert an object with an empty name.";
+      return false;
+    }
+    if (! serialize (objects[i].first, objects[i].second, texts[i].second))
+      return false;
+  }
+  return putTexts (texts, batch, absent, expected);
 }
 
 
-void
-XmlObjectCatalog::
-clearErrors()
+bool
+XmlObjectCatalogP::
+putTexts (const CatalogBackend::text_list_t& texts, bool batch,
+	  bool absent, const XmlObjectCatalog::ObjectVersion* expected)
 {
-  _mp->_errors.erase(_mp->_errors.begin(), _mp->_errors.end());
+  if (_skip_unchanged && ! batch && ! absent && ! expected &&
+      texts.size() == 1 && _backend->unchanged (texts[0].first,
+						texts[0].second))
+  {
+    return true;
+  }
+  // The summary and index records carry the version each text was
+  // stored as, so the records of racing inserts can land in any order.
+  std::vector<XmlObjectCatalog::ObjectVersion> versions;
+  std::vector<string> keys;
+  for (unsigned int i = 0; i < texts.size(); ++i)
+  {
+    keys.push_back (texts[i].first);
+  }
+  if (! _backend->put (texts, batch, absent, expected, &versions))
+  {
+    // Whatever landed of a failed put is found by reading it back.
+    if (_index_fd >= 0)
+      indexKeys (keys);
+    return false;
+  }
+  if (_segments && _segments->needsCompaction())
+    startCompactor();
+  // The objects are stored, so each log gets its record whether or not
+  // another one failed, and any failure is still reported.
+  bool ok = indexTexts (texts, versions);
+  if (_summary_fd >= 0)
+    ok = summarize ('I', texts, versions) && ok;
+  if (_journal_fd >= 0)
+    ok = journal (XmlObjectCatalog::JOURNAL_INSERT, keys) && ok;
+  return ok;
 }
 
 
-std::string
-XmlObjectCatalog::
-lastError()
+string
+XmlObjectCatalogP::
+escapeField (const std::string& text)
 {
-  if (errorsPending())
+  // Escape the escape character and the control characters, which
+  // include the tab and newline that separate the fields and lines of
+  // index files and journal records.  Nothing escaped sorts before a
+  // tab, so the lines of a sorted file are in order by value and then by
+  // key.
+  string field;
+  for (string::size_type i = 0; i < text.length(); ++i)
   {
-    return _mp->_errors.back();
+    unsigned char c = text[i];
+    if (c == '%' || c < ' ')
+    {
+      char hex[4];
+      snprintf (hex, sizeof(hex), "%%%02X", c);
+      field += hex;
+    }
+    else
+      field += c;
   }
-  return "";
+  return field;
 }
 
 
-XmlObjectCatalog::
-~XmlObjectCatalog()
+string
+XmlObjectCatalogP::
+unescapeField (const std::string& name)
+{
+  string key;
+  for (string::size_type i = 0; i < name.length(); ++i)
+  {
+    unsigned int c;
+    if (name[i] == '%' && sscanf (name.c_str() + i + 1, "%2X", &c) == 1)
+    {
+      key += char(c);
+      i += 2;
+    }
+    else
+      key += name[i];
+  }
+  return key;
+}
+
+
+bool
+XmlObjectCatalogP::
+readLine (int fd, off_t offset, std::string& line)
+{
+  // Read from @p offset through the next newline.  Returns false with
+  // errno 0 at the end of the file or without a newline before it.
+  line.clear();
+  char buf[256];
+  while (true)
+  {
+    ssize_t n = pread (fd, buf, sizeof(buf), offset + line.length());
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      if (n == 0)
+	errno = 0;
+      return false;
+    }
+    const char* nl = (const char*)memchr (buf, '\n', n);
+    line.append (buf, nl ? nl - buf + 1 : n);
+    if (nl)
+      return true;
+  }
+}
+
+
+bool
+XmlObjectCatalogP::
+writeText (const std::string& id, const std::string& text,
+	   CatalogTempFile& tmp)
+{
+  tmp.data = text;
+  tmp.dirfd = objectDir(id, true);
+  if (tmp.dirfd < 0)
+    return false;
+
+#ifdef O_TMPFILE
+  // An O_TMPFILE file has no directory entry at all until it is linked
+  // into place, so nothing is left behind if we fail before then.
+  if (useTmpfile())
+  {
+    tmp.fd = openat (tmp.dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (tmp.fd < 0 &&
+	(errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+    {
+      DLOG << "O_TMPFILE not supported in " << dirPath(tmp.dirfd)
+	   << ", using named temporary files";
+      noTmpfile();
+    }
+    else if (tmp.fd < 0)
+    {
+      failures() << system_error("opening temporary file in",
+				 dirPath(tmp.dirfd));
+      return false;
+    }
+  }
+#endif
+  if (tmp.fd < 0 && ! openNamedTemp (objectName(id), tmp))
+    return false;
+  if (! writeData (tmp))
+    return false;
+  stampTemp (tmp);
+  return true;
+}
+
+
+void
+XmlObjectCatalogP::
+stampTemp (CatalogTempFile& tmp)
+{
+  // Record the version the written object file will be published as.
+  // Neither the fingerprint attribute nor the link or rename which
+  // publishes the file changes its modification time, so the time taken
+  // here is the one a later insert finds unless the file is written
+  // again.  The fingerprint is only a shortcut for skipping unchanged
+  // inserts, so a filesystem without user attributes just goes without.
+  struct stat sbuf;
+  if (fstat (tmp.fd, &sbuf) < 0)
+    return;
+  toVersion (sbuf, tmp.version);
+  if (! useXattr())
+    return;
+  string value = fingerprint (tmp.data, sbuf);
+  if (fsetxattr (tmp.fd, FINGERPRINT_XATTR, value.data(), value.length(),
+		 0) < 0 &&
+      (errno == ENOTSUP || errno == EPERM))
+  {
+    DLOG << "user attributes not supported in " << dirPath(tmp.dirfd)
+	 << ", not storing object fingerprints";
+    noXattr();
+  }
+}
+
+
+bool
+XmlObjectCatalogP::
+openNamedTemp (const std::string& filename, CatalogTempFile& tmp)
+{
+  // The temporary name is the final name with a suffix unique to this
+  // writer, which keeps it out of the key list until it is renamed and
+  // keeps concurrent writers of the same key from sharing a file.  A
+  // clash with a file left by a dead writer just moves on to the next
+  // suffix.
+  for (int tries = 0; tries < 10; ++tries)
+  {
+    tmp.path = filename + uniqueSuffix() + "-temp";
+    tmp.fd = openat (tmp.dirfd, tmp.path.c_str(),
+		     O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (tmp.fd >= 0 || errno != EEXIST)
+      break;
+  }
+  if (tmp.fd < 0)
+  {
+    failures() << system_error("opening", fullPath(tmp.dirfd, tmp.path));
+    tmp.path = "";
+    return false;
+  }
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+writeData (CatalogTempFile& tmp)
+{
+  const char* p = tmp.data.data();
+  size_t left = tmp.data.length();
+  while (left > 0)
+  {
+    ssize_t n = ::write (tmp.fd, p, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      failures() << system_error("writing", fullPath(tmp.dirfd, tmp.path));
+      discardTemp (tmp);
+      return false;
+    }
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+syncTemp (CatalogTempFile& tmp, bool dataonly)
+{
+  int result = dataonly ? fdatasync (tmp.fd) : fsync (tmp.fd);
+  if (result < 0)
+  {
+    failures() << system_error(dataonly ? "fdatasync" : "fsync",
+			       fullPath(tmp.dirfd, tmp.path));
+    discardTemp (tmp);
+    return false;
+  }
+  tmp.synced = dataonly ? 1 : 2;
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+publishTemp (CatalogTempFile& tmp, const std::string& filename)
+{
+  if (tmp.path.length() == 0)
+  {
+    // When there is no object by this name yet, the link alone
+    // publishes it.
+    if (linkAnonymous (tmp, filename))
+    {
+      close (tmp.fd);
+      tmp.fd = -1;
+      return true;
+    }
+    if (errno == EEXIST)
+    {
+      string tmpname;
+      bool linked = false;
+      for (int tries = 0; !linked && tries < 10; ++tries)
+      {
+	tmpname = filename + uniqueSuffix() + "-temp";
+	linked = linkAnonymous (tmp, tmpname);
+	if (!linked && errno != EEXIST)
+	  break;
+      }
+      if (! linked)
+      {
+	failures() << system_error("linking", fullPath(tmp.dirfd, tmpname));
+	discardTemp (tmp);
+	return false;
+      }
+      tmp.path = tmpname;
+    }
+    else if (! rewriteNamed (tmp, filename))
+    {
+      return false;
+    }
+  }
+
+  // Now we can 'insert' the temporary file into the catalog
+  // with the atomic rename() function.
+  if (renameat (tmp.dirfd, tmp.path.c_str(), tmp.dirfd, filename.c_str()) < 0)
+  {
+    failures() << system_error("renaming", fullPath(tmp.dirfd, tmp.path));
+    discardTemp (tmp);
+    return false;
+  }
+  close (tmp.fd);
+  tmp.fd = -1;
+  tmp.path = "";
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+linkAnonymous (CatalogTempFile& tmp, const std::string& filename)
+{
+  // Give the anonymous file a name through its /proc link, since
+  // linkat() with AT_EMPTY_PATH needs privileges.
+  char procpath[64];
+  snprintf (procpath, sizeof(procpath), "/proc/self/fd/%d", tmp.fd);
+  return linkat (AT_FDCWD, procpath, tmp.dirfd, filename.c_str(),
+		 AT_SYMLINK_FOLLOW) == 0;
+}
+
+
+bool
+XmlObjectCatalogP::
+rewriteNamed (CatalogTempFile& tmp, const std::string& filename)
+{
+  // Most likely /proc is not available, so fall back to rewriting the
+  // object under a temporary name, now and from now on.
+  DLOG << "cannot link anonymous file: " << strerror(errno)
+       << ", using named temporary files";
+  noTmpfile();
+  int synced = tmp.synced;
+  close (tmp.fd);
+  tmp.fd = -1;
+  if (! openNamedTemp (filename, tmp) || ! writeData (tmp))
+    return false;
+  stampTemp (tmp);
+  if (synced && ! syncTemp (tmp, synced == 1))
+    return false;
+  return true;
+}
+
+
+void
+XmlObjectCatalogP::
+discardTemp (CatalogTempFile& tmp)
+{
+  if (tmp.fd >= 0)
+    close (tmp.fd);
+  if (tmp.path.length())
+    unlinkat (tmp.dirfd, tmp.path.c_str(), 0);
+  tmp.fd = -1;
+  tmp.path = "";
+}
+
+
+bool
+XmlObjectCatalogP::
+publishNew (CatalogTempFile& tmp, const std::string& filename, bool& existed)
+{
+  // Like publishTemp(), except an existing object is never replaced.
+  existed = false;
+  int result = 0;
+  if (tmp.path.length() == 0 && ! linkAnonymous (tmp, filename))
+  {
+    result = -1;
+    if (errno != EEXIST && rewriteNamed (tmp, filename))
+      result = 0;
+  }
+  if (result == 0 && tmp.path.length())
+  {
+    result = renameNoReplace (tmp.dirfd, tmp.path, filename);
+  }
+  if (result < 0)
+  {
+    existed = (errno == EEXIST);
+    if (! existed)
+      failures() << system_error("publishing",
+				 fullPath(tmp.dirfd, filename));
+    discardTemp (tmp);
+    return false;
+  }
+  close (tmp.fd);
+  tmp.fd = -1;
+  tmp.path = "";
+  return true;
+}
+
+
+int
+XmlObjectCatalogP::
+renameNoReplace (int dirfd, const std::string& from, const std::string& to)
+{
+#ifdef RENAME_NOREPLACE
+  int result = renameat2 (dirfd, from.c_str(), dirfd, to.c_str(),
+			  RENAME_NOREPLACE);
+  if (result == 0 || (errno != EINVAL && errno != ENOSYS))
+    return result;
+#endif
+  // Without renameat2() support, link() gives the same guarantee.
+  if (linkat (dirfd, from.c_str(), dirfd, to.c_str(), 0) < 0)
+    return -1;
+  unlinkat (dirfd, from.c_str(), 0);
+  return 0;
+}
+
+
+void
+XmlObjectCatalogP::
+toVersion (const struct stat& sbuf, XmlObjectCatalog::ObjectVersion& v)
+{
+  v.device = sbuf.st_dev;
+  v.inode = sbuf.st_ino;
+  v.mtime_ns = (long long)sbuf.st_mtim.tv_sec * 1000000000LL +
+    sbuf.st_mtim.tv_nsec;
+  v.size = sbuf.st_size;
+}
+
+
+bool
+XmlObjectCatalogP::
+readObject (const std::string& id, std::string& text,
+	    XmlObjectCatalog::ObjectVersion* version)
+{
+  if (_backend->concurrentReads())
+    return _backend->get (id, text, version);
+  pthread_mutex_lock (&_read_lock);
+  bool ok = _backend->get (id, text, version);
+  pthread_mutex_unlock (&_read_lock);
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+statObject (const std::string& id, XmlObjectCatalog::ObjectVersion& version)
+{
+  if (_backend->concurrentReads())
+    return _backend->stat (id, version);
+  pthread_mutex_lock (&_read_lock);
+  bool ok = _backend->stat (id, version);
+  pthread_mutex_unlock (&_read_lock);
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+readFile (int dirfd, const std::string& filename, std::string& text,
+	  XmlObjectCatalog::ObjectVersion* version)
+{
+  // Just try to open the file.  If we can't then maybe it's just not there.
+  int fd = openat (dirfd, filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    if (errno != ENOENT)
+      failures() << system_error("loading ", fullPath(dirfd, filename));
+    return false;
+  }
+  // The version comes from the open file, so it always matches the text
+  // even if the object is replaced while it is being read.
+  struct stat sbuf;
+  bool ok = (fstat (fd, &sbuf) == 0);
+  if (ok && version)
+    toVersion (sbuf, *version);
+  if (ok)
+  {
+    text.resize (sbuf.st_size);
+    size_t got = 0;
+    while (ok && got < text.length())
+    {
+      ssize_t n = ::read (fd, &text[got], text.length() - got);
+      if (n < 0 && errno == EINTR)
+	continue;
+      ok = (n > 0);
+      if (ok)
+	got += n;
+    }
+  }
+  if (! ok)
+    failures() << system_error("loading ", fullPath(dirfd, filename));
+  else if (version)
+    version->checksum = textChecksum (text);
+  close (fd);
+  return ok;
+}
+
+
+string
+XmlObjectCatalogP::
+uniqueSuffix ()
+{
+  // Process id, thread id and a process-wide counter together are unique
+  // among all live writers on the host.
+  static unsigned long counter = 0;
+  unsigned long n = __sync_fetch_and_add (&counter, 1);
+  std::ostringstream suffix;
+  suffix << "-" << getpid() << "." << (unsigned long)pthread_self()
+	 << "." << n;
+  return suffix.str();
+}
+
+
+bool
+XmlObjectCatalogP::
+syncDirectory (int dirfd)
+{
+  // The renames are only durable once the directory itself is synced.
+  if (fsync (dirfd) < 0)
+  {
+    failures() << system_error("fsync", dirPath(dirfd));
+    return false;
+  }
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+syncDirectories (const std::vector<int>& dirs)
+{
+  bool ok = true;
+  for (unsigned int i = 0; i < dirs.size(); ++i)
+  {
+    if (std::find (dirs.begin(), dirs.begin()+i, dirs[i]) == dirs.begin()+i)
+      ok = syncDirectory (dirs[i]) && ok;
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+syncFilesystem ()
+{
+  // This runs on the background thread, so errors are only logged and
+  // not queued.
+#ifdef __linux__
+  int result = syncfs (_dirfd);
+#else
+  int result = 0;
+  ::sync ();
+#endif
+  if (result < 0)
+  {
+    ELOG << system_error("syncfs", getDirectory());
+  }
+  return result == 0;
+}
+
+
+void
+XmlObjectCatalogP::
+markDirty ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  _dirty = true;
+  pthread_mutex_unlock (&_sync_lock);
+}
+
+
+void
+XmlObjectCatalogP::
+startSyncer ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  if (! _syncing)
+  {
+    _syncing = (pthread_create (&_syncer, 0, syncerMain, this) == 0);
+    if (! _syncing)
+      failures() << "could not start background sync thread";
+  }
+  pthread_mutex_unlock (&_sync_lock);
+}
+
+
+void
+XmlObjectCatalogP::
+stopSyncer ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  bool running = _syncing;
+  _syncing = false;
+  pthread_cond_signal (&_sync_cond);
+  pthread_mutex_unlock (&_sync_lock);
+  if (running)
+  {
+    pthread_join (_syncer, 0);
+  }
+}
+
+
+void*
+XmlObjectCatalogP::
+syncerMain (void* arg)
+{
+  XmlObjectCatalogP* cp = static_cast<XmlObjectCatalogP*>(arg);
+  pthread_mutex_lock (&cp->_sync_lock);
+  while (cp->_syncing || cp->_dirty)
+  {
+    if (cp->_syncing)
+    {
+      struct timeval now;
+      gettimeofday (&now, 0);
+      struct timespec deadline;
+      deadline.tv_sec = now.tv_sec + cp->_sync_period;
+      deadline.tv_nsec = now.tv_usec * 1000;
+      pthread_cond_timedwait (&cp->_sync_cond, &cp->_sync_lock, &deadline);
+    }
+    // Sync outside the lock so inserts are not held up by the disk.  A
+    // stop request still gets one final sync of any pending changes.
+    if (cp->_dirty)
+    {
+      cp->_dirty = false;
+      pthread_mutex_unlock (&cp->_sync_lock);
+      cp->syncFilesystem ();
+      pthread_mutex_lock (&cp->_sync_lock);
+    }
+  }
+  pthread_mutex_unlock (&cp->_sync_lock);
+  return 0;
+}
+
+
+namespace
+{
+  bool
+  earlier (const struct timespec& a, const struct timespec& b)
+  {
+    return a.tv_sec < b.tv_sec ||
+      (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+  }
+}
+
+
+bool
+XmlObjectCatalogP::
+queueInsert (const std::string& id, XmlObjectInterface* object)
+{
+  // The object is serialized now, so the caller is free to change it
+  // again as soon as this returns.
+  if (id.length() == 0)
+  {
+    failures() << "Cannot insert an object with an empty name.";
+    return false;
+  }
+  string text;
+  if (! serialize (id, object, text))
+    return false;
+
+  pthread_mutex_lock (&_insert_lock);
+  bool ok = true;
+  if (! _async_running)
+  {
+    _async_running = (pthread_create (&_async_writer, 0, writerMain,
+				      this) == 0);
+    if (! _async_running)
+    {
+      failures() << "could not start background insert thread";
+      ok = false;
+    }
+  }
+  std::map<string, AsyncInsert>::iterator it = _async_queue.find (id);
+  if (ok && it != _async_queue.end())
+  {
+    it->second.text.swap (text);
+  }
+  else if (ok)
+  {
+    AsyncInsert& entry = _async_queue[id];
+    entry.text.swap (text);
+    struct timeval now;
+    gettimeofday (&now, 0);
+    long long ns = now.tv_usec * 1000LL + _async_window * 1000000LL;
+    entry.due.tv_sec = now.tv_sec + ns / 1000000000LL;
+    entry.due.tv_nsec = ns % 1000000000LL;
+    pthread_cond_signal (&_insert_cond);
+  }
+  pthread_mutex_unlock (&_insert_lock);
+
+  // Without the thread, write the object now rather than lose it.
+  if (! ok)
+    return putTexts (CatalogBackend::text_list_t
+		     (1, std::make_pair (id, text)), false, false, 0);
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+flushInserts ()
+{
+  pthread_mutex_lock (&_insert_lock);
+  ++_flushing;
+  pthread_cond_signal (&_insert_cond);
+  while (! _async_queue.empty() || _async_writing)
+  {
+    pthread_cond_wait (&_insert_idle, &_insert_lock);
+  }
+  --_flushing;
+  bool ok = ! _async_failed;
+  _async_failed = false;
+  pthread_mutex_unlock (&_insert_lock);
+  return ok;
+}
+
+
+void
+XmlObjectCatalogP::
+settleInsert (const std::string& id, bool discard)
+{
+  // Make the queue agree with the catalog for one key before it is read
+  // or removed: the queued text is written, or with @p discard dropped,
+  // and an insert already on its way to the backend is waited for.
+  pthread_mutex_lock (&_insert_lock);
+  bool queued = _async_queue.count (id) > 0;
+  if (queued && discard)
+  {
+    _async_queue.erase (id);
+    queued = false;
+  }
+  bool writing = _async_writing;
+  pthread_mutex_unlock (&_insert_lock);
+  if (queued || writing)
+    flushInserts ();
+}
+
+
+void
+XmlObjectCatalogP::
+stopWriter ()
+{
+  // The writer leaves once the queue is empty after the last flush.
+  flushInserts ();
+  pthread_mutex_lock (&_insert_lock);
+  bool running = _async_running;
+  _async_running = false;
+  pthread_cond_signal (&_insert_cond);
+  pthread_mutex_unlock (&_insert_lock);
+  if (running)
+  {
+    pthread_join (_async_writer, 0);
+  }
+}
+
+
+void*
+XmlObjectCatalogP::
+writerMain (void* arg)
+{
+  XmlObjectCatalogP* cp = static_cast<XmlObjectCatalogP*>(arg);
+  pthread_mutex_lock (&cp->_insert_lock);
+  while (cp->_async_running || ! cp->_async_queue.empty())
+  {
+    // Take every insert which is due, or all of them for a flush, and
+    // note when the next one falls due.
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    struct timespec now;
+    now.tv_sec = tv.tv_sec;
+    now.tv_nsec = tv.tv_usec * 1000;
+    bool all = cp->_flushing > 0 || ! cp->_async_running;
+    CatalogBackend::text_list_t texts;
+    struct timespec next = now;
+    bool waiting = false;
+    std::map<string, AsyncInsert>::iterator it = cp->_async_queue.begin();
+    while (it != cp->_async_queue.end())
+    {
+      if (all || ! earlier (now, it->second.due))
+      {
+	texts.push_back (std::make_pair (it->first, string()));
+	texts.back().second.swap (it->second.text);
+	cp->_async_queue.erase (it++);
+	continue;
+      }
+      if (! waiting || earlier (it->second.due, next))
+	next = it->second.due;
+      waiting = true;
+      ++it;
+    }
+
+    if (texts.size())
+    {
+      // Write outside the lock so the caller can keep queuing.  Each is
+      // an ordinary insert under the durability policy of the catalog.
+      cp->_async_writing = true;
+      pthread_mutex_unlock (&cp->_insert_lock);
+      bool ok = true;
+      for (unsigned int i = 0; i < texts.size(); ++i)
+      {
+	ok = cp->putTexts (CatalogBackend::text_list_t (1, texts[i]),
+			   false, false, 0) && ok;
+      }
+      pthread_mutex_lock (&cp->_insert_lock);
+      cp->_async_writing = false;
+      if (! ok)
+	cp->_async_failed = true;
+    }
+    else if (waiting)
+    {
+      pthread_cond_timedwait (&cp->_insert_cond, &cp->_insert_lock, &next);
+    }
+    else if (cp->_async_running)
+    {
+      pthread_cond_wait (&cp->_insert_cond, &cp->_insert_lock);
+    }
+    pthread_cond_broadcast (&cp->_insert_idle);
+  }
+  pthread_mutex_unlock (&cp->_insert_lock);
+  return 0;
+}
+
+
+
+bool
+XmlObjectCatalog::
+insert (const std::string& id, XmlObjectInterface* object)
+{
+  if (! isOpen())
+    return false;
+  // Segment storage cannot take a write alongside the reads of the
+  // caller, and an insert there is a single append anyway.
+  if (_mp->_async_window && _mp->_backend->concurrentReads())
+    return _mp->queueInsert (id, object);
+  return _mp->putObjects (object_list_t (1, object_entry_t (id, object)),
+			  false, false, 0);
+}
+
+
+
+bool
+XmlObjectCatalog::
+insertBatch (const object_list_t& objects)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+
+  // Rejecting duplicate names up front keeps the rollback simple: every
+  // rename in the batch replaces a distinct target.
+  key_set_t names;
+  object_list_t::const_iterator it;
+  for (it = objects.begin(); it != objects.end(); ++it)
+  {
+    if (! names.insert (it->first).second)
+    {
+      _mp->failures() << "insertBatch: name appears more than once: "
+		      << it->first;
+      return false;
+    }
+  }
+  return _mp->putObjects (objects, true, false, 0);
+}
+
+
+
+bool
+XmlObjectCatalog::
+insertIfAbsent (const std::string& id, XmlObjectInterface* object)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  return _mp->putObjects (object_list_t (1, object_entry_t (id, object)),
+			  false, true, 0);
+}
+
+
+
+bool
+XmlObjectCatalog::
+replaceIfUnchanged (const std::string& id, XmlObjectInterface* object,
+		    const ObjectVersion& expected)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  return _mp->putObjects (object_list_t (1, object_entry_t (id, object)),
+			  false, false, &expected);
+}
+
+
+
+bool
+XmlObjectCatalog::
+version (const std::string& id, ObjectVersion& version)
+{
+  if (! isOpen())
+    return false;
+  _mp->settleInsert (id, false);
+
+  string text;
+  return _mp->readObject (id, text, &version);
+}
+
+
+
+bool
+XmlObjectCatalog::
+remove (const std::string& id)
+{
+  if (! isOpen())
+    return true;
+  _mp->settleInsert (id, true);
+  if (! _mp->_backend->remove (id))
+    return false;
+  if (_mp->_segments && _mp->_segments->needsCompaction())
+    _mp->startCompactor();
+  std::vector<string> keys (1, id);
+  bool ok = _mp->journal (JOURNAL_REMOVE, keys);
+  ok = _mp->summarize ('K', keys) && ok;
+  ok = _mp->indexKeys (keys) && ok;
+  return ok;
+}
+
+
+bool
+CatalogBackend::
+rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest)
+{
+  bool ok = true;
+  XmlObjectCatalog::key_set_t::const_iterator it;
+  for (it = names.begin(); it != names.end(); ++it)
+  {
+    string text;
+    if (! get (*it, text, 0))
+    {
+      if (errno == ENOENT)
+	cp->failures() << "moving " << *it << " out of " << cp->_name
+		       << ": no such object";
+      ok = false;
+      continue;
+    }
+    if (! dest->put (text_list_t (1, std::make_pair (*it, text)),
+		     false, false, 0, 0))
+    {
+      cp->failures() << "moving " << *it << " out of " << cp->_name
+		     << ": " << dest->cp->_that->lastError();
+      ok = false;
+      continue;
+    }
+    ok = remove (*it) && ok;
+  }
+  return ok;
+}
+
+
+bool
+CatalogBackend::
+unchanged (const std::string& id, const std::string& text)
+{
+  XmlObjectCatalog::ObjectVersion version;
+  if (! cp->statObject (id, version))
+    return false;
+  return version.checksum != 0 &&
+    version.size == (long long)text.length() &&
+    version.checksum == textChecksum (text);
+}
+
+
+bool
+XmlObjectCatalog::
+move (const std::string& id, XmlObjectCatalog* dest)
+{
+  key_set_t names;
+  names.insert (id);
+  return move (names, dest);
+}
+
+
+bool
+XmlObjectCatalog::
+move (const key_set_t& names, XmlObjectCatalog* dest)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+
+  if (! dest->isOpen())
+  {
+    _mp->failures() << "move: destination catalog '" 
+		    << dest->name() << "' is not open.";
+    return false;
+  }
+  dest->_mp->flushInserts();
+  bool ok = _mp->_backend->rename (names, dest->_mp->_backend);
+  if (_mp->_journal_fd < 0 && dest->_mp->_journal_fd < 0 &&
+      _mp->_summary_fd < 0 && dest->_mp->_summary_fd < 0 &&
+      _mp->_index_fd < 0 && dest->_mp->_index_fd < 0)
+  {
+    return ok;
+  }
+
+  // Journal, summarize and index whatever has left this catalog, which
+  // is everything unless something failed.
+  std::vector<string> moved;
+  key_set_t::const_iterator it;
+  for (it = names.begin(); it != names.end(); ++it)
+  {
+    bool found = false;
+    if (ok || (_mp->_backend->exists (*it, found) && ! found))
+      moved.push_back (*it);
+  }
+  if (dest->_mp != _mp && dest->_mp->_directory != _mp->_directory)
+  {
+    ok = _mp->journal (JOURNAL_MOVE, moved, dest->name()) && ok;
+    ok = dest->_mp->journal (JOURNAL_INSERT, moved) && ok;
+    ok = _mp->summarize ('K', moved) && ok;
+    ok = dest->_mp->summarize ('K', moved) && ok;
+    ok = _mp->indexKeys (moved) && ok;
+    ok = dest->_mp->indexKeys (moved) && ok;
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+load (const std::string& id, XmlObjectInterface* object)
+{
+  if (! isOpen())
+    return false;
+  return _mp->loadObject (id, object, 0);
+}
+
+
+bool
+XmlObjectCatalog::
+load (const std::string& id, XmlObjectInterface* object,
+      ObjectVersion& version)
+{
+  if (! isOpen())
+    return false;
+  return _mp->loadObject (id, object, &version);
+}
+
+
+bool
+XmlObjectCatalogP::
+loadObject (const std::string& id, XmlObjectInterface* object,
+	    XmlObjectCatalog::ObjectVersion* version)
+{
+  settleInsert (id, false);
+
+  // With the cache on, the version of the stored object decides whether
+  // the cached copy can be used, before anything is read.
+  string key = _directory + "/" + id;
+  bool cached = LOAD_CACHE.enabled();
+  XmlObjectCatalog::ObjectVersion current;
+  if (cached)
+  {
+    if (! statObject (id, current))
+      return false;
+    if (LOAD_CACHE.fetch (key, current, object, version))
+      return true;
+  }
+
+  string text;
+  if (! readObject (id, text, &current))
+    return false;
+  if (version)
+    *version = current;
+  if (cached)
+    return LOAD_CACHE.store (key, current, text, object);
+  // Now just load it up.
+  return object->fromXML (text);
+}
+
+
+bool
+XmlObjectCatalogP::
+parseObject (const std::string& id, const std::string& text,
+	     const XmlObjectCatalog::ObjectVersion& current,
+	     XmlObjectInterface* object,
+	     XmlObjectCatalog::ObjectVersion* version)
+{
+  // The text has already been read, but the cache can still save
+  // parsing it.
+  if (version)
+    *version = current;
+  if (! LOAD_CACHE.enabled())
+    return object->fromXML (text);
+  string key = _directory + "/" + id;
+  if (LOAD_CACHE.fetch (key, current, object, version))
+    return true;
+  return LOAD_CACHE.store (key, current, text, object);
+}
+
+
+void
+XmlObjectCatalogP::
+readFiles (std::vector<CatalogRead>& reads, unsigned int begin,
+	   unsigned int end, CatalogRing& ring)
+{
+  // Whatever io_uring could not finish is read the usual way, which also
+  // reports any errors.  A ring which failed may still hold completions,
+  // so it is not used for the rest of the call.
+#ifdef DOMX_HAVE_LIBURING
+  if (ring.ready && ! uringRead (ring.ring, reads, begin, end))
+  {
+    io_uring_queue_exit (&ring.ring);
+    ring.ready = false;
+  }
+#else
+  (void)ring;
+#endif
+  for (unsigned int i = begin; i < end; ++i)
+  {
+    CatalogRead& r = reads[i];
+    if (! r.done)
+    {
+      r.ok = readFile (r.dirfd, r.filename, r.text, &r.version);
+      r.done = true;
+    }
+  }
+}
+
+
+#ifdef DOMX_HAVE_LIBURING
+bool
+XmlObjectCatalogP::
+uringRun (struct io_uring& ring, unsigned int count, std::vector<int>& results)
+{
+  // Submit the prepared operations and collect each result by the index
+  // it was tagged with.
+  if (count == 0)
+    return true;
+  if (io_uring_submit_and_wait (&ring, count) < 0)
+    return false;
+  for (unsigned int n = 0; n < count; ++n)
+  {
+    struct io_uring_cqe* cqe;
+    if (io_uring_wait_cqe (&ring, &cqe) < 0)
+      return false;
+    results[(uintptr_t)io_uring_cqe_get_data (cqe)] = cqe->res;
+    io_uring_cqe_seen (&ring, cqe);
+  }
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+uringRead (struct io_uring& ring, std::vector<CatalogRead>& reads,
+	   unsigned int begin, unsigned int end)
+{
+  // Open, stat, read and close the files each with one submission for
+  // the whole batch, rather than four system calls per file.  Anything
+  // which fails is left for the synchronous path.  The ring has room for
+  // URING_BATCH entries, and every submission is drained before the next.
+  unsigned int n = end - begin;
+  if (n == 0)
+    return true;
+  std::vector<int> fds (n, -1);
+  std::vector<int> results (n, 0);
+  std::vector<struct statx> stx (n);
+  struct io_uring_sqe* sqe;
+
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    sqe = io_uring_get_sqe (&ring);
+    io_uring_prep_openat (sqe, reads[begin+i].dirfd,
+			  reads[begin+i].filename.c_str(),
+			  O_RDONLY | O_CLOEXEC, 0);
+    io_uring_sqe_set_data (sqe, (void*)(uintptr_t)i);
+  }
+  bool ok = uringRun (ring, n, results);
+  unsigned int count = 0;
+  for (unsigned int i = 0; ok && i < n; ++i)
+  {
+    if (results[i] >= 0)
+      fds[i] = results[i];
+    else if (results[i] == -ENOENT)
+      reads[begin+i].done = true;
+    if (fds[i] < 0)
+      continue;
+    sqe = io_uring_get_sqe (&ring);
+    io_uring_prep_statx (sqe, fds[i], "", AT_EMPTY_PATH, STATX_BASIC_STATS,
+			 &stx[i]);
+    io_uring_sqe_set_data (sqe, (void*)(uintptr_t)i);
+    ++count;
+  }
+
+  ok = ok && uringRun (ring, count, results);
+  count = 0;
+  for (unsigned int i = 0; ok && i < n; ++i)
+  {
+    CatalogRead& r = reads[begin+i];
+    if (fds[i] < 0 || results[i] < 0)
+      continue;
+    XmlObjectCatalog::ObjectVersion& v = r.version;
+    v.device = makedev (stx[i].stx_dev_major, stx[i].stx_dev_minor);
+    v.inode = stx[i].stx_ino;
+    v.mtime_ns = (long long)stx[i].stx_mtime.tv_sec * 1000000000LL +
+      stx[i].stx_mtime.tv_nsec;
+    v.size = stx[i].stx_size;
+    r.text.resize (v.size);
+    results[i] = -1;
+    if (v.size == 0)
+    {
+      results[i] = 0;
+      continue;
+    }
+    sqe = io_uring_get_sqe (&ring);
+    io_uring_prep_read (sqe, fds[i], &r.text[0], r.text.length(), 0);
+    io_uring_sqe_set_data (sqe, (void*)(uintptr_t)i);
+    ++count;
+  }
+
+  ok = ok && uringRun (ring, count, results);
+  for (unsigned int i = 0; ok && i < n; ++i)
+  {
+    CatalogRead& r = reads[begin+i];
+    if (fds[i] >= 0 && results[i] == (int)r.text.length())
+    {
+      r.version.checksum = textChecksum (r.text);
+      r.done = r.ok = true;
+    }
+  }
+
+  // Close whatever was opened, whether or not the rest worked.
+  count = 0;
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    if (fds[i] < 0)
+      continue;
+    sqe = io_uring_get_sqe (&ring);
+    io_uring_prep_close (sqe, fds[i]);
+    io_uring_sqe_set_data (sqe, (void*)(uintptr_t)i);
+    ++count;
+  }
+  if (! uringRun (ring, count, results))
+  {
+    for (unsigned int i = 0; i < n; ++i)
+    {
+      if (fds[i] >= 0)
+	close (fds[i]);
+    }
+    ok = false;
+  }
+  return ok;
+}
+#endif
+
+
+void*
+XmlObjectCatalogP::
+loadMain (void* arg)
+{
+  LoadBatch* batch = static_cast<LoadBatch*>(arg);
+  const XmlObjectCatalog::object_list_t& objects = *batch->objects;
+  pthread_mutex_lock (&batch->lock);
+  while (batch->next < objects.size())
+  {
+    if (batch->reads && batch->next >= batch->ready)
+    {
+      pthread_cond_wait (&batch->more, &batch->lock);
+      continue;
+    }
+    unsigned int i = batch->next++;
+    pthread_mutex_unlock (&batch->lock);
+    bool ok;
+    if (batch->reads)
+    {
+      CatalogRead& r = (*batch->reads)[i];
+      ok = r.ok && batch->cp->parseObject (objects[i].first, r.text,
+					   r.version, objects[i].second, 0);
+      string().swap (r.text);
+    }
+    else
+    {
+      ok = batch->cp->loadObject (objects[i].first, objects[i].second, 0);
+    }
+    pthread_mutex_lock (&batch->lock);
+    batch->loaded[i] = ok;
+    batch->done.push_back (i);
+    pthread_cond_signal (&batch->cond);
+  }
+  pthread_mutex_unlock (&batch->lock);
+  return 0;
+}
+
+
+void
+LoadBatch::
+deliver (XmlObjectCatalog::load_callback_t callback, void* arg, bool wait)
+{
+  // Deliver each object which is done, outside the lock so the threads
+  // keep going while the callback runs.  The lock must be held.
+  while (delivered < objects->size())
+  {
+    if (done.empty() && ! wait)
+      break;
+    if (done.empty())
+    {
+      pthread_cond_wait (&cond, &lock);
+      continue;
+    }
+    unsigned int i = done.front();
+    done.pop_front();
+    ++delivered;
+    ok = ok && loaded[i];
+    if (callback)
+    {
+      pthread_mutex_unlock (&lock);
+      (*callback)((*objects)[i], loaded[i], arg);
+      pthread_mutex_lock (&lock);
+    }
+  }
+}
+
+
+bool
+XmlObjectCatalog::
+setIoUring (bool enable)
+{
+#ifdef DOMX_HAVE_LIBURING
+  URING_ENABLED = enable;
+  return enable;
+#else
+  (void)enable;
+  return false;
+#endif
+}
+
+
+bool
+XmlObjectCatalog::
+loadMany (const object_list_t& objects, unsigned int nthreads)
+{
+  return loadMany (objects, 0, 0, nthreads);
+}
+
+
+bool
+XmlObjectCatalog::
+loadMany (const object_list_t& objects, load_callback_t callback, void* arg,
+	  unsigned int nthreads)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (objects.empty())
+    return true;
+
+  // Initialize xerces before the threads race to do it.
+  domx::xmlInitialize();
+  long nt = nthreads;
+  if (nt == 0)
+    nt = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nt > (long)objects.size())
+    nt = objects.size();
+  if (nt < 1)
+    nt = 1;
+
+  LoadBatch batch;
+  batch.cp = _mp;
+  batch.objects = &objects;
+  batch.next = 0;
+  batch.loaded.resize (objects.size(), 0);
+  batch.reads = 0;
+  batch.ready = 0;
+  batch.delivered = 0;
+  batch.ok = true;
+  pthread_mutex_init (&batch.lock, 0);
+  pthread_cond_init (&batch.cond, 0);
+  pthread_cond_init (&batch.more, 0);
+
+  // With io_uring, files are read here in batches while the threads
+  // parse what has already been read.
+  std::vector<CatalogRead> reads;
+  CatalogRing ring;
+#ifdef DOMX_HAVE_LIBURING
+  if (URING_ENABLED && storage() == STORAGE_FILES)
+    ring.ready = io_uring_queue_init (URING_BATCH, &ring.ring, 0) == 0;
+  if (ring.ready)
+  {
+    reads.resize (objects.size());
+    for (unsigned int i = 0; i < objects.size(); ++i)
+    {
+      reads[i].dirfd = _mp->objectDir (objects[i].first);
+      reads[i].filename = XmlObjectCatalogP::objectName (objects[i].first);
+      reads[i].done = reads[i].ok = false;
+    }
+    batch.reads = &reads;
+  }
+#endif
+
+  std::vector<pthread_t> threads (nt);
+  long started = 0;
+  for (long t = 0; t < nt; ++t)
+  {
+    if (pthread_create (&threads[started], 0,
+			XmlObjectCatalogP::loadMain, &batch) == 0)
+      ++started;
+  }
+  if (started == 0)
+  {
+    batch.reads = 0;
+    XmlObjectCatalogP::loadMain (&batch);
+  }
+
+  pthread_mutex_lock (&batch.lock);
+  while (batch.reads && batch.ready < objects.size())
+  {
+    unsigned int begin = batch.ready;
+    unsigned int end = std::min (begin + URING_BATCH,
+				 (unsigned int)objects.size());
+    pthread_mutex_unlock (&batch.lock);
+    _mp->readFiles (reads, begin, end, ring);
+    pthread_mutex_lock (&batch.lock);
+    batch.ready = end;
+    pthread_cond_broadcast (&batch.more);
+    batch.deliver (callback, arg, false);
+  }
+  batch.deliver (callback, arg, true);
+  pthread_mutex_unlock (&batch.lock);
+
+  for (long t = 0; t < started; ++t)
+  {
+    pthread_join (threads[t], 0);
+  }
+#ifdef DOMX_HAVE_LIBURING
+  if (ring.ready)
+    io_uring_queue_exit (&ring.ring);
+#endif
+  pthread_cond_destroy (&batch.more);
+  pthread_cond_destroy (&batch.cond);
+  pthread_mutex_destroy (&batch.lock);
+  return batch.ok;
+}
+
+
+void
+XmlObjectCatalog::
+setLoadCacheSize (unsigned int entries)
+{
+  LOAD_CACHE.resize (entries);
+}
+
+
+bool
+XmlObjectCatalog::
+setSharedLoadCache (const std::string& dir, unsigned int slots)
+{
+  int fd = -1;
+  if (dir.length() && slots > 0)
+  {
+    if (mkdir (dir.c_str(), 0775) < 0 && errno != EEXIST)
+    {
+      ELOG << system_error("creating shared load cache", dir);
+      return false;
+    }
+    fd = ::open (dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      ELOG << system_error("opening shared load cache", dir);
+      return false;
+    }
+  }
+  // A descriptor being replaced stays open, since a load on another
+  // thread may still be using it.
+  pthread_mutex_lock (&LOAD_CACHE.lock);
+  LOAD_CACHE.shared_fd = fd;
+  LOAD_CACHE.shared_slots = slots;
+  pthread_mutex_unlock (&LOAD_CACHE.lock);
+  return true;
+}
+
+
+XmlObjectCatalog::LoadCacheStats
+XmlObjectCatalog::
+loadCacheStats ()
+{
+  LoadCacheStats stats;
+  pthread_mutex_lock (&LOAD_CACHE.lock);
+  stats.hits = LOAD_CACHE.hits;
+  stats.misses = LOAD_CACHE.misses;
+  stats.entries = LOAD_CACHE.lru.size();
+  stats.shared_hits = LOAD_CACHE.shared_hits;
+  stats.shared_misses = LOAD_CACHE.shared_misses;
+  pthread_mutex_unlock (&LOAD_CACHE.lock);
+  return stats;
+}
+
+
+bool
+XmlObjectCatalogP::
+scanDirectory (int dirfd, XmlObjectCatalog::key_set_t& kset,
+	       std::string& error)
+{
+  // Open the directory again so the scan has its own position.
+  int fd = openat (dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR* dir = (fd >= 0) ? fdopendir (fd) : 0;
+  if (! dir)
+  {
+    std::ostringstream msg;
+    msg << system_error("keys(): opening catalog directory", dirPath(dirfd));
+    error = msg.str();
+    if (fd >= 0)
+      close (fd);
+    return false;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != 0)
+  {
+    // Only match ?*.xml entries.
+    string dname(entry->d_name);
+    if (dname.length() > 4 && dname.substr(dname.length()-4) == ".xml")
+      kset.insert(dname.substr(0, dname.length()-4));
+  }
+  closedir(dir);
+  return true;
+}
+
+
+void*
+XmlObjectCatalogP::
+scanMain (void* arg)
+{
+  DirectoryScan* scan = static_cast<DirectoryScan*>(arg);
+  scan->ok = true;
+  for (unsigned int i = 0; scan->ok && i < scan->dirs.size(); ++i)
+  {
+    scan->ok = scan->cp->scanDirectory (scan->dirs[i], scan->keys,
+					scan->error);
+  }
+  return 0;
+}
+
+
+bool
+XmlObjectCatalogP::
+scanDirectories (const std::vector<int>& dirs,
+		 XmlObjectCatalog::key_set_t& kset)
+{
+  // Spread the directories over a few threads, since most of the time
+  // goes to waiting on directory reads, and merge what they find.
+  long nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nthreads > 16)
+    nthreads = 16;
+  if (nthreads > (long)dirs.size())
+    nthreads = dirs.size();
+  if (nthreads < 1)
+    nthreads = 1;
+  std::vector<DirectoryScan> scans (nthreads);
+  for (unsigned int i = 0; i < dirs.size(); ++i)
+  {
+    scans[i % nthreads].dirs.push_back (dirs[i]);
+  }
+  std::vector<bool> started (nthreads, false);
+  for (long t = 0; t < nthreads; ++t)
+  {
+    scans[t].cp = this;
+    if (t > 0)
+      started[t] = (pthread_create (&scans[t].thread, 0, scanMain,
+				    &scans[t]) == 0);
+    if (! started[t])
+      scanMain (&scans[t]);
+  }
+
+  bool ok = true;
+  for (long t = 0; t < nthreads; ++t)
+  {
+    if (started[t])
+      pthread_join (scans[t].thread, 0);
+    if (! scans[t].ok)
+    {
+      failures() << scans[t].error;
+      ok = false;
+    }
+    kset.insert (scans[t].keys.begin(), scans[t].keys.end());
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+keys(key_set_t& kset)
+{
+  return keys ("", "", kset);
+}
+
+
+bool
+XmlObjectCatalog::
+keys (const std::string& from, const std::string& to, key_set_t& kset)
+{
+  kset.erase (kset.begin(), kset.end());
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+
+  bool ok = _mp->_backend->list (from, to, kset);
+  kset.erase (kset.begin(), kset.lower_bound (from));
+  if (to.length())
+    kset.erase (kset.lower_bound (to), kset.end());
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+dropBefore (const std::string& key)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (_mp->_partitioning == PARTITION_NONE)
+  {
+    _mp->failures() << "dropBefore: catalog " << name()
+		    << " is not partitioned";
+    return false;
+  }
+
+  // Rename each partition which is entirely older than the key out of
+  // the way, then remove the lot in the background.  Any trash left by a
+  // removal which never finished goes too.
+  int dirfd = _mp->_dirfd;
+  std::vector<string> names;
+  TrashRemoval* trash = new TrashRemoval;
+  trash->dirfd = dirfd;
+  trash->cache = 0;
+  if (! _mp->listEntries (dirfd, ".part-", names) ||
+      ! _mp->listEntries (dirfd, ".trash-", trash->names))
+  {
+    delete trash;
+    return false;
+  }
+  bool ok = true;
+  unsigned int dropped = 0;
+  for (unsigned int i = 0; i < names.size(); ++i)
+  {
+    string prefix = names[i].substr (6);
+    if (! (prefix < key.substr (0, prefix.length())))
+      continue;
+    string tname = ".trash-" + prefix + XmlObjectCatalogP::uniqueSuffix();
+    if (renameat (dirfd, names[i].c_str(), dirfd, tname.c_str()) < 0)
+    {
+      _mp->failures() << system_error("dropping partition",
+				      _mp->fullPath(names[i]));
+      ok = false;
+      continue;
+    }
+    // A new partition of the same name gets a new descriptor, but the
+    // old one is retired rather than closed, since the async writer, a
+    // loadMany() or an iterator here or in another catalog may still hold
+    // it.
+    pthread_mutex_lock (&DIRECTORY_LOCK);
+    CatalogDirectory* cd = _mp->_cache;
+    std::map<string, int>::iterator it = cd->partitions.find (names[i]);
+    if (it != cd->partitions.end())
+    {
+      cd->retired.push_back (it->second);
+      cd->partitions.erase (it);
+    }
+    pthread_mutex_unlock (&DIRECTORY_LOCK);
+    trash->names.push_back (tname);
+    ++dropped;
+  }
+
+  if (dropped && _mp->_durability == SYNC_FULL)
+    ok = _mp->syncDirectory (dirfd) && ok;
+  else if (dropped && _mp->_durability == SYNC_PERIODIC)
+    _mp->markDirty();
+  if (dropped)
+  {
+    ok = _mp->journal (JOURNAL_DROP, std::vector<string> (1, key)) && ok;
+    ok = _mp->summarize ('S', std::vector<string> (1, "")) && ok;
+  }
+
+  if (trash->names.empty())
+  {
+    delete trash;
+    return ok;
+  }
+  // The thread owns the trash list, and uses the directory like an open
+  // catalog until it is done.  If it cannot be started, remove the trash
+  // here instead.
+  pthread_mutex_lock (&DIRECTORY_LOCK);
+  trash->cache = _mp->_cache;
+  ++trash->cache->users;
+  pthread_mutex_unlock (&DIRECTORY_LOCK);
+  pthread_t remover;
+  if (pthread_create (&remover, 0, XmlObjectCatalogP::removeMain, trash) == 0)
+    pthread_detach (remover);
+  else
+    XmlObjectCatalogP::removeMain (trash);
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+exists (const std::string& id)
+{
+  if (! isOpen())
+    return false;
+  _mp->settleInsert (id, false);
+  bool found;
+  _mp->_backend->exists (id, found);
+  return found;
+}
+
+
+bool
+XmlObjectCatalog::
+exists (const key_set_t& names, key_set_t& found)
+{
+  found.erase (found.begin(), found.end());
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+
+  bool ok = true;
+  key_set_t::const_iterator it;
+  for (it = names.begin(); it != names.end(); ++it)
+  {
+    bool exists;
+    ok = _mp->_backend->exists (*it, exists) && ok;
+    if (exists)
+      found.insert (found.end(), *it);
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+reshard (unsigned int nshards)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (nshards > 0 && _mp->_partitioning != PARTITION_NONE)
+  {
+    _mp->failures() << "reshard: catalog " << name() << " is partitioned";
+    return false;
+  }
+  return _mp->migrate (nshards, _mp->_partitioning);
+}
+
+
+bool
+XmlObjectCatalog::
+repartition (EnumPartitioning mode)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (mode != PARTITION_NONE && ! _mp->_shards.empty())
+  {
+    _mp->failures() << "repartition: catalog " << name() << " is sharded";
+    return false;
+  }
+  return _mp->migrate (_mp->_shards.size(), mode);
+}
+
+
+XmlObjectCatalog::EnumPartitioning
+XmlObjectCatalog::
+partitioning()
+{
+  return _mp->_partitioning;
+}
+
+
+bool
+XmlObjectCatalogP::
+migrate (unsigned int nshards, XmlObjectCatalog::EnumPartitioning mode)
+{
+  stopFolder();
+  stopMerger();
+  if (_backend->storage() != XmlObjectCatalog::STORAGE_FILES)
+  {
+    failures() << "cannot shard or partition " << getDirectory()
+	       << " unless it is stored in files";
+    return false;
+  }
+  int dirfd = _dirfd;
+  std::vector<int> shards;
+  if (! openShards (dirfd, nshards, shards))
+    return false;
+
+  // Objects may be in the catalog directory itself or in any shard or
+  // partition directory, whatever the old layout was or however far an
+  // earlier attempt got.
+  std::vector<string> sources (1, "");
+  if (! listEntries (dirfd, ".shard-", sources) ||
+      ! listEntries (dirfd, ".part-", sources))
+  {
+    for (unsigned int i = 0; i < shards.size(); ++i)
+      close (shards[i]);
+    return false;
+  }
+
+  bool ok = true;
+  std::map<string, int> parts;
+  std::vector<int> synced (shards);
+  synced.push_back (dirfd);
+  for (unsigned int s = 0; s < sources.size(); ++s)
+  {
+    const string& source = sources[s];
+    int srcfd = dirfd;
+    if (source.length())
+      srcfd = openat (dirfd, source.c_str(),
+		      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    string error;
+    XmlObjectCatalog::key_set_t kset;
+    if (srcfd < 0)
+    {
+      failures() << system_error("migrating", fullPath(source));
+      ok = false;
+      continue;
+    }
+    if (! scanDirectory (srcfd, kset, error))
+    {
+      failures() << error;
+      ok = false;
+    }
+    XmlObjectCatalog::key_set_t::iterator it;
+    for (it = kset.begin(); it != kset.end(); ++it)
+    {
+      string filename = objectName(*it);
+      int destfd = dirfd;
+      string dest;
+      if (nshards > 0)
+      {
+	unsigned int i = textChecksum(*it) % nshards;
+	destfd = shards[i];
+	dest = shardName(i);
+      }
+      else if ((dest = partitionName (mode, *it)).length())
+      {
+	if (parts.find (dest) == parts.end())
+	{
+	  if (mkdirat (dirfd, dest.c_str(), 0775) < 0 && errno != EEXIST)
+	    parts[dest] = -1;
+	  else
+	    parts[dest] = openat (dirfd, dest.c_str(),
+				  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	  if (parts[dest] >= 0)
+	    synced.push_back (parts[dest]);
+	}
+	destfd = parts[dest];
+      }
+      if (dest == source)
+	continue;
+      if (destfd < 0)
+      {
+	failures() << system_error("migrating: opening", fullPath(dest));
+	ok = false;
+	break;
+      }
+      if (renameat (srcfd, filename.c_str(), destfd, filename.c_str()) < 0)
+      {
+	failures() << system_error("migrating",
+				   fullPath(source.length() ?
+					    source + "/" + filename :
+					    filename));
+	ok = false;
+      }
+    }
+    if (srcfd != dirfd)
+    {
+      ok = syncDirectory (srcfd) && ok;
+      close (srcfd);
+    }
+  }
+  if (ok)
+    ok = syncDirectories (synced);
+
+  // Record the new layout only once every object is in its place.
+  if (ok)
+  {
+    std::ostringstream text;
+    if (nshards > 0)
+      text << nshards << "\n";
+    ok = writeLayout (SHARD_FILE, text.str());
+  }
+  if (ok)
+  {
+    const char* text = "";
+    if (mode == XmlObjectCatalog::PARTITION_DAY)
+      text = "day\n";
+    else if (mode == XmlObjectCatalog::PARTITION_HOUR)
+      text = "hour\n";
+    ok = writeLayout (PARTITION_FILE, text);
+  }
+  if (ok)
+    ok = syncDirectory (dirfd);
+  if (! ok)
+  {
+    for (unsigned int i = 0; i < shards.size(); ++i)
+      close (shards[i]);
+    std::map<string, int>::iterator pt;
+    for (pt = parts.begin(); pt != parts.end(); ++pt)
+    {
+      if (pt->second >= 0)
+	close (pt->second);
+    }
+    return false;
+  }
+
+  // The old shard and partition directories should be empty now.
+  for (unsigned int s = 1; s < sources.size(); ++s)
+  {
+    const string& source = sources[s];
+    unsigned int i;
+    if (sscanf (source.c_str(), ".shard-%x", &i) == 1 && i < nshards &&
+	source == shardName(i))
+      continue;
+    if (source == partitionName (mode, source.substr (6)))
+      continue;
+    if (unlinkat (dirfd, source.c_str(), AT_REMOVEDIR) < 0)
+    {
+      failures() << system_error("migrating: removing", fullPath(source));
+      ok = false;
+    }
+  }
+
+  // The old shard and partition descriptors are retired rather than
+  // closed, since this and other catalogs may still hold copies.
+  pthread_mutex_lock (&DIRECTORY_LOCK);
+  _cache->retired.insert (_cache->retired.end(), _cache->shards.begin(),
+			  _cache->shards.end());
+  std::map<string, int>::iterator pt;
+  for (pt = _cache->partitions.begin(); pt != _cache->partitions.end(); ++pt)
+  {
+    _cache->retired.push_back (pt->second);
+  }
+  _cache->partitions = parts;
+  _cache->partitioning = mode;
+  _cache->shards = shards;
+  _cache->layout = true;
+  _shards = shards;
+  _partitioning = mode;
+  pthread_mutex_unlock (&DIRECTORY_LOCK);
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+writeLayout (const char* filename, const std::string& text)
+{
+  // An empty layout is recorded by the absence of the file.
+  if (text.empty())
+  {
+    if (unlinkat (_dirfd, filename, 0) < 0 && errno != ENOENT)
+    {
+      failures() << system_error("removing", fullPath(filename));
+      return false;
+    }
+    return true;
+  }
+  CatalogTempFile tmp;
+  tmp.dirfd = _dirfd;
+  tmp.data = text;
+  return openNamedTemp (filename, tmp) && writeData (tmp) &&
+    syncTemp (tmp, false) && publishTemp (tmp, filename);
+}
+
+
+void
+XmlObjectCatalogP::
+removeDirectory (int dirfd, const std::string& name)
+{
+  // This runs on a detached thread, so errors are only logged.
+  int fd = openat (dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR* dir = (fd >= 0) ? fdopendir (fd) : 0;
+  if (! dir)
+  {
+    if (fd >= 0)
+      close (fd);
+    if (errno != ENOENT)
+      ELOG << system_error("removing dropped partition", name);
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != 0)
+  {
+    string dname(entry->d_name);
+    if (dname != "." && dname != ".." &&
+	unlinkat (fd, dname.c_str(), 0) < 0 && errno != ENOENT)
+    {
+      ELOG << system_error("removing dropped object", name + "/" + dname);
+    }
+  }
+  closedir (dir);
+  if (unlinkat (dirfd, name.c_str(), AT_REMOVEDIR) < 0 && errno != ENOENT)
+    ELOG << system_error("removing dropped partition", name);
+}
+
+
+void*
+XmlObjectCatalogP::
+removeMain (void* arg)
+{
+  TrashRemoval* trash = static_cast<TrashRemoval*>(arg);
+  for (unsigned int i = 0; i < trash->names.size(); ++i)
+  {
+    removeDirectory (trash->dirfd, trash->names[i]);
+  }
+  pthread_mutex_lock (&DIRECTORY_LOCK);
+  releaseDirectory (trash->cache);
+  pthread_mutex_unlock (&DIRECTORY_LOCK);
+  delete trash;
+  return 0;
+}
+
+
+bool
+XmlObjectCatalog::
+setStorage (EnumStorage mode)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  // Conversion syncs everything it writes before it removes anything.
+  EnumDurability durability = _mp->_durability;
+  _mp->_durability = SYNC_FULL;
+  bool ok = _mp->convertStorage (mode);
+  _mp->_durability = durability;
+  return ok;
+}
+
+
+XmlObjectCatalog::EnumStorage
+XmlObjectCatalog::
+storage()
+{
+  return _mp->_backend ? _mp->_backend->storage() : STORAGE_FILES;
+}
+
+
+bool
+XmlObjectCatalog::
+compact()
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (! _mp->_segments)
+    return true;
+  _mp->stopCompactor();
+  CatalogSegments segments (_mp, _mp->_dirfd, _mp->getDirectory());
+  return segments.open() && segments.compact();
+}
+
+
+bool
+XmlObjectCatalogP::
+convertStorage (XmlObjectCatalog::EnumStorage mode)
+{
+  stopCompactor();
+  stopFolder();
+  stopMerger();
+  if (mode == XmlObjectCatalog::STORAGE_MEMORY ||
+      _backend->storage() == XmlObjectCatalog::STORAGE_MEMORY)
+  {
+    failures() << "setStorage: " << _name
+	       << ": memory catalogs cannot be converted";
+    return false;
+  }
+  if (mode == XmlObjectCatalog::STORAGE_SEGMENTS)
+  {
+    if (! _shards.empty() ||
+	_partitioning != XmlObjectCatalog::PARTITION_NONE)
+    {
+      failures() << "setStorage: " << getDirectory()
+		 << " must be flat to use segment storage";
+      return false;
+    }
+    if (! _segments)
+    {
+      CatalogSegments* segments = new CatalogSegments (this, _dirfd,
+						       getDirectory());
+      if (! segments->create())
+      {
+	delete segments;
+	return false;
+      }
+      delete _backend;
+      _backend = segments;
+      _segments = segments;
+      pthread_mutex_lock (&DIRECTORY_LOCK);
+      _cache->segmented = true;
+      pthread_mutex_unlock (&DIRECTORY_LOCK);
+    }
+
+    // Sweep the object files into the segments a batch at a time,
+    // removing each batch only once it is stored.
+    XmlObjectCatalog::key_set_t kset;
+    string error;
+    if (! scanDirectory (_dirfd, kset, error))
+    {
+      failures() << error;
+      return false;
+    }
+    CatalogSegments::text_list_t batch;
+    size_t bytes = 0;
+    bool ok = true;
+    XmlObjectCatalog::key_set_t::iterator it = kset.begin();
+    while (ok && it != kset.end())
+    {
+      string text;
+      if (readFile (_dirfd, objectName(*it), text, 0))
+      {
+	bytes += text.length();
+	batch.push_back (std::make_pair (*it, text));
+      }
+      ++it;
+      if (! batch.empty() && (bytes >= (1 << 20) || it == kset.end()))
+      {
+	ok = _segments->put (batch, true, false, 0, 0);
+	for (unsigned int i = 0; ok && i < batch.size(); ++i)
+	{
+	  unlinkat (_dirfd, objectName(batch[i].first).c_str(), 0);
+	}
+	batch.clear();
+	bytes = 0;
+      }
+    }
+    return ok && syncDirectory (_dirfd);
+  }
+
+  if (! _segments)
+    return true;
+
+  // Write every object back out as a file, and only then drop the
+  // segments, so the catalog is complete in one storage or the other.
+  XmlObjectCatalog::key_set_t kset;
+  bool ok = _segments->list ("", "", kset);
+  XmlObjectCatalog::key_set_t::iterator it;
+  for (it = kset.begin(); ok && it != kset.end(); ++it)
+  {
+    string text;
+    ok = _segments->get (*it, text, 0);
+    CatalogTempFile tmp;
+    ok = ok && writeText (*it, text, tmp) && syncTemp (tmp, true) &&
+      publishTemp (tmp, objectName(*it));
+  }
+  ok = ok && syncDirectory (_dirfd) && _segments->lock();
+  if (! ok)
+    return false;
+  if (unlinkat (_dirfd, SEGMENT_FILE, 0) < 0)
+  {
+    failures() << system_error("removing", fullPath(SEGMENT_FILE));
+    ok = false;
+  }
+  std::vector<string> names;
+  if (ok && listEntries (_dirfd, ".seg-", names))
+  {
+    for (unsigned int i = 0; i < names.size(); ++i)
+    {
+      unlinkat (_dirfd, names[i].c_str(), 0);
+    }
+  }
+  _segments->unlock();
+  if (! ok)
+    return false;
+  delete _backend;
+  _backend = new CatalogFiles (this);
+  _segments = 0;
+  unlinkat (_dirfd, SEGMENT_LOCK, 0);
+  unlinkat (_dirfd, COMPACT_LOCK, 0);
+  pthread_mutex_lock (&DIRECTORY_LOCK);
+  _cache->segmented = false;
+  pthread_mutex_unlock (&DIRECTORY_LOCK);
+  return syncDirectory (_dirfd);
+}
+
+
+void
+XmlObjectCatalogP::
+startCompactor ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  if (_compacting && _compacted)
+  {
+    pthread_join (_compactor, 0);
+    _compacting = false;
+  }
+  if (! _compacting)
+  {
+    _compacted = false;
+    _compacting = (pthread_create (&_compactor, 0, compactorMain, this) == 0);
+  }
+  pthread_mutex_unlock (&_sync_lock);
+}
+
+
+void
+XmlObjectCatalogP::
+stopCompactor ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  bool running = _compacting;
+  _compacting = false;
+  pthread_mutex_unlock (&_sync_lock);
+  if (running)
+  {
+    pthread_join (_compactor, 0);
+  }
+}
+
+
+void*
+XmlObjectCatalogP::
+compactorMain (void* arg)
+{
+  // The compaction has its own view of the segments, and only logs its
+  // errors, so it shares no state with the catalog.
+  XmlObjectCatalogP* cp = static_cast<XmlObjectCatalogP*>(arg);
+  {
+    CatalogSegments segments (0, cp->_dirfd, cp->getDirectory());
+    if (segments.open())
+      segments.compact();
+  }
+  pthread_mutex_lock (&cp->_sync_lock);
+  cp->_compacted = true;
+  pthread_mutex_unlock (&cp->_sync_lock);
+  return 0;
+}
+
+
+CatalogBackend*
+XmlObjectCatalogP::
+readerBackend ()
+{
+  // Segment storage cannot be read alongside the writes of the catalog,
+  // so a background thread reads through its own view of the segments,
+  // as the compactor does.  Files can be read from any thread.  Returns
+  // null if the view cannot be opened.
+  if (! _segments)
+    return new CatalogFiles (this);
+  CatalogSegments* segments =
+    new CatalogSegments (0, _dirfd, getDirectory());
+  if (segments->open())
+    return segments;
+  delete segments;
+  return 0;
+}
+
+
+void
+XmlObjectCatalogP::
+fail (const std::string& msg)
+{
+  // For now we only log the failure and queue it.  Someday
+  // we could enable exceptions on failures.
+  //
+  ELOG << msg;
+  pthread_mutex_lock (&_error_lock);
+  if (_errors.size() >= _that->MAX_PENDING_ERRORS)
+  {
+    std::vector<string>::iterator it =_errors.begin();
+    _errors.erase (it, it+(_errors.size()-_that->MAX_PENDING_ERRORS)+1);
+  }
+  _errors.push_back (msg);
+  pthread_mutex_unlock (&_error_lock);
+}
+
+
+int
+XmlObjectCatalog::
+errorsPending()
+{
+  pthread_mutex_lock (&_mp->_error_lock);
+  int n = _mp->_errors.size();
+  pthread_mutex_unlock (&_mp->_error_lock);
+  return n;
+}
+
+
+std::vector<std::string>
+XmlObjectCatalog::
+getErrors()
+{
+  pthread_mutex_lock (&_mp->_error_lock);
+  std::vector<std::string> errors = _mp->_errors;
+  pthread_mutex_unlock (&_mp->_error_lock);
+  return errors;
+}
+
+
+void
+XmlObjectCatalog::
+clearErrors()
+{
+  pthread_mutex_lock (&_mp->_error_lock);
+  _mp->_errors.erase(_mp->_errors.begin(), _mp->_errors.end());
+  pthread_mutex_unlock (&_mp->_error_lock);
+}
+
+
+std::string
+XmlObjectCatalog::
+lastError()
+{
+  string last;
+  pthread_mutex_lock (&_mp->_error_lock);
+  if (_mp->_errors.size())
+  {
+    last = _mp->_errors.back();
+  }
+  pthread_mutex_unlock (&_mp->_error_lock);
+  return last;
+}
+
+
+XmlObjectCatalog::
+~XmlObjectCatalog()
 {
   delete _mp;
 }
 
 
+XmlObjectCatalogIteratorP::Slot*
+XmlObjectCatalogIteratorP::
+load (unsigned int i)
+{
+  Slot* slot = new Slot;
+  slot->key = keys[i];
+  slot->loaded = cp->loadObject (slot->key, &slot->object, 0);
+  return slot;
+}
+
+
+void*
+XmlObjectCatalogIteratorP::
+readMain (void* arg)
+{
+  XmlObjectCatalogIteratorP* ip = static_cast<XmlObjectCatalogIteratorP*>(arg);
+  pthread_mutex_lock (&ip->lock);
+  while (! ip->stopping && ip->fetched < ip->keys.size())
+  {
+    if (ip->ready.size() >= ip->window)
+    {
+      pthread_cond_wait (&ip->cond, &ip->lock);
+      continue;
+    }
+    unsigned int i = ip->fetched++;
+    pthread_mutex_unlock (&ip->lock);
+    Slot* slot = ip->load (i);
+    pthread_mutex_lock (&ip->lock);
+    ip->ready.push_back (slot);
+    pthread_cond_broadcast (&ip->cond);
+  }
+  pthread_mutex_unlock (&ip->lock);
+  return 0;
+}
+
+
+XmlObjectCatalogIterator::
+XmlObjectCatalogIterator (XmlObjectCatalog& catalog, const std::string& from,
+			  const std::string& to, unsigned int window) :
+  _ip (new XmlObjectCatalogIteratorP)
+{
+  _ip->cp = catalog._mp;
+  XmlObjectCatalog::key_set_t kset;
+  catalog.keys (from, to, kset);
+  _ip->keys.assign (kset.begin(), kset.end());
+  _ip->fetched = 0;
+  _ip->delivered = 0;
+  _ip->window = window;
+  _ip->threaded = false;
+  _ip->stopping = false;
+  pthread_mutex_init (&_ip->lock, 0);
+  pthread_cond_init (&_ip->cond, 0);
+
+  // Only read ahead where reads can run alongside whatever the caller
+  // does to the catalog in the meantime.
+  if (catalog.isOpen() && _ip->cp->_backend->concurrentReads() &&
+      _ip->keys.size())
+  {
+    _ip->threaded = (pthread_create (&_ip->reader, 0,
+				     XmlObjectCatalogIteratorP::readMain,
+				     _ip) == 0);
+  }
+}
+
+
+bool
+XmlObjectCatalogIterator::
+next (std::string& key, XmlObjectInterface* object)
+{
+  typedef XmlObjectCatalogIteratorP::Slot Slot;
+  bool found = false;
+  pthread_mutex_lock (&_ip->lock);
+  while (! found && _ip->delivered < _ip->keys.size())
+  {
+    Slot* slot = 0;
+    if (! _ip->ready.empty())
+    {
+      slot = _ip->ready.front();
+      _ip->ready.pop_front();
+      pthread_cond_broadcast (&_ip->cond);
+    }
+    else if (_ip->fetched == _ip->delivered &&
+	     (! _ip->threaded || _ip->window == 0))
+    {
+      // Nothing is being read ahead, so read the next one now.
+      unsigned int i = _ip->fetched++;
+      pthread_mutex_unlock (&_ip->lock);
+      slot = _ip->load (i);
+      pthread_mutex_lock (&_ip->lock);
+    }
+    else
+    {
+      pthread_cond_wait (&_ip->cond, &_ip->lock);
+      continue;
+    }
+    ++_ip->delivered;
+    pthread_mutex_unlock (&_ip->lock);
+    if (slot->loaded)
+    {
+      key = slot->key;
+      found = object->copyDocument (slot->object);
+    }
+    delete slot;
+    pthread_mutex_lock (&_ip->lock);
+  }
+  pthread_mutex_unlock (&_ip->lock);
+  return found;
+}
+
+
+void
+XmlObjectCatalogIterator::
+setWindow (unsigned int window)
+{
+  pthread_mutex_lock (&_ip->lock);
+  _ip->window = window;
+  pthread_cond_broadcast (&_ip->cond);
+  pthread_mutex_unlock (&_ip->lock);
+}
+
+
+XmlObjectCatalogIterator::
+~XmlObjectCatalogIterator()
+{
+  pthread_mutex_lock (&_ip->lock);
+  _ip->stopping = true;
+  pthread_cond_broadcast (&_ip->cond);
+  pthread_mutex_unlock (&_ip->lock);
+  if (_ip->threaded)
+    pthread_join (_ip->reader, 0);
+  while (! _ip->ready.empty())
+  {
+    delete _ip->ready.front();
+    _ip->ready.pop_front();
+  }
+  pthread_cond_destroy (&_ip->cond);
+  pthread_mutex_destroy (&_ip->lock);
+  delete _ip;
+}
+
+
+bool
+XmlObjectCatalogWatchP::
+addWatch (const std::string& dir)
+{
+  string path = cp->_directory + (dir.length() ? "/" + dir : "");
+  int wd = inotify_add_watch (fd, path.c_str(),
+			      IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+			      IN_DELETE | IN_ONLYDIR);
+  if (wd < 0)
+  {
+    cp->failures() << system_error("watching catalog directory", path);
+    return false;
+  }
+  dirs[wd] = dir;
+  return true;
+}
+
+
+bool
+XmlObjectCatalogWatchP::
+resync (std::map<string, bool>& present)
+{
+  // Take whether each key exists from a fresh listing instead of the
+  // events, and add every key which has come or gone since the keys
+  // were last known.
+  XmlObjectCatalog::key_set_t now;
+  if (! catalog->keys (now))
+    return false;
+  std::map<string, bool>::iterator pt;
+  for (pt = present.begin(); pt != present.end(); ++pt)
+  {
+    pt->second = now.count (pt->first);
+  }
+  XmlObjectCatalog::key_set_t::iterator it;
+  for (it = keys.begin(); it != keys.end(); ++it)
+  {
+    if (! now.count (*it))
+      present[*it] = false;
+  }
+  for (it = now.begin(); it != now.end(); ++it)
+  {
+    if (! keys.count (*it))
+      present[*it] = true;
+  }
+  return true;
+}
+
+
+void
+XmlObjectCatalogWatchP::
+close ()
+{
+  if (fd >= 0)
+    ::close (fd);
+  fd = -1;
+  dirs.clear();
+  keys.clear();
+}
+
+
+XmlObjectCatalogWatch::
+XmlObjectCatalogWatch () :
+  _wp (new XmlObjectCatalogWatchP)
+{
+}
+
+
+bool
+XmlObjectCatalogWatch::
+watch (XmlObjectCatalog& catalog)
+{
+  _wp->close();
+  _wp->catalog = &catalog;
+  _wp->cp = catalog._mp;
+  if (! catalog.isOpen())
+    return false;
+  XmlObjectCatalogP* cp = _wp->cp;
+  if (cp->_backend->storage() != XmlObjectCatalog::STORAGE_FILES)
+  {
+    cp->failures() << "cannot watch catalog " << cp->_name
+		   << " unless it is stored in files";
+    return false;
+  }
+  _wp->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (_wp->fd < 0)
+  {
+    cp->failures() << system_error("inotify_init1", cp->_directory);
+    return false;
+  }
+
+  // Watch first and then list the keys, so nothing is missed in between.
+  bool ok = _wp->addWatch ("");
+  for (unsigned int i = 0; ok && i < cp->_shards.size(); ++i)
+  {
+    ok = _wp->addWatch (XmlObjectCatalogP::shardName(i));
+  }
+  std::vector<string> parts;
+  if (ok && cp->_partitioning != XmlObjectCatalog::PARTITION_NONE)
+    ok = cp->listEntries (cp->_dirfd, ".part-", parts);
+  for (unsigned int i = 0; ok && i < parts.size(); ++i)
+  {
+    ok = _wp->addWatch (parts[i]);
+  }
+  ok = ok && catalog.keys (_wp->keys);
+  if (! ok)
+    _wp->close();
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogWatch::
+wait (change_list_t& changes, int timeout_ms)
+{
+  changes.clear();
+  if (_wp->fd < 0)
+    return false;
+  XmlObjectCatalogP* cp = _wp->cp;
+  struct pollfd pfd;
+  pfd.fd = _wp->fd;
+  pfd.events = POLLIN;
+  int n = poll (&pfd, 1, timeout_ms);
+  if (n < 0 && errno != EINTR)
+  {
+    cp->failures() << system_error("waiting for catalog changes",
+				   cp->_directory);
+    return false;
+  }
+  if (n <= 0)
+    return true;
+
+  // Work out from the events whether each key they name exists now.
+  std::map<string, bool> present;
+  bool overflow = false;
+  char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read (_wp->fd, buf, sizeof(buf))) > 0)
+  {
+    for (char* p = buf; p < buf + len; )
+    {
+      struct inotify_event* ev = (struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      string name (ev->len ? ev->name : "");
+      bool added = (ev->mask & (IN_CREATE | IN_MOVED_TO));
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+	overflow = true;
+      }
+      else if (ev->mask & IN_IGNORED)
+      {
+	// A partition which has been dropped.
+	_wp->dirs.erase (ev->wd);
+	overflow = true;
+      }
+      else if (ev->mask & IN_ISDIR)
+      {
+	// A new partition may already hold objects, and a dropped one
+	// takes all of its objects with it.  Other directories are
+	// catalogs of their own.
+	if (name.compare (0, 6, ".part-") != 0)
+	  continue;
+	if (added && ! _wp->addWatch (name))
+	  return false;
+	overflow = true;
+      }
+      else if (name.length() > 4 && name.substr(name.length()-4) == ".xml")
+      {
+	present[name.substr(0, name.length()-4)] = added;
+      }
+    }
+  }
+  if (overflow && ! _wp->resync (present))
+    return false;
+
+  std::map<string, bool>::iterator it;
+  for (it = present.begin(); it != present.end(); ++it)
+  {
+    Change change;
+    change.key = it->first;
+    bool known = _wp->keys.count (it->first);
+    if (it->second && known)
+      change.change = KEY_REPLACED;
+    else if (it->second)
+      change.change = KEY_INSERTED;
+    else if (known)
+      change.change = KEY_REMOVED;
+    else
+      continue;
+    if (it->second)
+      _wp->keys.insert (it->first);
+    else
+      _wp->keys.erase (it->first);
+    changes.push_back (change);
+  }
+  return true;
+}
+
+
+int
+XmlObjectCatalogWatch::
+fd ()
+{
+  return _wp->fd;
+}
+
+
+XmlObjectCatalogWatch::
+~XmlObjectCatalogWatch()
+{
+  _wp->close();
+  delete _wp;
+}
@@ -0,0 +1,522 @@
+//
+// $Id$
+//
+
+#include "XmlObjectCatalogP.h"
+
+#include "logx/system_error.h"
+
+using namespace domx;
+using std::string;
+
+using logx::system_error;
+
+
+bool
+CatalogFiles::
+unchanged (const std::string& id, const std::string& text)
+{
+  // The attribute only vouches for the file if the file still has the
+  // size and modification time it had when the attribute was set, since
+  // editing it in place keeps the attribute.  On a filesystem without
+  // user attributes the file is read instead, and is unchanged if it has
+  // the size and checksum of the text.  A missing object or attribute
+  // just means the object is written.
+  int dirfd = cp->objectDir(id);
+  if (dirfd < 0)
+    return false;
+  int fd = openat (dirfd, XmlObjectCatalogP::objectName(id).c_str(),
+		   O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat sbuf;
+  char value[128];
+  ssize_t n = -1;
+  bool same = false;
+  bool ok = (fstat (fd, &sbuf) == 0);
+  if (ok && cp->useXattr())
+    n = fgetxattr (fd, FINGERPRINT_XATTR, value, sizeof(value));
+  if (ok && n < 0 && (! cp->useXattr() || errno == ENOTSUP))
+  {
+    cp->noXattr();
+    if (sbuf.st_size == (off_t)text.length())
+    {
+      string current (text.length(), '\0');
+      same = (readAt (fd, 0, current) &&
+	      textChecksum (current) == textChecksum (text));
+    }
+  }
+  close (fd);
+  if (n <= 0)
+    return same;
+  return string (value, n) == XmlObjectCatalogP::fingerprint (text, sbuf);
+}
+
+
+bool
+CatalogFiles::
+put (const text_list_t& objects, bool batch, bool absent,
+     const XmlObjectCatalog::ObjectVersion* expected,
+     std::vector<XmlObjectCatalog::ObjectVersion>* versions)
+{
+  std::vector<XmlObjectCatalog::ObjectVersion> stored (objects.size());
+  bool ok = true;
+  if (batch)
+    ok = putBatch (objects, stored);
+  for (unsigned int i = 0; ok && ! batch && i < objects.size(); ++i)
+  {
+    if (expected)
+      ok = replace (objects[i].first, objects[i].second, *expected,
+		    stored[i]);
+    else
+      ok = putOne (objects[i].first, objects[i].second, absent, stored[i]);
+  }
+  if (ok && versions)
+    versions->swap (stored);
+  return ok;
+}
+
+
+bool
+CatalogFiles::
+putOne (const std::string& id, const std::string& text, bool absent,
+	XmlObjectCatalog::ObjectVersion& version)
+{
+  CatalogTempFile tmp;
+  if (! cp->writeText (id, text, tmp))
+    return false;
+
+  XmlObjectCatalog::EnumDurability mode = cp->_durability;
+  if ((mode == XmlObjectCatalog::SYNC_DATA ||
+       mode == XmlObjectCatalog::SYNC_FULL) &&
+      ! cp->syncTemp (tmp, mode == XmlObjectCatalog::SYNC_DATA))
+  {
+    return false;
+  }
+  string filename = XmlObjectCatalogP::objectName(id);
+  bool existed;
+  int fd = -1;
+  if (! absent && ! lockObject (tmp.dirfd, filename, fd))
+  {
+    cp->discardTemp (tmp);
+    return false;
+  }
+  bool ok = absent ? cp->publishNew (tmp, filename, existed) :
+    cp->publishTemp (tmp, filename);
+  if (fd >= 0)
+    close (fd);
+  if (! ok)
+    return false;
+  version = tmp.version;
+
+  if (mode == XmlObjectCatalog::SYNC_FULL)
+    return cp->syncDirectory (tmp.dirfd);
+  if (mode == XmlObjectCatalog::SYNC_PERIODIC)
+    cp->markDirty();
+  return true;
+}
+
+
+bool
+CatalogFiles::
+putBatch (const text_list_t& objects,
+	  std::vector<XmlObjectCatalog::ObjectVersion>& versions)
+{
+  // Write every object to its temporary file, then sync them all, before
+  // any of them become visible.
+  std::vector<CatalogTempFile> tmpfiles (objects.size());
+  bool ok = true;
+  for (unsigned int i = 0; ok && i < objects.size(); ++i)
+  {
+    ok = cp->writeText (objects[i].first, objects[i].second, tmpfiles[i]);
+  }
+  for (unsigned int i = 0; ok && i < tmpfiles.size(); ++i)
+  {
+    ok = cp->syncTemp (tmpfiles[i], false);
+  }
+
+  // Lock the existing objects in key order, so batches which share keys
+  // cannot each wait on the other, and hold the locks until the batch is
+  // published or rolled back.
+  std::vector<std::pair<string, unsigned int> > order;
+  for (unsigned int i = 0; i < objects.size(); ++i)
+  {
+    order.push_back (std::make_pair (objects[i].first, i));
+  }
+  std::sort (order.begin(), order.end());
+  std::vector<int> locks;
+  for (unsigned int i = 0; ok && i < order.size(); ++i)
+  {
+    if (i > 0 && order[i].first == order[i-1].first)
+      continue;
+    int fd;
+    ok = lockObject (tmpfiles[order[i].second].dirfd,
+		     XmlObjectCatalogP::objectName(order[i].first), fd);
+    if (ok && fd >= 0)
+      locks.push_back (fd);
+  }
+
+  // Publish each object, but first keep a hard link to any existing
+  // object so it can be restored if a later step fails.
+  std::vector<string> backups;
+  unsigned int renamed = 0;
+  for ( ; ok && renamed < tmpfiles.size(); ++renamed)
+  {
+    string filename = XmlObjectCatalogP::objectName(objects[renamed].first);
+    string backup = filename + XmlObjectCatalogP::uniqueSuffix() + "-backup";
+    int dirfd = tmpfiles[renamed].dirfd;
+    if (linkat (dirfd, filename.c_str(), dirfd, backup.c_str(), 0) == 0)
+    {
+      backups.push_back (backup);
+    }
+    else if (errno == ENOENT)
+    {
+      backups.push_back ("");
+    }
+    else
+    {
+      cp->failures() << system_error("linking backup",
+				     cp->fullPath(dirfd, backup));
+      ok = false;
+      break;
+    }
+    if (! cp->publishTemp (tmpfiles[renamed], filename))
+    {
+      ok = false;
+      break;
+    }
+    versions[renamed] = tmpfiles[renamed].version;
+  }
+
+  if (ok)
+  {
+    std::vector<int> dirs;
+    for (unsigned int i = 0; i < tmpfiles.size(); ++i)
+    {
+      dirs.push_back (tmpfiles[i].dirfd);
+    }
+    ok = cp->syncDirectories (dirs);
+  }
+
+  if (! ok)
+  {
+    // Roll back: restore or remove whatever has been renamed so far and
+    // discard the temporary files which were never published.
+    for (unsigned int i = 0; i < renamed; ++i)
+    {
+      int dirfd = tmpfiles[i].dirfd;
+      string filename = XmlObjectCatalogP::objectName(objects[i].first);
+      if (backups[i].length())
+	renameat (dirfd, backups[i].c_str(), dirfd, filename.c_str());
+      else
+	unlinkat (dirfd, filename.c_str(), 0);
+    }
+    for (unsigned int i = renamed; i < tmpfiles.size(); ++i)
+    {
+      cp->discardTemp (tmpfiles[i]);
+    }
+  }
+  for (unsigned int i = 0; i < backups.size(); ++i)
+  {
+    if (backups[i].length())
+      unlinkat (tmpfiles[i].dirfd, backups[i].c_str(), 0);
+  }
+  for (unsigned int i = 0; i < locks.size(); ++i)
+  {
+    close (locks[i]);
+  }
+  return ok;
+}
+
+
+bool
+CatalogFiles::
+replace (const std::string& id, const std::string& text,
+	 const XmlObjectCatalog::ObjectVersion& expected,
+	 XmlObjectCatalog::ObjectVersion& version)
+{
+  // Get the replacement ready first to keep the lock window short.
+  CatalogTempFile tmp;
+  if (! cp->writeText (id, text, tmp))
+    return false;
+
+  XmlObjectCatalog::EnumDurability mode = cp->_durability;
+  if ((mode == XmlObjectCatalog::SYNC_DATA ||
+       mode == XmlObjectCatalog::SYNC_FULL) &&
+      ! cp->syncTemp (tmp, mode == XmlObjectCatalog::SYNC_DATA))
+  {
+    return false;
+  }
+
+  // Lock the current object, as every writer of this key does, then check
+  // that it is still the expected version.  The name is never missing
+  // meanwhile, and a writer which fails leaves it untouched.
+  string filename = XmlObjectCatalogP::objectName(id);
+  int dirfd = tmp.dirfd;
+  int fd;
+  if (! lockObject (dirfd, filename, fd) || fd < 0)
+  {
+    cp->discardTemp (tmp);
+    return false;
+  }
+
+  string current_text;
+  XmlObjectCatalog::ObjectVersion current;
+  struct stat sbuf;
+  bool replaced = false;
+  if (fstat (fd, &sbuf) == 0 &&
+      cp->readFile (dirfd, filename, current_text, &current) &&
+      current == expected && current.inode == (unsigned long long)sbuf.st_ino)
+  {
+    replaced = cp->publishTemp (tmp, filename);
+    version = tmp.version;
+  }
+  else
+  {
+    cp->discardTemp (tmp);
+  }
+  close (fd);
+  if (! replaced)
+    return false;
+
+  if (mode == XmlObjectCatalog::SYNC_FULL)
+    return cp->syncDirectory (dirfd);
+  if (mode == XmlObjectCatalog::SYNC_PERIODIC)
+    cp->markDirty();
+  return true;
+}
+
+
+bool
+CatalogFiles::
+lockObject (int dirfd, const std::string& filename, int& fd)
+{
+  // Every writer of an existing object holds an flock() on the object
+  // file while it checks and replaces it, so a conditional replace sees
+  // no other write between its check and its rename.  The lock has to be
+  // on the file the name holds once it is granted, or a writer which got
+  // there first has already replaced it.  Leaves @p fd -1 if there is no
+  // such object.
+  fd = -1;
+  for (;;)
+  {
+    fd = openat (dirfd, filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT)
+      return true;
+    if (fd < 0)
+    {
+      cp->failures() << system_error("opening",
+				     cp->fullPath(dirfd, filename));
+      return false;
+    }
+    int result;
+    while ((result = flock (fd, LOCK_EX)) < 0 && errno == EINTR)
+      ;
+    if (result < 0)
+    {
+      cp->failures() << system_error("locking",
+				     cp->fullPath(dirfd, filename));
+      close (fd);
+      fd = -1;
+      return false;
+    }
+    struct stat locked, current;
+    if (fstat (fd, &locked) < 0 ||
+	(fstatat (dirfd, filename.c_str(), &current, 0) < 0 &&
+	 errno != ENOENT))
+    {
+      cp->failures() << system_error("checking",
+				     cp->fullPath(dirfd, filename));
+      close (fd);
+      fd = -1;
+      return false;
+    }
+    if (locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+      return true;
+    close (fd);
+  }
+}
+
+
+bool
+CatalogFiles::
+get (const std::string& id, std::string& text,
+     XmlObjectCatalog::ObjectVersion* version)
+{
+  return cp->readFile (cp->objectDir(id), XmlObjectCatalogP::objectName(id),
+		       text, version);
+}
+
+
+bool
+CatalogFiles::
+stat (const std::string& id, XmlObjectCatalog::ObjectVersion& version)
+{
+  string filename = XmlObjectCatalogP::objectName(id);
+  int dirfd = cp->objectDir(id);
+  struct stat sbuf;
+  if (fstatat (dirfd, filename.c_str(), &sbuf, 0) < 0)
+  {
+    if (errno != ENOENT)
+      cp->failures() << system_error("loading ",
+				     cp->fullPath(dirfd, filename));
+    return false;
+  }
+  version = XmlObjectCatalog::ObjectVersion();
+  XmlObjectCatalogP::toVersion (sbuf, version);
+  return true;
+}
+
+
+bool
+CatalogFiles::
+remove (const std::string& id)
+{
+  string filename = XmlObjectCatalogP::objectName(id);
+  int dirfd = cp->objectDir(id);
+  int fd;
+  if (! lockObject (dirfd, filename, fd))
+    return false;
+  if (fd < 0)
+    return true;
+  int result = unlinkat (dirfd, filename.c_str(), 0);
+  int error = errno;
+  close (fd);
+  if (result < 0 && error != ENOENT)
+  {
+    errno = error;
+    cp->failures() << system_error("unlink", cp->fullPath(dirfd, filename));
+    return false;
+  }
+  if (result == 0 && cp->_durability == XmlObjectCatalog::SYNC_FULL)
+    return cp->syncDirectory (dirfd);
+  if (result == 0 && cp->_durability == XmlObjectCatalog::SYNC_PERIODIC)
+    cp->markDirty();
+  return true;
+}
+
+
+bool
+CatalogFiles::
+rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest)
+{
+  if (dest->storage() != XmlObjectCatalog::STORAGE_FILES)
+    return CatalogBackend::rename (names, dest);
+  XmlObjectCatalogP* dp = dest->cp;
+  if (dp->_dirfd == cp->_dirfd)
+    return true;
+
+  // Each object is renamed straight into the destination directory,
+  // unless it is on another filesystem and has to be copied.
+  bool ok = true;
+  std::vector<int> srcdirs;
+  std::vector<int> destdirs;
+  XmlObjectCatalog::key_set_t::const_iterator it;
+  for (it = names.begin(); it != names.end(); ++it)
+  {
+    string filename = XmlObjectCatalogP::objectName(*it);
+    int dirfd = cp->objectDir(*it);
+    int destfd = dp->objectDir(*it, true);
+    if (destfd < 0)
+    {
+      ok = false;
+      continue;
+    }
+    // Both objects are locked like any other write, always in path order
+    // so that moves each way between two catalogs cannot wait on each
+    // other, and released before a copy, which locks them itself.
+    CatalogFiles* df = static_cast<CatalogFiles*>(dest);
+    int srclock = -1;
+    int destlock = -1;
+    bool locked;
+    if (cp->fullPath(dirfd, filename) < dp->fullPath(destfd, filename))
+      locked = lockObject (dirfd, filename, srclock) &&
+	df->lockObject (destfd, filename, destlock);
+    else
+      locked = df->lockObject (destfd, filename, destlock) &&
+	lockObject (dirfd, filename, srclock);
+    int result = -1;
+    int error = errno;
+    if (locked)
+    {
+      result = renameat (dirfd, filename.c_str(), destfd, filename.c_str());
+      error = errno;
+    }
+    if (srclock >= 0)
+      close (srclock);
+    if (destlock >= 0)
+      close (destlock);
+    if (! locked)
+    {
+      ok = false;
+    }
+    else if (result == 0)
+    {
+      srcdirs.push_back (dirfd);
+      destdirs.push_back (destfd);
+    }
+    else if (error == EXDEV)
+    {
+      XmlObjectCatalog::key_set_t one;
+      one.insert (*it);
+      ok = CatalogBackend::rename (one, dest) && ok;
+    }
+    else
+    {
+      errno = error;
+      cp->failures() << system_error("moving", cp->fullPath(dirfd, filename));
+      ok = false;
+    }
+  }
+  if (srcdirs.empty())
+    return ok;
+
+  // The object must be in the destination directory on disk before it
+  // leaves this one.
+  if (dp->_durability == XmlObjectCatalog::SYNC_FULL)
+    ok = dp->syncDirectories (destdirs) && ok;
+  else if (dp->_durability == XmlObjectCatalog::SYNC_PERIODIC)
+    dp->markDirty();
+  if (cp->_durability == XmlObjectCatalog::SYNC_FULL)
+    ok = cp->syncDirectories (srcdirs) && ok;
+  else if (cp->_durability == XmlObjectCatalog::SYNC_PERIODIC)
+    cp->markDirty();
+  return ok;
+}
+
+
+bool
+CatalogFiles::
+list (const std::string& from, const std::string& to,
+      XmlObjectCatalog::key_set_t& kset)
+{
+  // Keys without a time prefix stay in the catalog directory even when
+  // it is partitioned.
+  std::vector<int> dirs;
+  if (! cp->_shards.empty())
+    dirs = cp->_shards;
+  else
+    dirs.push_back (cp->_dirfd);
+  if (cp->_partitioning != XmlObjectCatalog::PARTITION_NONE &&
+      ! cp->partitionDirs (from, to, dirs))
+  {
+    return false;
+  }
+  return cp->scanDirectories (dirs, kset);
+}
+
+
+bool
+CatalogFiles::
+exists (const std::string& id, bool& found)
+{
+  string filename = XmlObjectCatalogP::objectName(id);
+  int dirfd = cp->objectDir(id);
+  struct stat sbuf;
+  found = (fstatat (dirfd, filename.c_str(), &sbuf, 0) == 0);
+  if (found || errno == ENOENT)
+    return true;
+  cp->failures() << system_error("checking existence",
+				 cp->fullPath(dirfd, filename));
+  return false;
+}
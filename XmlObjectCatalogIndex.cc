@@ -0,0 +1,1019 @@
+//
+// $Id$
+//
+
+#include "XmlObjectCatalogP.h"
+
+#include "logx/system_error.h"
+
+using namespace domx;
+using std::string;
+
+using logx::system_error;
+
+
+bool
+XmlObjectCatalogP::
+indexElements (const std::string& path, std::vector<std::string>& elements)
+{
+  elements.clear();
+  string::size_type pos = 0;
+  while (pos <= path.length())
+  {
+    string::size_type slash = path.find ('/', pos);
+    if (slash == string::npos)
+      slash = path.length();
+    if (slash == pos)
+      return false;
+    elements.push_back (path.substr (pos, slash - pos));
+    pos = slash + 1;
+  }
+  return ! elements.empty();
+}
+
+
+string
+XmlObjectCatalogP::
+indexName (const std::string& text)
+{
+  // Escape whatever cannot be in a file name, the escape character, and
+  // a leading dot, which keeps index names apart from anything else in
+  // the index directory.
+  string name;
+  for (string::size_type i = 0; i < text.length(); ++i)
+  {
+    unsigned char c = text[i];
+    if (c == '/' || c == '%' || c == 0 || (i == 0 && c == '.'))
+    {
+      char hex[4];
+      snprintf (hex, sizeof(hex), "%%%02X", c);
+      name += hex;
+    }
+    else
+      name += c;
+  }
+  return name;
+}
+
+
+string
+XmlObjectCatalogP::
+indexLine (const std::string& value, const std::string& key,
+	   const XmlObjectCatalog::ObjectVersion& v)
+{
+  char version[120];
+  snprintf (version, sizeof(version), "%llx %llx %llx %llx %llx\n",
+	    v.device, v.inode, (unsigned long long)v.mtime_ns,
+	    (unsigned long long)v.size, v.checksum);
+  return escapeField (value) + "\t" + escapeField (key) + "\t" + version;
+}
+
+
+bool
+XmlObjectCatalogP::
+parseIndexLine (const std::string& line, std::string& value,
+		std::string& key, XmlObjectCatalog::ObjectVersion& v)
+{
+  string::size_type tab = line.find ('\t');
+  string::size_type tab2 = line.find ('\t', tab + 1);
+  unsigned long long mtime, size;
+  if (tab == string::npos || tab2 == string::npos ||
+      sscanf (line.c_str() + tab2 + 1, "%llx %llx %llx %llx %llx",
+	      &v.device, &v.inode, &mtime, &size, &v.checksum) != 5)
+  {
+    return false;
+  }
+  v.mtime_ns = mtime;
+  v.size = size;
+  value = unescapeField (line.substr (0, tab));
+  key = unescapeField (line.substr (tab + 1, tab2 - tab - 1));
+  return true;
+}
+
+
+string
+XmlObjectCatalogP::
+lineEnds (const std::string& text)
+{
+  // Line ends become a single newline, as the parser reads them.
+  string out;
+  for (string::size_type i = 0; i < text.length(); ++i)
+  {
+    if (text[i] != '\r')
+      out += text[i];
+    else if (i + 1 == text.length() || text[i+1] != '\n')
+      out += '\n';
+  }
+  return out;
+}
+
+
+bool
+XmlObjectCatalogP::
+memberText (const std::string& text, const std::vector<std::string>& path,
+	    std::string& value)
+{
+  // Scan the markup for the first element along the path below the
+  // document element, counting how much of the path the open elements
+  // match.  Its text is read as the parser reads it: character data with
+  // every reference decoded and CDATA sections as they are, skipping
+  // comments and processing instructions, up to its first child element
+  // or its end tag, and trimmed of the whitespace a parse trims.
+  std::istringstream in (text);
+  XmlObjectReaderP reader (in, text.length());
+  unsigned int depth = 0;
+  unsigned int matched = 0;
+  bool member = false;
+  string chars;
+  string token;
+  while (true)
+  {
+    chars.clear();
+    if (! reader.copyText (member ? &chars : 0))
+      return false;
+    if (member)
+      value += unescapeText (lineEnds (chars));
+    token = "<";
+    if (! reader.readMarkup (token))
+      return false;
+    if (token.compare (0, 9, "<![CDATA[") == 0)
+    {
+      if (member)
+	value += lineEnds (token.substr (9, token.length() - 12));
+    }
+    else if (XmlObjectReaderP::isEndTag (token))
+    {
+      if (member)
+	break;
+      if (depth > 0)
+	--depth;
+      if (matched > 0 && depth == matched)
+	--matched;
+    }
+    else if (XmlObjectReaderP::isTag (token))
+    {
+      if (member)
+	break;
+      bool empty = XmlObjectReaderP::isEmptyTag (token);
+      if (depth == matched + 1 && matched < path.size() &&
+	  XmlObjectReaderP::tagName (token) == path[matched])
+      {
+	if (++matched == path.size())
+	{
+	  value.clear();
+	  if (empty)
+	    return true;
+	  member = true;
+	}
+	else if (empty)
+	  --matched;
+      }
+      if (! empty)
+	++depth;
+    }
+  }
+  value.erase (0, value.find_first_not_of (" \t\n"));
+  value.erase (value.find_last_not_of (" \t\n") + 1);
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+searchIndex (int fd, const std::string& prefix,
+	     std::vector<std::string>& lines)
+{
+  // Binary search the sorted file for the first line which starts with
+  // @p prefix, then read on while the lines do.  Every line before @c lo
+  // sorts before the prefix, and @c hi is the start of a line which does
+  // not or the end of the file.  Once the probes stop landing on a new
+  // line start between them, the rest is read in order.
+  struct stat sbuf;
+  if (fstat (fd, &sbuf) < 0)
+    return false;
+  off_t lo = 0;
+  off_t hi = sbuf.st_size;
+  string line;
+  while (hi - lo > INDEX_BLOCK)
+  {
+    off_t mid = lo + (hi - lo) / 2;
+    if (! readLine (fd, mid - 1, line))
+      return errno == 0;
+    off_t start = mid - 1 + line.length();
+    if (start >= hi)
+      break;
+    if (! readLine (fd, start, line))
+      return errno == 0;
+    if (line < prefix)
+      lo = start + line.length();
+    else
+      hi = start;
+  }
+  for (off_t pos = lo; readLine (fd, pos, line); pos += line.length())
+  {
+    if (line.compare (0, prefix.length(), prefix) == 0)
+      lines.push_back (line);
+    else if (line > prefix)
+      return true;
+  }
+  return errno == 0;
+}
+
+
+bool
+XmlObjectCatalogP::
+openIndexes (bool create)
+{
+  // A catalog keeps indexes once the index directory exists.
+  if (create && mkdirat (_dirfd, INDEX_DIR, 0775) < 0 && errno != EEXIST)
+  {
+    failures() << system_error("creating index directory",
+			       fullPath(INDEX_DIR));
+    return false;
+  }
+  _index_fd = openat (_dirfd, INDEX_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (_index_fd < 0 && errno != ENOENT)
+  {
+    failures() << system_error("opening index directory",
+			       fullPath(INDEX_DIR));
+    return false;
+  }
+  _index_mtime = -1;
+  return true;
+}
+
+
+void
+XmlObjectCatalogP::
+closeIndexes ()
+{
+  pthread_mutex_lock (&_index_lock);
+  _indexes.clear();
+  _index_mtime = -1;
+  pthread_mutex_unlock (&_index_lock);
+}
+
+
+bool
+XmlObjectCatalogP::
+currentIndexes (std::vector<CatalogIndex>& indexes)
+{
+  // Writers know an index by its log, which exists from the moment the
+  // index is created, while only an index whose sorted file has been
+  // built can answer lookups.  The list is read again whenever the
+  // directory has changed since, or changed so shortly before the list
+  // was read that a later change could have left the same time.
+  pthread_mutex_lock (&_index_lock);
+  struct stat sbuf;
+  bool ok = (fstat (_index_fd, &sbuf) == 0);
+  if (! ok)
+    failures() << system_error("reading index directory",
+			       fullPath(INDEX_DIR));
+  long long mtime = (long long)sbuf.st_mtim.tv_sec * 1000000000LL +
+    sbuf.st_mtim.tv_nsec;
+  if (ok && (mtime != _index_mtime || _index_listed < sbuf.st_mtime + 2))
+  {
+    time_t now = time (0);
+    std::vector<string> names;
+    ok = listEntries (_index_fd, "", names);
+    std::set<string> nset (names.begin(), names.end());
+    _indexes.clear();
+    string log (INDEX_LOG);
+    for (unsigned int i = 0; ok && i < names.size(); ++i)
+    {
+      const string& name = names[i];
+      if (name.length() <= log.length() ||
+	  name.compare (name.length() - log.length(), log.length(), log) != 0)
+	continue;
+      CatalogIndex index;
+      index.name = name.substr (0, name.length() - log.length());
+      index.path = unescapeField (index.name);
+      indexElements (index.path, index.elements);
+      index.built = nset.count (index.name + INDEX_FILE) > 0;
+      _indexes.push_back (index);
+    }
+    _index_mtime = ok ? mtime : -1;
+    _index_listed = now;
+  }
+  if (ok)
+    indexes = _indexes;
+  pthread_mutex_unlock (&_index_lock);
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+findIndex (const std::string& path, CatalogIndex& index, bool& found)
+{
+  found = false;
+  std::vector<CatalogIndex> indexes;
+  if (_index_fd < 0)
+    return true;
+  if (! currentIndexes (indexes))
+    return false;
+  for (unsigned int i = 0; ! found && i < indexes.size(); ++i)
+  {
+    found = (indexes[i].path == path);
+    if (found)
+      index = indexes[i];
+  }
+  return true;
+}
+
+
+int
+XmlObjectCatalogP::
+lockIndex (const CatalogIndex& index, int operation, bool writing)
+{
+  // Lock the log of an index through a descriptor of its own, so threads
+  // exclude each other just as processes do, and closing it releases the
+  // lock.  A merge replaces the log, so once the lock is held make sure
+  // it is on the current file, otherwise start again on that one.
+  // Returns -1 without an error queued and errno ENOENT if the index has
+  // been dropped, or EWOULDBLOCK if the lock was not to wait.
+  string logname = index.name + INDEX_LOG;
+  int fd;
+  int result;
+  struct stat locked, current;
+  while (true)
+  {
+    fd = openat (_index_fd, logname.c_str(),
+		 (writing ? O_RDWR | O_APPEND : O_RDONLY) | O_CLOEXEC);
+    result = (fd >= 0) ? flock (fd, operation) : -1;
+    while (result < 0 && fd >= 0 && errno == EINTR)
+      result = flock (fd, operation);
+    if (result < 0 || fstat (fd, &locked) < 0)
+      break;
+    if (fstatat (_index_fd, logname.c_str(), &current, 0) < 0)
+      break;
+    if (locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+      return fd;
+    close (fd);
+  }
+  int error = errno;
+  if (fd >= 0)
+    close (fd);
+  errno = error;
+  if (errno != ENOENT && errno != EWOULDBLOCK)
+    failures() << system_error("locking index", fullPath(_index_fd, logname));
+  return -1;
+}
+
+
+bool
+XmlObjectCatalogP::
+appendIndex (const CatalogIndex& index, const std::string& records)
+{
+  // Records go in with a single write under a shared lock, which only
+  // keeps them out of the moments a merge holds the log, so appends and
+  // lookups never wait on each other.  The writer which takes the log
+  // past an eighth of the sorted file starts the merger.
+  if (records.empty())
+    return true;
+  int fd = lockIndex (index, LOCK_SH, true);
+  if (fd < 0)
+    return errno == ENOENT;
+  string logname = index.name + INDEX_LOG;
+  bool ok = (write (fd, records.data(), records.length()) ==
+	     (ssize_t)records.length());
+  if (! ok)
+    failures() << system_error("appending to index log",
+			       fullPath(_index_fd, logname));
+  struct stat log;
+  bool merge = (ok && fstat (fd, &log) == 0 && mergeDue (index, log.st_size));
+  close (fd);
+  if (merge)
+    startMerger();
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+readIndexed (const std::string& key, std::string& text,
+	     XmlObjectCatalog::ObjectVersion& version, CatalogBackend* backend)
+{
+  // Read an object with its version as stat() gives it, which is what
+  // later checks compare against, or with no version at all if the
+  // object was replaced between the read and the stat.  A background
+  // thread reads through a @p backend of its own.
+  XmlObjectCatalog::ObjectVersion current;
+  if (backend ? ! backend->get (key, text, &version) :
+      ! readObject (key, text, &version))
+    return false;
+  if (backend ? backend->stat (key, current) : statObject (key, current))
+    version.checksum = current.checksum;
+  if (version != current)
+    version = XmlObjectCatalog::ObjectVersion();
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+indexTexts (const CatalogBackend::text_list_t& texts,
+	    const std::vector<XmlObjectCatalog::ObjectVersion>& versions)
+{
+  // Log the value of each text which has been stored, with the version
+  // it was stored as.  Records of racing changes to a key may land out
+  // of order, which lookups and merges sort out by the version the
+  // object has now.
+  std::vector<CatalogIndex> indexes;
+  if (_index_fd < 0 || texts.empty())
+    return true;
+  if (! currentIndexes (indexes))
+    return false;
+  bool ok = true;
+  for (unsigned int i = 0; i < indexes.size(); ++i)
+  {
+    string records;
+    for (unsigned int j = 0; j < texts.size(); ++j)
+    {
+      XmlObjectCatalog::ObjectVersion v;
+      if (j < versions.size())
+	v = versions[j];
+      string value;
+      if (memberText (texts[j].second, indexes[i].elements, value))
+	records += "\n+\t" + indexLine (value, texts[j].first, v);
+      else
+	records += "\n-\t" + escapeField (texts[j].first) + "\n";
+    }
+    ok = appendIndex (indexes[i], records) && ok;
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+indexKeys (const std::vector<std::string>& keys)
+{
+  // Log the values of the objects as they are stored now, such as after
+  // a remove or a move, or a put which may have partly landed.
+  std::vector<CatalogIndex> indexes;
+  if (_index_fd < 0 || keys.empty())
+    return true;
+  if (! currentIndexes (indexes))
+    return false;
+  bool ok = true;
+  CatalogBackend::text_list_t texts;
+  std::vector<XmlObjectCatalog::ObjectVersion> versions;
+  std::vector<string> removed;
+  for (unsigned int i = 0; i < keys.size(); ++i)
+  {
+    string text;
+    XmlObjectCatalog::ObjectVersion v;
+    if (readIndexed (keys[i], text, v))
+    {
+      texts.push_back (std::make_pair (keys[i], text));
+      versions.push_back (v);
+    }
+    else if (errno == ENOENT)
+      removed.push_back (keys[i]);
+    else
+      ok = false;
+  }
+  for (unsigned int i = 0; i < indexes.size(); ++i)
+  {
+    string records;
+    for (unsigned int j = 0; j < removed.size(); ++j)
+    {
+      records += "\n-\t" + escapeField (removed[j]) + "\n";
+    }
+    ok = appendIndex (indexes[i], records) && ok;
+  }
+  return indexTexts (texts, versions) && ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+readIndex (const CatalogIndex& index, const std::string& value,
+	   std::map<std::string, index_versions_t>& found)
+{
+  // With the log locked shared, search the sorted file for the value and
+  // add every record of it in the log, so each key found comes with the
+  // versions of its object which had the value.
+  int fd = lockIndex (index, LOCK_SH, false);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+      failures() << "index of " << index.path << " has been dropped";
+    return false;
+  }
+  string filename = index.name + INDEX_FILE;
+  string prefix = escapeField (value) + "\t";
+  std::vector<string> lines;
+  int sfd = openat (_index_fd, filename.c_str(), O_RDONLY | O_CLOEXEC);
+  bool ok = (sfd >= 0 && searchIndex (sfd, prefix, lines));
+  if (! ok)
+    failures() << system_error("reading index", fullPath(_index_fd, filename));
+  if (sfd >= 0)
+    close (sfd);
+  string log;
+  ok = ok && readFile (_index_fd, index.name + INDEX_LOG, log, 0);
+  close (fd);
+
+  string::size_type pos = 0;
+  string::size_type eol;
+  while (ok && (eol = log.find ('\n', pos)) != string::npos)
+  {
+    if (log.compare (pos, 2, "+\t") == 0 &&
+	log.compare (pos + 2, prefix.length(), prefix) == 0)
+      lines.push_back (log.substr (pos + 2, eol + 1 - pos - 2));
+    pos = eol + 1;
+  }
+  for (unsigned int i = 0; ok && i < lines.size(); ++i)
+  {
+    string v, key;
+    XmlObjectCatalog::ObjectVersion version;
+    if (parseIndexLine (lines[i], v, key, version))
+      found[key].push_back (version);
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+snapshotIndex (const CatalogIndex& index, index_entries_t& entries)
+{
+  // Read the index from the objects as they are now.  The log is not
+  // locked, so changes made in the meantime land in the log for the
+  // merge to settle.
+  XmlObjectCatalog::key_set_t kset;
+  bool ok = _backend->list ("", "", kset);
+  XmlObjectCatalog::key_set_t::const_iterator it;
+  for (it = kset.begin(); ok && it != kset.end(); ++it)
+  {
+    string text;
+    string value;
+    XmlObjectCatalog::ObjectVersion v;
+    if (! readIndexed (*it, text, v))
+      ok = (errno == ENOENT);
+    else if (memberText (text, index.elements, value))
+      entries[*it] = indexLine (value, *it, v);
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+mergeDue (const CatalogIndex& index, off_t logsize)
+{
+  struct stat sorted;
+  string filename = index.name + INDEX_FILE;
+  return logsize >= INDEX_LOG_MIN &&
+    fstatat (_index_fd, filename.c_str(), &sorted, 0) == 0 &&
+    logsize * 8 >= sorted.st_size;
+}
+
+
+bool
+XmlObjectCatalogP::
+compactIndex (const CatalogIndex& index, const index_entries_t* snapshot,
+	      bool wait, CatalogBackend* backend)
+{
+  // One merge runs at a time in the catalog, under an flock on a
+  // descriptor of the index directory of its own.  A merge which is not
+  // to wait leaves the log to the one running.
+  int fd = openat (_index_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int operation = wait ? LOCK_EX : LOCK_EX | LOCK_NB;
+  int result = (fd >= 0) ? flock (fd, operation) : -1;
+  while (result < 0 && fd >= 0 && errno == EINTR)
+    result = flock (fd, operation);
+  if (result < 0)
+  {
+    bool busy = (fd >= 0 && errno == EWOULDBLOCK);
+    if (! busy)
+      failures() << system_error("locking index directory",
+				 fullPath(INDEX_DIR));
+    if (fd >= 0)
+      close (fd);
+    return busy;
+  }
+  bool ok = mergeIndex (index, snapshot, backend);
+  close (fd);
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+mergeIndex (const CatalogIndex& index, const index_entries_t* snapshot,
+	    CatalogBackend* backend)
+{
+  // Merge the log into the sorted file, or into a @p snapshot of the
+  // objects when the index is being built.  The log is only held
+  // exclusively for two moments: to mark the end of the records this
+  // merge takes, and to publish the merged file together with a new log
+  // of the records appended since.  Each key named in the log, or whose
+  // entry differs between the snapshot and the sorted file, is settled
+  // by the version its object has now: the entry read from that version
+  // wins, and otherwise the object is read again.
+  int fd = lockIndex (index, LOCK_EX, true);
+  if (fd < 0)
+    return errno == ENOENT;
+  string logname = index.name + INDEX_LOG;
+  string filename = index.name + INDEX_FILE;
+  struct stat marked;
+  bool ok = (fstat (fd, &marked) == 0);
+  flock (fd, LOCK_UN);
+  if (! ok)
+    failures() << system_error("reading index log",
+			       fullPath(_index_fd, logname));
+  if (! ok || (! snapshot && ! mergeDue (index, marked.st_size)))
+  {
+    close (fd);
+    return ok;
+  }
+  string log (marked.st_size, '\0');
+  string sorted;
+  ok = readAt (fd, 0, log);
+  if (! ok)
+    failures() << system_error("reading index log",
+			       fullPath(_index_fd, logname));
+  bool built = ok && readFile (_index_fd, filename, sorted, 0);
+  if (ok && ! built && (snapshot == 0 || errno != ENOENT))
+  {
+    // A merge waits for the sorted file to be built.
+    bool waiting = (snapshot == 0 && errno == ENOENT);
+    close (fd);
+    return waiting;
+  }
+
+  index_entries_t entries;
+  std::map<string, std::vector<string> > changed;
+  if (snapshot)
+    entries = *snapshot;
+  string::size_type pos = 0;
+  string::size_type eol;
+  while ((eol = sorted.find ('\n', pos)) != string::npos)
+  {
+    string line = sorted.substr (pos, eol + 1 - pos);
+    string value, key;
+    XmlObjectCatalog::ObjectVersion v;
+    pos = eol + 1;
+    if (! parseIndexLine (line, value, key, v))
+      continue;
+    index_entries_t::iterator it = entries.find (key);
+    if (! snapshot)
+      entries[key] = line;
+    else if (it == entries.end() || it->second != line)
+      changed[key].push_back (line);
+  }
+
+  // Each record starts on a line of its own, so one torn by a crash ends
+  // where the next begins and is skipped.
+  pos = 0;
+  while ((eol = log.find ('\n', pos)) != string::npos)
+  {
+    string line = (eol > pos + 2) ? log.substr (pos + 2, eol - 1 - pos) : "";
+    string value, key;
+    XmlObjectCatalog::ObjectVersion v;
+    if (log.compare (pos, 2, "+\t") == 0 &&
+	parseIndexLine (line, value, key, v))
+      changed[key].push_back (line);
+    else if (log.compare (pos, 2, "-\t") == 0 && line.length())
+      changed[unescapeField (line.substr (0, line.length() - 1))];
+    pos = eol + 1;
+  }
+
+  std::map<string, std::vector<string> >::iterator ct;
+  for (ct = changed.begin(); ok && ct != changed.end(); ++ct)
+  {
+    const string& key = ct->first;
+    XmlObjectCatalog::ObjectVersion current;
+    if (backend ? ! backend->stat (key, current) : ! statObject (key, current))
+    {
+      if (errno == ENOENT)
+	entries.erase (key);
+      else
+	ok = false;
+      continue;
+    }
+    std::vector<string>& lines = ct->second;
+    index_entries_t::iterator it = entries.find (key);
+    if (it != entries.end())
+      lines.push_back (it->second);
+    unsigned int i = 0;
+    for ( ; i < lines.size(); ++i)
+    {
+      string value, k;
+      XmlObjectCatalog::ObjectVersion v;
+      if (parseIndexLine (lines[i], value, k, v) && v == current)
+	break;
+    }
+    string text, value;
+    XmlObjectCatalog::ObjectVersion v;
+    if (i < lines.size())
+      entries[key] = lines[i];
+    else if (! readIndexed (key, text, v, backend))
+    {
+      if (errno == ENOENT)
+	entries.erase (key);
+      else
+	ok = false;
+    }
+    else if (memberText (text, index.elements, value))
+      entries[key] = indexLine (value, key, v);
+    else
+      entries.erase (key);
+  }
+
+  std::vector<string> lines;
+  index_entries_t::const_iterator it;
+  for (it = entries.begin(); it != entries.end(); ++it)
+  {
+    lines.push_back (it->second);
+  }
+  std::sort (lines.begin(), lines.end());
+  CatalogTempFile tmp;
+  tmp.dirfd = _index_fd;
+  for (unsigned int i = 0; i < lines.size(); ++i)
+  {
+    tmp.data += lines[i];
+  }
+  ok = ok && openNamedTemp (filename, tmp) && writeData (tmp) &&
+    syncTemp (tmp, true);
+
+  // Publish the merged file, then a log of just the records appended
+  // since the mark, unless the index has been dropped meanwhile.  A crash
+  // in between leaves the whole old log, whose records are settled again
+  // by the next merge.  The new log is not synced, any more than appends
+  // are.
+  CatalogTempFile tail;
+  tail.dirfd = _index_fd;
+  int result = ok ? flock (fd, LOCK_EX) : 0;
+  while (result < 0 && errno == EINTR)
+    result = flock (fd, LOCK_EX);
+  if (result < 0)
+  {
+    failures() << system_error("locking index", fullPath(_index_fd, logname));
+    ok = false;
+  }
+  struct stat locked, current;
+  bool dropped = ok &&
+    (fstat (fd, &locked) < 0 ||
+     fstatat (_index_fd, logname.c_str(), &current, 0) < 0 ||
+     locked.st_dev != current.st_dev || locked.st_ino != current.st_ino);
+  if (ok && ! dropped)
+  {
+    tail.data.resize (locked.st_size - marked.st_size);
+    ok = readAt (fd, marked.st_size, tail.data);
+    if (! ok)
+      failures() << system_error("reading index log",
+				 fullPath(_index_fd, logname));
+    ok = ok && openNamedTemp (logname, tail) && writeData (tail) &&
+      publishTemp (tmp, filename) && publishTemp (tail, logname);
+  }
+  close (fd);
+  discardTemp (tmp);
+  discardTemp (tail);
+  return ok && (dropped || syncDirectory (_index_fd));
+}
+
+
+bool
+XmlObjectCatalogP::
+dropIndex (const CatalogIndex& index)
+{
+  // Once its log is gone the index is gone for every process, and the
+  // exclusive lock keeps anyone from still using it.
+  int fd = lockIndex (index, LOCK_EX, true);
+  if (fd < 0)
+    return errno == ENOENT;
+  string logname = index.name + INDEX_LOG;
+  string filename = index.name + INDEX_FILE;
+  bool ok = (unlinkat (_index_fd, logname.c_str(), 0) == 0);
+  if (! ok)
+    failures() << system_error("dropping index",
+			       fullPath(_index_fd, logname));
+  if (ok && unlinkat (_index_fd, filename.c_str(), 0) < 0 && errno != ENOENT)
+  {
+    failures() << system_error("dropping index",
+			       fullPath(_index_fd, filename));
+    ok = false;
+  }
+  close (fd);
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+setIndex (const std::string& path, bool enable)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  CatalogIndex index;
+  index.path = path;
+  index.name = XmlObjectCatalogP::indexName (path);
+  if (! XmlObjectCatalogP::indexElements (path, index.elements))
+  {
+    _mp->failures() << "setIndex: bad member path '" << path << "'";
+    return false;
+  }
+  if (index.name.length() + strlen (INDEX_FILE) > INDEX_NAME_MAX)
+  {
+    _mp->failures() << "setIndex: member path '" << path << "' is too long";
+    return false;
+  }
+  if (storage() == STORAGE_MEMORY)
+  {
+    _mp->failures() << "setIndex: memory catalog " << name()
+		    << " cannot keep an index";
+    return false;
+  }
+  if (_mp->_index_fd < 0 && (! enable || ! _mp->openIndexes (true)))
+    return ! enable;
+  if (! enable)
+    return _mp->dropIndex (index);
+
+  // Create the log first, so every change from then on is logged while
+  // the index is built from the objects.  An index which is already
+  // there is left alone, while one whose build never finished, such as
+  // in a process which crashed, is built again.
+  bool found = false;
+  CatalogIndex current;
+  if (! _mp->findIndex (path, current, found))
+    return false;
+  if (found && current.built)
+    return true;
+  CatalogTempFile tmp;
+  tmp.dirfd = _mp->_index_fd;
+  bool existed = false;
+  string logname = index.name + INDEX_LOG;
+  if (! _mp->openNamedTemp (logname, tmp) || ! _mp->syncTemp (tmp, false) ||
+      (! _mp->publishNew (tmp, logname, existed) && ! existed))
+  {
+    return false;
+  }
+  XmlObjectCatalogP::index_entries_t snapshot;
+  return _mp->snapshotIndex (index, snapshot) &&
+    _mp->compactIndex (index, &snapshot, true);
+}
+
+
+bool
+XmlObjectCatalog::
+rebuildIndex (const std::string& path)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  CatalogIndex index;
+  bool found = false;
+  if (! _mp->findIndex (path, index, found))
+    return false;
+  if (! found)
+  {
+    _mp->failures() << "catalog " << name() << " has no index of " << path;
+    return false;
+  }
+  XmlObjectCatalogP::index_entries_t snapshot;
+  return _mp->snapshotIndex (index, snapshot) &&
+    _mp->compactIndex (index, &snapshot, true);
+}
+
+
+bool
+XmlObjectCatalog::
+lookup (const std::string& path, const std::string& value, key_set_t& kset)
+{
+  kset.erase (kset.begin(), kset.end());
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  CatalogIndex index;
+  bool found = false;
+  if (! _mp->findIndex (path, index, found))
+    return false;
+  if (! found || ! index.built)
+  {
+    _mp->failures() << "catalog " << name() << " has no index of " << path;
+    return false;
+  }
+  std::map<string, XmlObjectCatalogP::index_versions_t> keys;
+  if (! _mp->readIndex (index, value, keys))
+    return false;
+
+  // A key is only found if its object has the value now, which the
+  // version of the object shows without reading it when it matches one
+  // the value was indexed from.  Objects can leave without passing
+  // through remove(), such as when a partition is dropped, so their
+  // keys are logged as removed here.
+  bool ok = true;
+  string removed;
+  std::map<string, XmlObjectCatalogP::index_versions_t>::iterator it;
+  for (it = keys.begin(); ok && it != keys.end(); ++it)
+  {
+    const string& key = it->first;
+    ObjectVersion current;
+    string text, v;
+    if (! _mp->statObject (key, current))
+    {
+      if (errno == ENOENT)
+	removed += "\n-\t" + XmlObjectCatalogP::escapeField (key) + "\n";
+      else
+	ok = false;
+    }
+    else if (std::find (it->second.begin(), it->second.end(), current) !=
+	     it->second.end())
+      kset.insert (key);
+    else if (_mp->readObject (key, text, 0))
+    {
+      if (XmlObjectCatalogP::memberText (text, index.elements, v) &&
+	  v == value)
+	kset.insert (key);
+    }
+    else if (errno == ENOENT)
+      removed += "\n-\t" + XmlObjectCatalogP::escapeField (key) + "\n";
+    else
+      ok = false;
+  }
+  return _mp->appendIndex (index, removed) && ok;
+}
+
+
+bool
+XmlObjectCatalog::
+indexes (std::vector<std::string>& paths)
+{
+  paths.clear();
+  if (! isOpen())
+    return false;
+  std::vector<CatalogIndex> indexes;
+  if (_mp->_index_fd < 0)
+    return true;
+  if (! _mp->currentIndexes (indexes))
+    return false;
+  for (unsigned int i = 0; i < indexes.size(); ++i)
+  {
+    if (indexes[i].built)
+      paths.push_back (indexes[i].path);
+  }
+  return true;
+}
+
+
+void
+XmlObjectCatalogP::
+startMerger ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  if (_merging && _merged)
+  {
+    pthread_join (_merger, 0);
+    _merging = false;
+  }
+  if (! _merging)
+  {
+    _merged = false;
+    _merging = (pthread_create (&_merger, 0, mergerMain, this) == 0);
+  }
+  pthread_mutex_unlock (&_sync_lock);
+}
+
+
+void
+XmlObjectCatalogP::
+stopMerger ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  bool running = _merging;
+  _merging = false;
+  pthread_mutex_unlock (&_sync_lock);
+  if (running)
+  {
+    pthread_join (_merger, 0);
+  }
+}
+
+
+void*
+XmlObjectCatalogP::
+mergerMain (void* arg)
+{
+  // Merge every index whose log is due, leaving any which another
+  // process is merging to that process.
+  XmlObjectCatalogP* cp = static_cast<XmlObjectCatalogP*>(arg);
+  CatalogBackend* backend = cp->readerBackend();
+  std::vector<CatalogIndex> indexes;
+  if (backend && cp->currentIndexes (indexes))
+  {
+    for (unsigned int i = 0; i < indexes.size(); ++i)
+    {
+      if (indexes[i].built)
+	cp->compactIndex (indexes[i], 0, false, backend);
+    }
+  }
+  delete backend;
+  pthread_mutex_lock (&cp->_sync_lock);
+  cp->_merged = true;
+  pthread_mutex_unlock (&cp->_sync_lock);
+  return 0;
+}
@@ -0,0 +1,388 @@
+//
+// $Id$
+//
+
+#include "XmlObjectCatalogP.h"
+
+#include "logx/system_error.h"
+
+using namespace domx;
+using std::string;
+
+using logx::system_error;
+
+
+bool
+XmlObjectCatalogP::
+openJournal ()
+{
+  // A catalog keeps a journal if the journal file exists.
+  _journal_fd = openat (_dirfd, JOURNAL_FILE, O_RDWR | O_APPEND | O_CLOEXEC);
+  _journal_size = -1;
+  if (_journal_fd < 0 && errno != ENOENT)
+  {
+    failures() << system_error("opening journal", fullPath(JOURNAL_FILE));
+    return false;
+  }
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+lockJournal ()
+{
+  // Compaction replaces the journal file, so once the lock is held make
+  // sure it is on the current file, otherwise start again on that one.
+  // The flock only keeps other processes out, so the journal lock
+  // serializes the threads of this one.  Returns false with the
+  // descriptor closed if the catalog no longer keeps a journal, and false
+  // with an error queued if the lock fails.
+  pthread_mutex_lock (&_journal_lock);
+  while (_journal_fd >= 0)
+  {
+    if (flock (_journal_fd, LOCK_EX) < 0)
+    {
+      failures() << system_error("locking journal", fullPath(JOURNAL_FILE));
+      break;
+    }
+    struct stat locked, current;
+    if (fstat (_journal_fd, &locked) == 0 &&
+	fstatat (_dirfd, JOURNAL_FILE, &current, 0) == 0 &&
+	locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+    {
+      return true;
+    }
+    close (_journal_fd);
+    if (! openJournal())
+      break;
+  }
+  pthread_mutex_unlock (&_journal_lock);
+  return false;
+}
+
+
+void
+XmlObjectCatalogP::
+unlockJournal ()
+{
+  flock (_journal_fd, LOCK_UN);
+  pthread_mutex_unlock (&_journal_lock);
+}
+
+
+bool
+XmlObjectCatalogP::
+lastSequence (unsigned long long& sequence)
+{
+  // Only the end of the journal needs to be read, and only if it has
+  // grown since the last append from this process, and a record cut
+  // short by a crash is dropped first.  The journal lock must be held.
+  struct stat sbuf;
+  string buf;
+  off_t len = 0;
+  bool ok = (fstat (_journal_fd, &sbuf) == 0);
+  if (ok && sbuf.st_size == _journal_size)
+  {
+    sequence = _journal_sequence;
+    return true;
+  }
+  if (ok)
+  {
+    len = std::min (sbuf.st_size, (off_t)65536);
+    buf.resize (len);
+    ok = (pread (_journal_fd, &buf[0], len, sbuf.st_size - len) == len);
+  }
+  if (! ok)
+  {
+    failures() << system_error("reading journal", fullPath(JOURNAL_FILE));
+    return false;
+  }
+  string::size_type end = buf.rfind ('\n');
+  off_t size = sbuf.st_size;
+  if (end != string::npos && end + 1 < buf.length())
+  {
+    size -= len - end - 1;
+    if (ftruncate (_journal_fd, size) < 0)
+    {
+      failures() << system_error("truncating journal",
+				 fullPath(JOURNAL_FILE));
+      return false;
+    }
+  }
+  string::size_type start = string::npos;
+  if (end != string::npos && end > 0)
+    start = buf.rfind ('\n', end - 1);
+  if (start == string::npos && len < sbuf.st_size)
+    end = string::npos;
+  if (end == string::npos)
+  {
+    failures() << "journal " << fullPath(JOURNAL_FILE) << " is damaged";
+    return false;
+  }
+  start = (start == string::npos) ? 0 : start + 1;
+  string line = buf.substr (start, end - start);
+  string::size_type hlen = strlen (JOURNAL_HEADER);
+  if (line.compare (0, hlen, JOURNAL_HEADER) == 0)
+    line = line.substr (hlen);
+  sequence = strtoull (line.c_str(), 0, 10);
+  _journal_sequence = sequence;
+  _journal_size = size;
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+journal (XmlObjectCatalog::EnumJournalOp op,
+	 const std::vector<std::string>& keys, const std::string& destination)
+{
+  // Every record of one call goes in with a single write.
+  if (_journal_fd < 0 || keys.empty())
+    return true;
+  if (! lockJournal())
+    return _journal_fd < 0;
+  unsigned long long sequence;
+  bool ok = lastSequence (sequence);
+  if (ok)
+  {
+    std::ostringstream text;
+    for (unsigned int i = 0; i < keys.size(); ++i)
+    {
+      text << ++sequence << '\t' << JOURNAL_OPS[op] << '\t'
+	   << escapeField (keys[i]);
+      if (destination.length())
+	text << '\t' << escapeField (destination);
+      text << '\n';
+    }
+    string data = text.str();
+    ok = (write (_journal_fd, data.data(), data.length()) ==
+	  (ssize_t)data.length());
+    _journal_size = ok ? _journal_size + data.length() : -1;
+    _journal_sequence = sequence;
+    if (ok && (_durability == XmlObjectCatalog::SYNC_DATA ||
+	       _durability == XmlObjectCatalog::SYNC_FULL))
+      ok = (fdatasync (_journal_fd) == 0);
+    if (! ok)
+      failures() << system_error("appending to journal",
+				 fullPath(JOURNAL_FILE));
+  }
+  unlockJournal();
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+readJournal (unsigned long long after, unsigned long long& base,
+	     XmlObjectCatalog::journal_t& entries)
+{
+  // Read the records after sequence number @p after.  The sequence
+  // numbers grow along the file, so the search for the first of them
+  // works like the search of a sorted index file.  The file in place is
+  // always whole, except perhaps for a record still being appended,
+  // which is left for next time.
+  entries.clear();
+  int fd = openat (_dirfd, JOURNAL_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+      failures() << "catalog " << _name << " does not keep a journal";
+    else
+      failures() << system_error("opening journal", fullPath(JOURNAL_FILE));
+    return false;
+  }
+  string::size_type hlen = strlen (JOURNAL_HEADER);
+  struct stat sbuf;
+  string line;
+  bool ok = (fstat (fd, &sbuf) == 0 && readLine (fd, 0, line));
+  if (! ok && errno)
+    failures() << system_error("reading journal", fullPath(JOURNAL_FILE));
+  else if (line.compare (0, hlen, JOURNAL_HEADER) != 0)
+    failures() << "journal " << fullPath(JOURNAL_FILE) << " is damaged";
+  if (! ok || line.compare (0, hlen, JOURNAL_HEADER) != 0)
+  {
+    close (fd);
+    return false;
+  }
+  base = strtoull (line.c_str() + hlen, 0, 10);
+  off_t lo = line.length();
+  off_t hi = sbuf.st_size;
+  while (hi - lo > JOURNAL_BLOCK)
+  {
+    off_t mid = lo + (hi - lo) / 2;
+    if (! readLine (fd, mid - 1, line))
+      break;
+    off_t start = mid - 1 + line.length();
+    if (start >= hi || ! readLine (fd, start, line))
+      break;
+    if (strtoull (line.c_str(), 0, 10) <= after)
+      lo = start + line.length();
+    else
+      hi = start;
+  }
+  string text (sbuf.st_size - lo, '\0');
+  ok = readAt (fd, lo, text);
+  if (! ok)
+    failures() << system_error("reading journal", fullPath(JOURNAL_FILE));
+  close (fd);
+
+  string::size_type start = 0;
+  string::size_type end;
+  while (ok && (end = text.find ('\n', start)) != string::npos)
+  {
+    std::istringstream record (text.substr (start, end - start));
+    XmlObjectCatalog::JournalEntry entry;
+    string op;
+    start = end + 1;
+    record >> entry.sequence;
+    record.ignore (1);
+    std::getline (record, op, '\t');
+    std::getline (record, entry.key, '\t');
+    std::getline (record, entry.destination);
+    const char* found = op.length() == 1 ? strchr (JOURNAL_OPS, op[0]) : 0;
+    if (! record.eof() || ! found || ! *found)
+    {
+      failures() << "journal " << fullPath(JOURNAL_FILE) << " is damaged";
+      return false;
+    }
+    if (entry.sequence <= after)
+      continue;
+    entry.op = (XmlObjectCatalog::EnumJournalOp)(found - JOURNAL_OPS);
+    entry.key = unescapeField (entry.key);
+    entry.destination = unescapeField (entry.destination);
+    entries.push_back (entry);
+  }
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+setJournal (bool enable)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (storage() == STORAGE_MEMORY)
+  {
+    _mp->failures() << "setJournal: memory catalog " << name()
+		    << " cannot keep a journal";
+    return false;
+  }
+  if (! enable)
+  {
+    pthread_mutex_lock (&_mp->_journal_lock);
+    if (_mp->_journal_fd >= 0)
+      close (_mp->_journal_fd);
+    _mp->_journal_fd = -1;
+    pthread_mutex_unlock (&_mp->_journal_lock);
+    return _mp->writeLayout (JOURNAL_FILE, "");
+  }
+  if (_mp->_journal_fd >= 0)
+    return true;
+
+  // Another process may have just started the journal, so only create
+  // the file if it is still missing.
+  CatalogTempFile tmp;
+  tmp.dirfd = _mp->_dirfd;
+  tmp.data = string(JOURNAL_HEADER) + "0\n";
+  bool existed = false;
+  if (! _mp->openNamedTemp (JOURNAL_FILE, tmp) || ! _mp->writeData (tmp) ||
+      ! _mp->syncTemp (tmp, false) ||
+      (! _mp->publishNew (tmp, JOURNAL_FILE, existed) && ! existed))
+  {
+    return false;
+  }
+  return _mp->openJournal();
+}
+
+
+bool
+XmlObjectCatalog::
+journalSequence (unsigned long long& sequence)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (_mp->_journal_fd < 0)
+  {
+    _mp->failures() << "catalog " << name() << " does not keep a journal";
+    return false;
+  }
+  if (! _mp->lockJournal())
+  {
+    if (_mp->_journal_fd < 0)
+      _mp->failures() << "catalog " << name() << " does not keep a journal";
+    return false;
+  }
+  bool ok = _mp->lastSequence (sequence);
+  _mp->unlockJournal();
+  return ok;
+}
+
+
+bool
+XmlObjectCatalog::
+tail (unsigned long long after, journal_t& entries)
+{
+  entries.clear();
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  unsigned long long base;
+  if (! _mp->readJournal (after, base, entries))
+    return false;
+  if (after < base)
+  {
+    entries.clear();
+    _mp->failures() << "tail: the journal of " << name()
+		    << " no longer holds the records after " << after;
+    return false;
+  }
+  return true;
+}
+
+
+bool
+XmlObjectCatalog::
+compactJournal (unsigned long long before)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (_mp->_journal_fd < 0)
+  {
+    _mp->failures() << "catalog " << name() << " does not keep a journal";
+    return false;
+  }
+  // Hold the lock on the old file while the new one replaces it, so no
+  // append can land in between.
+  if (! _mp->lockJournal())
+    return false;
+  unsigned long long base, last;
+  journal_t entries;
+  bool ok = _mp->lastSequence (last) &&
+    _mp->readJournal (before > 0 ? before - 1 : 0, base, entries);
+  if (ok)
+  {
+    if (before > 0 && before - 1 > base)
+      base = std::min (before - 1, last);
+    std::ostringstream text;
+    text << JOURNAL_HEADER << base << '\n';
+    for (unsigned int i = 0; i < entries.size(); ++i)
+    {
+      const JournalEntry& entry = entries[i];
+      if (entry.sequence <= base)
+	continue;
+      text << entry.sequence << '\t' << JOURNAL_OPS[entry.op] << '\t'
+	   << XmlObjectCatalogP::escapeField (entry.key);
+      if (entry.destination.length())
+	text << '\t' << XmlObjectCatalogP::escapeField (entry.destination);
+      text << '\n';
+    }
+    ok = _mp->writeLayout (JOURNAL_FILE, text.str());
+  }
+  _mp->unlockJournal();
+  return ok;
+}
@@ -0,0 +1,291 @@
+//
+// $Id$
+//
+
+#include "XmlObjectCatalogP.h"
+
+#include "logx/Logging.h"
+#include "logx/system_error.h"
+
+LOGGING("XmlObjectCatalog");
+
+using namespace domx;
+using std::string;
+
+using logx::system_error;
+
+
+bool
+LoadCache::
+enabled ()
+{
+  pthread_mutex_lock (&lock);
+  bool on = (capacity > 0 || shared_fd >= 0);
+  pthread_mutex_unlock (&lock);
+  return on;
+}
+
+
+bool
+LoadCache::
+sameVersion (const XmlObjectCatalog::ObjectVersion& cached,
+	     const XmlObjectCatalog::ObjectVersion& current)
+{
+  // The checksum only counts when the backend knew it without reading.
+  return cached.device == current.device && cached.inode == current.inode &&
+    cached.mtime_ns == current.mtime_ns && cached.size == current.size &&
+    (current.checksum == 0 || cached.checksum == current.checksum);
+}
+
+
+bool
+LoadCache::
+fetch (const std::string& key, const XmlObjectCatalog::ObjectVersion& current,
+       XmlObjectInterface* object, XmlObjectCatalog::ObjectVersion* version)
+{
+  pthread_mutex_lock (&lock);
+  bool hit = false;
+  std::map<string, lru_t::iterator>::iterator it = index.find (key);
+  if (it != index.end())
+  {
+    const XmlObjectCatalog::ObjectVersion& v = it->second->version;
+    hit = sameVersion (v, current) &&
+      object->copyDocument (*it->second->object);
+    if (hit)
+    {
+      lru.splice (lru.begin(), lru, it->second);
+      if (version)
+	*version = v;
+    }
+    else
+    {
+      erase (it->second);
+    }
+  }
+  if (hit)
+    ++hits;
+  else if (capacity > 0)
+    ++misses;
+  int fd = shared_fd;
+  unsigned int slots = shared_slots;
+  pthread_mutex_unlock (&lock);
+  if (hit || fd < 0)
+    return hit;
+
+  // Try the shared cache outside the lock, and keep what it has in the
+  // local cache too.
+  XmlObjectCatalog::ObjectVersion v;
+  hit = readSlot (fd, slots, key, current, object, v);
+  if (hit && version)
+    *version = v;
+  XmlObjectInterface* copy = 0;
+  if (hit)
+  {
+    copy = new XmlObjectInterface;
+    if (! copy->copyDocument (*object))
+    {
+      delete copy;
+      copy = 0;
+    }
+  }
+  pthread_mutex_lock (&lock);
+  if (hit)
+    ++shared_hits;
+  else
+    ++shared_misses;
+  if (copy && capacity > 0)
+    insert (key, v, copy);
+  else
+    delete copy;
+  pthread_mutex_unlock (&lock);
+  return hit;
+}
+
+
+bool
+LoadCache::
+store (const std::string& key, const XmlObjectCatalog::ObjectVersion& version,
+       const std::string& text, XmlObjectInterface* object)
+{
+  // Parse outside the lock into an object of our own, then copy it to
+  // the caller.
+  XmlObjectInterface* parsed = new XmlObjectInterface;
+  if (! parsed->fromXML (text))
+  {
+    delete parsed;
+    return false;
+  }
+  if (! object->copyDocument (*parsed) && ! object->fromXML (text))
+  {
+    delete parsed;
+    return false;
+  }
+
+  pthread_mutex_lock (&lock);
+  int fd = shared_fd;
+  unsigned int slots = shared_slots;
+  pthread_mutex_unlock (&lock);
+  string flat;
+  if (fd >= 0 && parsed->toFlat (flat))
+    writeSlot (fd, slots, key, version, flat);
+
+  pthread_mutex_lock (&lock);
+  if (capacity > 0)
+    insert (key, version, parsed);
+  else
+    delete parsed;
+  pthread_mutex_unlock (&lock);
+  return true;
+}
+
+
+void
+LoadCache::
+resize (unsigned int entries)
+{
+  pthread_mutex_lock (&lock);
+  capacity = entries;
+  trim();
+  pthread_mutex_unlock (&lock);
+}
+
+
+void
+LoadCache::
+insert (const std::string& key, const XmlObjectCatalog::ObjectVersion& version,
+	XmlObjectInterface* object)
+{
+  // The lock must be held.  The cache takes over the object.
+  std::map<string, lru_t::iterator>::iterator it = index.find (key);
+  if (it != index.end())
+    erase (it->second);
+  Entry entry;
+  entry.key = key;
+  entry.version = version;
+  entry.object = object;
+  lru.push_front (entry);
+  index[key] = lru.begin();
+  trim();
+}
+
+
+void
+LoadCache::
+trim ()
+{
+  // The lock must be held.
+  while (lru.size() > capacity)
+  {
+    erase (--lru.end());
+  }
+}
+
+
+void
+LoadCache::
+erase (lru_t::iterator it)
+{
+  index.erase (it->key);
+  delete it->object;
+  lru.erase (it);
+}
+
+
+string
+LoadCache::
+slotName (const std::string& key, unsigned int slots)
+{
+  char name[32];
+  snprintf (name, sizeof(name), "slot-%08x",
+	    (unsigned int)(textChecksum (key) % slots));
+  return name;
+}
+
+
+bool
+LoadCache::
+readSlot (int dirfd, unsigned int slots, const std::string& key,
+	  const XmlObjectCatalog::ObjectVersion& current,
+	  XmlObjectInterface* object, XmlObjectCatalog::ObjectVersion& version)
+{
+  // An empty or missing slot, a slot for another key or version, and a
+  // damaged slot are all just misses.
+  int fd = openat (dirfd, slotName (key, slots).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat sbuf;
+  string data;
+  bool ok = (fstat (fd, &sbuf) == 0 &&
+	     sbuf.st_size >= (off_t)(sizeof(SlotHeader) + key.length()));
+  if (ok)
+  {
+    data.resize (sbuf.st_size);
+    ok = (read (fd, &data[0], data.size()) == (ssize_t)data.size());
+  }
+  close (fd);
+  SlotHeader head;
+  if (ok)
+  {
+    memcpy (&head, data.data(), sizeof(head));
+    ok = (memcmp (head.magic, "domxslot", 8) == 0 &&
+	  head.keylen == key.length() &&
+	  sizeof(head) + head.keylen + head.datalen == data.size() &&
+	  data.compare (sizeof(head), head.keylen, key) == 0);
+  }
+  if (ok)
+  {
+    version.device = head.device;
+    version.inode = head.inode;
+    version.mtime_ns = head.mtime_ns;
+    version.size = head.size;
+    version.checksum = head.checksum;
+    ok = sameVersion (version, current);
+  }
+  if (! ok)
+    return false;
+  string flat = data.substr (sizeof(head) + head.keylen);
+  return textChecksum (flat) == head.datasum && object->fromFlat (flat);
+}
+
+
+void
+LoadCache::
+writeSlot (int dirfd, unsigned int slots, const std::string& key,
+	   const XmlObjectCatalog::ObjectVersion& version,
+	   const std::string& flat)
+{
+  SlotHeader head;
+  memset (&head, 0, sizeof(head));
+  memcpy (head.magic, "domxslot", 8);
+  head.device = version.device;
+  head.inode = version.inode;
+  head.mtime_ns = version.mtime_ns;
+  head.size = version.size;
+  head.checksum = version.checksum;
+  head.keylen = key.length();
+  head.datalen = flat.length();
+  head.datasum = textChecksum (flat);
+  string data ((const char*)&head, sizeof(head));
+  data += key;
+  data += flat;
+
+  // The cache is only an optimization, so failures are just logged.
+  string slot = slotName (key, slots);
+  string tmpname = slot + XmlObjectCatalogP::uniqueSuffix() + "-temp";
+  int fd = openat (dirfd, tmpname.c_str(),
+		   O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0664);
+  bool ok = (fd >= 0);
+  if (ok)
+  {
+    ok = (write (fd, data.data(), data.size()) == (ssize_t)data.size());
+    close (fd);
+  }
+  if (ok)
+    ok = (renameat (dirfd, tmpname.c_str(), dirfd, slot.c_str()) == 0);
+  if (! ok)
+  {
+    DLOG << system_error("writing shared load cache slot", slot);
+    if (fd >= 0)
+      unlinkat (dirfd, tmpname.c_str(), 0);
+  }
+}
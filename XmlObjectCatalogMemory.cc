@@ -0,0 +1,142 @@
+//
+// $Id$
+//
+
+#include "XmlObjectCatalogP.h"
+
+using namespace domx;
+using std::string;
+
+
+bool
+CatalogMemory::
+put (const text_list_t& objects, bool /*batch*/, bool absent,
+     const XmlObjectCatalog::ObjectVersion* expected,
+     std::vector<XmlObjectCatalog::ObjectVersion>* versions)
+{
+  // Holding the lock makes every put atomic, batch or not.
+  pthread_mutex_lock (&store->lock);
+  bool conflict = false;
+  for (unsigned int i = 0; absent && i < objects.size(); ++i)
+  {
+    conflict = conflict || store->objects.count (objects[i].first);
+  }
+  if (expected && ! objects.empty())
+  {
+    std::map<string, MemoryStore::Object>::iterator it =
+      store->objects.find (objects[0].first);
+    conflict = (it == store->objects.end() || it->second.version != *expected);
+  }
+  if (! conflict)
+  {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    for (unsigned int i = 0; i < objects.size(); ++i)
+    {
+      MemoryStore::Object& object = store->objects[objects[i].first];
+      object.text = objects[i].second;
+      object.version.inode = ++store->serial;
+      object.version.mtime_ns = now.tv_sec * 1000000000LL +
+	now.tv_usec * 1000LL;
+      object.version.size = object.text.length();
+      object.version.checksum = textChecksum (object.text);
+      if (versions)
+	versions->push_back (object.version);
+    }
+  }
+  pthread_mutex_unlock (&store->lock);
+  return ! conflict;
+}
+
+
+bool
+CatalogMemory::
+get (const std::string& id, std::string& text,
+     XmlObjectCatalog::ObjectVersion* version)
+{
+  pthread_mutex_lock (&store->lock);
+  std::map<string, MemoryStore::Object>::iterator it =
+    store->objects.find (id);
+  bool found = (it != store->objects.end());
+  if (found)
+  {
+    text = it->second.text;
+    if (version)
+      *version = it->second.version;
+  }
+  pthread_mutex_unlock (&store->lock);
+  if (! found)
+    errno = ENOENT;
+  return found;
+}
+
+
+bool
+CatalogMemory::
+stat (const std::string& id, XmlObjectCatalog::ObjectVersion& version)
+{
+  pthread_mutex_lock (&store->lock);
+  std::map<string, MemoryStore::Object>::iterator it =
+    store->objects.find (id);
+  bool found = (it != store->objects.end());
+  if (found)
+    version = it->second.version;
+  pthread_mutex_unlock (&store->lock);
+  if (! found)
+    errno = ENOENT;
+  return found;
+}
+
+
+bool
+CatalogMemory::
+remove (const std::string& id)
+{
+  pthread_mutex_lock (&store->lock);
+  store->objects.erase (id);
+  pthread_mutex_unlock (&store->lock);
+  return true;
+}
+
+
+bool
+CatalogMemory::
+list (const std::string& from, const std::string& to,
+      XmlObjectCatalog::key_set_t& kset)
+{
+  pthread_mutex_lock (&store->lock);
+  std::map<string, MemoryStore::Object>::iterator it =
+    store->objects.lower_bound (from);
+  std::map<string, MemoryStore::Object>::iterator end =
+    to.length() ? store->objects.lower_bound (to) : store->objects.end();
+  for ( ; it != end; ++it)
+  {
+    kset.insert (kset.end(), it->first);
+  }
+  pthread_mutex_unlock (&store->lock);
+  return true;
+}
+
+
+bool
+CatalogMemory::
+exists (const std::string& id, bool& found)
+{
+  pthread_mutex_lock (&store->lock);
+  found = (store->objects.count (id) > 0);
+  pthread_mutex_unlock (&store->lock);
+  return true;
+}
+
+
+bool
+CatalogMemory::
+rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest)
+{
+  if (dest->storage() == XmlObjectCatalog::STORAGE_MEMORY &&
+      static_cast<CatalogMemory*>(dest)->store == store)
+  {
+    return true;
+  }
+  return CatalogBackend::rename (names, dest);
+}
@@ -0,0 +1,1553 @@
+// -*- C++ -*-
+//
+// $Id$
+//
+// The private state of XmlObjectCatalog, shared by the source files which
+// implement the catalog, its storage backends and its auxiliary logs.
+//
+
+#ifndef _domx_XmlObjectCatalogP_h_
+#define _domx_XmlObjectCatalogP_h_
+
+#include "domx/XmlObjectCatalog.h"
+#include "domx/XmlObjectNode.h"
+#include "XmlObjectReaderP.h"
+
+#include "logx/EventSource.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>    // for unlink()
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+
+#ifdef DOMX_HAVE_LIBURING
+#include <liburing.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include <sstream>
+#include <map>
+#include <list>
+#include <algorithm>
+
+namespace domx
+{
+  using std::string;
+
+  // 64-bit FNV-1a, enough to tell versions of an object apart and to
+  // spread keys over shards.
+  inline unsigned long long
+  textChecksum (const std::string& text)
+  {
+    unsigned long long h = 14695981039346656037ULL;
+    for (std::string::size_type i = 0; i < text.length(); ++i)
+    {
+      h ^= (unsigned char)text[i];
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  // Read text.length() bytes from @p fd at @p offset into @p text.
+  // Returns false with errno 0 if the file ends first.
+  inline bool
+  readAt (int fd, off_t offset, std::string& text)
+  {
+    size_t got = 0;
+    while (got < text.length())
+    {
+      ssize_t n = pread (fd, &text[got], text.length() - got, offset + got);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n == 0)
+	errno = 0;
+      if (n <= 0)
+	return false;
+      got += n;
+    }
+    return true;
+  }
+
+  // Escape @p text for an attribute value in single quotes.
+  inline string
+  attributeText (const std::string& text)
+  {
+    string value;
+    for (string::size_type i = 0; i < text.length(); ++i)
+    {
+      switch (text[i])
+      {
+      case '&': value += "&amp;"; break;
+      case '<': value += "&lt;"; break;
+      case '\'': value += "&apos;"; break;
+      default: value += text[i];
+      }
+    }
+    return value;
+  }
+
+  // The files in a catalog directory which record the number of shards
+  // or the partitioning.  A catalog with neither is flat.
+  const char* const SHARD_FILE = ".shards";
+  const char* const PARTITION_FILE = ".partitions";
+
+  // The manifest of a catalog in segment storage, the lock file which
+  // serializes its writers, and the lock file held while compacting.
+  const char* const SEGMENT_FILE = ".segments";
+  const char* const SEGMENT_LOCK = ".segments.lock";
+  const char* const COMPACT_LOCK = ".compact.lock";
+
+  // The extended attribute on an object file which holds the size and
+  // checksum of its text, plus the size and modification time of the file
+  // when it was written, so an unchanged insert can be skipped without
+  // reading the file and a file edited in place is not mistaken for it.
+  const char* const FINGERPRINT_XATTR = "user.domx.fingerprint";
+
+  // The change journal of a catalog which keeps one.  It starts with a
+  // header holding the last sequence number compacted away, followed by
+  // one line per change: sequence number, operation, key and any
+  // destination, separated by tabs, with the key and destination escaped
+  // like index fields.  Readers binary search the sequence numbers down
+  // to JOURNAL_BLOCK bytes and read on from there.
+  const char* const JOURNAL_FILE = ".journal";
+  const char* const JOURNAL_HEADER = "domx-journal ";
+  const char JOURNAL_OPS[] = "IRMD";
+  const off_t JOURNAL_BLOCK = 4096;
+
+  // The summary of a catalog which keeps one: a single xml document with
+  // the text of every object, and the log of changes not yet folded into
+  // it.  Each log record is a header line with the operation, the lengths
+  // of the key and text and the version the text was stored as, followed
+  // by the key and text themselves.  A background thread rewrites the
+  // summary once the log reaches a quarter of its size, or on the first
+  // change after it is SUMMARY_PERIOD seconds old, holding the fold lock
+  // so only one fold runs at a time.
+  const char* const SUMMARY_FILE = ".summary";
+  const char* const SUMMARY_LOG = ".summary.log";
+  const char* const SUMMARY_LOCK = ".summary.lock";
+  const time_t SUMMARY_PERIOD = 5;
+
+  // The indexes of a catalog which keeps any, two files for each member
+  // path named after it: a file of lines sorted by value, each with a
+  // key which has the value and the version of the object it was read
+  // from, and a log of the changes since.  A background thread merges
+  // the log into the sorted file once it reaches an eighth of its size,
+  // and at least INDEX_LOG_MIN.  Lookups binary search the sorted file,
+  // reading INDEX_BLOCK bytes at a time once the search has narrowed to
+  // that.
+  const char* const INDEX_DIR = ".indexes";
+  const char* const INDEX_FILE = ".idx";
+  const char* const INDEX_LOG = ".log";
+  const string::size_type INDEX_NAME_MAX = 200;
+  const off_t INDEX_LOG_MIN = 64 << 10;
+  const off_t INDEX_BLOCK = 4096;
+
+  // Appends go to a new segment once the active one reaches this size,
+  // and compaction starts once most of the segment bytes are dead.
+  const off_t SEGMENT_SIZE = 32 << 20;
+  const off_t COMPACT_MIN = 4 << 20;
+
+  /**
+   * An object which has been serialized and written to a file but is not
+   * yet visible in the catalog.  When the file was opened with O_TMPFILE
+   * it has no name until it is published and @c path is empty, otherwise
+   * @c path is the temporary name.  The serialized text is kept in case
+   * the file has to be rewritten under a name.  @c dirfd is the directory
+   * which will hold the object: the catalog directory or one of its
+   * shards.
+   **/
+  struct CatalogTempFile
+  {
+    int fd;
+    int dirfd;
+    string path;
+    string data;
+    int synced;
+    XmlObjectCatalog::ObjectVersion version;
+
+    CatalogTempFile() :
+      fd (-1),
+      dirfd (-1),
+      synced (0)
+    {}
+  };
+
+  /**
+   * An index kept by a catalog: the member path, the element names along
+   * it, the name its files share in the index directory, and whether its
+   * sorted file has been built yet.
+   **/
+  struct CatalogIndex
+  {
+    string path;
+    std::vector<string> elements;
+    string name;
+    bool built;
+
+    CatalogIndex() :
+      built (false)
+    {}
+  };
+
+  /**
+   * A cached catalog directory.  The layout is only read from the layout
+   * files once the directory is opened as a catalog rather than just
+   * passed through as a parent.  Partition directories come and go, so
+   * they are opened as they are needed and dropped from the map when the
+   * partition is dropped.
+   *
+   * Each open catalog on the directory, and each background removal in
+   * it, counts as a user.  Descriptors which a migration replaces or a
+   * drop takes out of the map are kept in @c retired, since users may
+   * still hold copies.  Once the directory has been removed and dropped
+   * from the cache, the entry and all of its descriptors are freed with
+   * its last user.
+   **/
+  struct CatalogDirectory
+  {
+    int fd;
+    bool layout;
+    std::vector<int> shards;
+    XmlObjectCatalog::EnumPartitioning partitioning;
+    std::map<string, int> partitions;
+    bool segmented;
+    int users;
+    bool cached;
+    std::vector<int> retired;
+
+    CatalogDirectory (int fd_) :
+      fd (fd_),
+      layout (false),
+      partitioning (XmlObjectCatalog::PARTITION_NONE),
+      segmented (false),
+      users (0),
+      cached (true)
+    {}
+  };
+
+  /**
+   * Where a catalog keeps the text of its objects.  The catalog checks its
+   * arguments and serializes and parses the objects, and the backend only
+   * stores text under keys: CatalogFiles keeps one file per object,
+   * CatalogSegments packs them into segment files, and CatalogMemory keeps
+   * them in this process only.  Errors are queued on the catalog @c cp.
+   * A missing object is not an error: get() returns false with errno set
+   * to ENOENT.
+   **/
+  struct CatalogBackend
+  {
+    typedef std::vector<std::pair<string, string> > text_list_t;
+
+    XmlObjectCatalogP* cp;
+
+    CatalogBackend (XmlObjectCatalogP* cp_) :
+      cp (cp_)
+    {}
+
+    virtual
+    ~CatalogBackend ()
+    {}
+
+    virtual XmlObjectCatalog::EnumStorage
+    storage () = 0;
+
+    // Store each text under its key.  A @p batch succeeds or fails as a
+    // group and is made durable whatever the durability policy.  Without
+    // a batch there is one object, which is only stored if it is @p
+    // absent or still the version @p expected when either is asked for.
+    // A failed condition returns false without queuing an error.  A put
+    // which succeeds fills in any @p versions with the version each text
+    // was stored as, left empty where it is not known.
+    virtual bool
+    put (const text_list_t& objects, bool batch, bool absent,
+	 const XmlObjectCatalog::ObjectVersion* expected,
+	 std::vector<XmlObjectCatalog::ObjectVersion>* versions) = 0;
+
+    virtual bool
+    get (const std::string& id, std::string& text,
+	 XmlObjectCatalog::ObjectVersion* version) = 0;
+
+    // Fill in the version of an object without reading it, so the
+    // checksum is only set if the backend already knows it.
+    virtual bool
+    stat (const std::string& id, XmlObjectCatalog::ObjectVersion& version) = 0;
+
+    virtual bool
+    remove (const std::string& id) = 0;
+
+    // Add at least the keys from @p from up to but not including @p to,
+    // or to the end if @p to is empty, to @p kset.  The catalog trims any
+    // extra keys.
+    virtual bool
+    list (const std::string& from, const std::string& to,
+	  XmlObjectCatalog::key_set_t& kset) = 0;
+
+    virtual bool
+    exists (const std::string& id, bool& found) = 0;
+
+    // True if the object @p id is stored with exactly @p text, judged by
+    // its size and checksum without reading it.  By default the version
+    // from stat() decides, when the backend knows the checksum.
+    virtual bool
+    unchanged (const std::string& id, const std::string& text);
+
+    // True if get() and stat() can run in several threads at once, as
+    // loadMany() does.  Otherwise the catalog serializes them.
+    virtual bool
+    concurrentReads ()
+    {
+      return false;
+    }
+
+    // Move the objects @p names to @p dest.  Backends override this to
+    // move within their own storage, and by default each object is copied
+    // to @p dest before it is removed here, so it is never lost.  Moving
+    // objects to the storage they are already in does nothing.
+    virtual bool
+    rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest);
+  };
+
+  /**
+   * Storage for a catalog which keeps one xml file per object, named by
+   * its key, in the catalog directory or in its shard or partition
+   * directories.  This is the default.
+   **/
+  struct CatalogFiles : public CatalogBackend
+  {
+    CatalogFiles (XmlObjectCatalogP* cp_) :
+      CatalogBackend (cp_)
+    {}
+
+    XmlObjectCatalog::EnumStorage
+    storage ()
+    {
+      return XmlObjectCatalog::STORAGE_FILES;
+    }
+
+    bool
+    concurrentReads ()
+    {
+      return true;
+    }
+
+    bool
+    put (const text_list_t& objects, bool batch, bool absent,
+	 const XmlObjectCatalog::ObjectVersion* expected,
+	 std::vector<XmlObjectCatalog::ObjectVersion>* versions);
+
+    bool
+    get (const std::string& id, std::string& text,
+	 XmlObjectCatalog::ObjectVersion* version);
+
+    bool
+    stat (const std::string& id, XmlObjectCatalog::ObjectVersion& version);
+
+    bool
+    remove (const std::string& id);
+
+    bool
+    list (const std::string& from, const std::string& to,
+	  XmlObjectCatalog::key_set_t& kset);
+
+    bool
+    exists (const std::string& id, bool& found);
+
+    bool
+    rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest);
+
+    bool
+    unchanged (const std::string& id, const std::string& text);
+
+    bool
+    putOne (const std::string& id, const std::string& text, bool absent,
+	    XmlObjectCatalog::ObjectVersion& version);
+
+    bool
+    putBatch (const text_list_t& objects,
+	      std::vector<XmlObjectCatalog::ObjectVersion>& versions);
+
+    bool
+    replace (const std::string& id, const std::string& text,
+	     const XmlObjectCatalog::ObjectVersion& expected,
+	     XmlObjectCatalog::ObjectVersion& version);
+
+    bool
+    lockObject (int dirfd, const std::string& filename, int& fd);
+  };
+
+  /**
+   * The objects of an in-memory catalog, shared by every catalog opened
+   * on the same name in this process.  Each put gets the next serial
+   * number as the inode of its version.
+   **/
+  struct MemoryStore
+  {
+    struct Object
+    {
+      string text;
+      XmlObjectCatalog::ObjectVersion version;
+    };
+
+    pthread_mutex_t lock;
+    std::map<string, Object> objects;
+    unsigned long long serial;
+
+    MemoryStore () :
+      serial (0)
+    {
+      pthread_mutex_init (&lock, 0);
+    }
+  };
+
+  /**
+   * Storage for a catalog which only lives in the memory of this process,
+   * for tests and for scratch catalogs which never need to persist.
+   **/
+  struct CatalogMemory : public CatalogBackend
+  {
+    MemoryStore* store;
+
+    CatalogMemory (XmlObjectCatalogP* cp_, MemoryStore* store_) :
+      CatalogBackend (cp_),
+      store (store_)
+    {}
+
+    XmlObjectCatalog::EnumStorage
+    storage ()
+    {
+      return XmlObjectCatalog::STORAGE_MEMORY;
+    }
+
+    bool
+    concurrentReads ()
+    {
+      return true;
+    }
+
+    bool
+    put (const text_list_t& objects, bool batch, bool absent,
+	 const XmlObjectCatalog::ObjectVersion* expected,
+	 std::vector<XmlObjectCatalog::ObjectVersion>* versions);
+
+    bool
+    get (const std::string& id, std::string& text,
+	 XmlObjectCatalog::ObjectVersion* version);
+
+    bool
+    stat (const std::string& id, XmlObjectCatalog::ObjectVersion& version);
+
+    bool
+    remove (const std::string& id);
+
+    bool
+    list (const std::string& from, const std::string& to,
+	  XmlObjectCatalog::key_set_t& kset);
+
+    bool
+    exists (const std::string& id, bool& found);
+
+    bool
+    rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest);
+  };
+
+  /**
+   * Storage for a catalog which packs its objects into append-only
+   * segment files instead of one file per object.  Each insert or remove
+   * appends a checksummed record to the active segment, and a batch is a
+   * single record holding all of its objects, so a reader either sees a
+   * whole record or ignores it as not yet written.  The manifest file
+   * lists the segments in order, and the index maps each key to the
+   * offset of its latest record.  Writers serialize on a lock file, while
+   * readers just follow the tail of the active segment and reload when
+   * the manifest is replaced.  Compaction copies the live records of the
+   * sealed segments into one new segment with a sorted index file, so
+   * reopening a compacted catalog does not have to scan the data.
+   **/
+  struct CatalogSegments : public CatalogBackend
+  {
+    struct Segment
+    {
+      unsigned int number;
+      int fd;
+      off_t scanned;
+    };
+
+    struct Entry
+    {
+      unsigned int segment;
+      off_t offset;
+      size_t length;
+      unsigned long long checksum;
+      size_t size;
+    };
+
+    typedef std::map<string, Entry> index_t;
+
+    // The catalog may be null here, as for the background compaction
+    // thread, and then errors are only logged.
+    int dirfd;
+    string path;
+    int lockfd;
+    ino_t manifest;
+    std::vector<Segment> segments;
+    index_t index;
+
+    // Bytes of live object text and bytes in all segments, which decide
+    // when compaction is worth it.
+    off_t live;
+    off_t total;
+
+    CatalogSegments (XmlObjectCatalogP* cp_, int dirfd_,
+		     const std::string& path_);
+
+    ~CatalogSegments ();
+
+    template <typename T>
+    void
+    fail (const T& msg);
+
+    void
+    reset ();
+
+    bool
+    open ();
+
+    bool
+    create ();
+
+    XmlObjectCatalog::EnumStorage
+    storage ()
+    {
+      return XmlObjectCatalog::STORAGE_SEGMENTS;
+    }
+
+    bool
+    get (const std::string& id, std::string& text,
+	 XmlObjectCatalog::ObjectVersion* version);
+
+    bool
+    stat (const std::string& id, XmlObjectCatalog::ObjectVersion& version);
+
+    bool
+    unchanged (const std::string& id, const std::string& text);
+
+    bool
+    put (const text_list_t& objects, bool batch, bool absent,
+	 const XmlObjectCatalog::ObjectVersion* expected,
+	 std::vector<XmlObjectCatalog::ObjectVersion>* versions);
+
+    bool
+    remove (const std::string& id);
+
+    bool
+    list (const std::string& from, const std::string& to,
+	  XmlObjectCatalog::key_set_t& kset);
+
+    bool
+    exists (const std::string& id, bool& found);
+
+    bool
+    rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest);
+
+    bool
+    compact ();
+
+    bool
+    needsCompaction ();
+
+    bool
+    refresh (bool writer);
+
+    bool
+    readManifest (std::vector<unsigned int>& numbers, ino_t& ino);
+
+    bool
+    writeManifest (const std::vector<unsigned int>& numbers);
+
+    bool
+    openSegment (unsigned int number, bool create);
+
+    bool
+    loadIndex (Segment& seg);
+
+    bool
+    scan (Segment& seg, bool writer);
+
+    bool
+    parse (const std::string& buf, std::string::size_type p, off_t base,
+	   unsigned int number, std::string::size_type& end, bool nested);
+
+    void
+    update (const std::string& key, char op, const Entry& entry);
+
+    bool
+    append (const std::string& records);
+
+    bool
+    roll ();
+
+    bool
+    writeCompacted (const std::string& tmpname,
+		    const std::vector<std::pair<string, Entry> >& entries);
+
+    bool
+    lock ();
+
+    void
+    unlock ();
+
+    int
+    segmentFd (unsigned int number);
+
+    bool
+    writeAt (int fd, off_t offset, const std::string& text);
+
+    bool
+    writeFile (const std::string& filename, const std::string& text);
+
+    static string
+    segmentName (unsigned int number);
+
+    static size_t
+    headerSize (char op, unsigned long a, unsigned long b,
+		unsigned long long sum);
+
+    static string
+    record (char op, const std::string& key, const std::string& data);
+
+    static void
+    toVersion (const Entry& entry, XmlObjectCatalog::ObjectVersion& v);
+  };
+
+  /**
+   * The work of one keys() thread: the directories it scans and the keys
+   * it finds.  Errors are kept here rather than queued, since the error
+   * queue is not shared between threads.
+   **/
+  struct DirectoryScan
+  {
+    XmlObjectCatalogP* cp;
+    std::vector<int> dirs;
+    XmlObjectCatalog::key_set_t keys;
+    string error;
+    bool ok;
+    pthread_t thread;
+  };
+
+  /**
+   * The io_uring which one loadMany() call reads all of its batches
+   * through, or none if it could not be set up or has stopped working.
+   **/
+  struct CatalogRing
+  {
+#ifdef DOMX_HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    bool ready;
+
+    CatalogRing() :
+      ready (false)
+    {}
+  };
+
+  /**
+   * One file for readFiles() to read, and what it found.  An object which
+   * does not exist is @c done but not @c ok.
+   **/
+  struct CatalogRead
+  {
+    int dirfd;
+    string filename;
+    string text;
+    XmlObjectCatalog::ObjectVersion version;
+    bool done;
+    bool ok;
+  };
+
+  /**
+   * An insert waiting in the queue of setAsyncInsert(): the latest text
+   * for its key, and when it is due to be written.  A later insert of the
+   * same key replaces the text but keeps the time.
+   **/
+  struct AsyncInsert
+  {
+    string text;
+    struct timespec due;
+  };
+
+  /**
+   * A loadMany() call shared by its threads.  Each thread takes the next
+   * object under the lock, and queues its index on @c done once it is
+   * loaded for the calling thread to deliver.
+   **/
+  struct LoadBatch
+  {
+    XmlObjectCatalogP* cp;
+    const XmlObjectCatalog::object_list_t* objects;
+    unsigned int next;
+    std::vector<char> loaded;
+    std::list<unsigned int> done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // When the calling thread reads the objects ahead, the threads only
+    // parse them, and only the first @c ready have been read.  The @c
+    // more condition signals that @c ready has grown.
+    std::vector<CatalogRead>* reads;
+    unsigned int ready;
+    pthread_cond_t more;
+
+    // Progress of the calling thread through the objects which are done.
+    unsigned int delivered;
+    bool ok;
+
+    void
+    deliver (XmlObjectCatalog::load_callback_t callback, void* arg,
+	     bool wait);
+  };
+
+  /**
+   * Dropped partitions waiting to be removed by a background thread,
+   * which owns and deletes this.
+   **/
+  struct TrashRemoval
+  {
+    int dirfd;
+    CatalogDirectory* cache;
+    std::vector<string> names;
+  };
+
+  /**
+   * Parsed objects kept for load(), keyed by catalog directory and object
+   * key, with the most recently used first.  Each entry remembers the
+   * version it was parsed from and is only used while the stored object
+   * still has that version.  The cached objects are only read, to copy
+   * their documents, and only under the lock.
+   *
+   * The shared cache is a directory of slot files, one per hash of the
+   * key, holding the version and the flat form of an object, which other
+   * processes fill and read the same way.  Each slot is replaced with a
+   * rename, so it is always read whole.
+   **/
+  struct LoadCache
+  {
+    struct Entry
+    {
+      string key;
+      XmlObjectCatalog::ObjectVersion version;
+      XmlObjectInterface* object;
+    };
+    typedef std::list<Entry> lru_t;
+
+    // The fixed header of a shared slot, followed by the key and the flat
+    // object.  The data checksum guards against a damaged slot.
+    struct SlotHeader
+    {
+      char magic[8];
+      unsigned long long device;
+      unsigned long long inode;
+      long long mtime_ns;
+      long long size;
+      unsigned long long checksum;
+      unsigned int keylen;
+      unsigned int datalen;
+      unsigned long long datasum;
+    };
+
+    pthread_mutex_t lock;
+    unsigned int capacity;
+    lru_t lru;
+    std::map<string, lru_t::iterator> index;
+    unsigned long long hits;
+    unsigned long long misses;
+
+    int shared_fd;
+    unsigned int shared_slots;
+    unsigned long long shared_hits;
+    unsigned long long shared_misses;
+
+    LoadCache () :
+      capacity (0),
+      hits (0),
+      misses (0),
+      shared_fd (-1),
+      shared_slots (0),
+      shared_hits (0),
+      shared_misses (0)
+    {
+      pthread_mutex_init (&lock, 0);
+    }
+
+    bool
+    enabled ();
+
+    bool
+    fetch (const std::string& key,
+	   const XmlObjectCatalog::ObjectVersion& current,
+	   XmlObjectInterface* object,
+	   XmlObjectCatalog::ObjectVersion* version);
+
+    bool
+    store (const std::string& key,
+	   const XmlObjectCatalog::ObjectVersion& version,
+	   const std::string& text, XmlObjectInterface* object);
+
+    void
+    resize (unsigned int entries);
+
+    void
+    insert (const std::string& key,
+	    const XmlObjectCatalog::ObjectVersion& version,
+	    XmlObjectInterface* object);
+
+    void
+    trim ();
+
+    void
+    erase (lru_t::iterator it);
+
+    static bool
+    readSlot (int dirfd, unsigned int slots, const std::string& key,
+	      const XmlObjectCatalog::ObjectVersion& current,
+	      XmlObjectInterface* object,
+	      XmlObjectCatalog::ObjectVersion& version);
+
+    static void
+    writeSlot (int dirfd, unsigned int slots, const std::string& key,
+	       const XmlObjectCatalog::ObjectVersion& version,
+	       const std::string& flat);
+
+    static string
+    slotName (const std::string& key, unsigned int slots);
+
+    static bool
+    sameVersion (const XmlObjectCatalog::ObjectVersion& cached,
+		 const XmlObjectCatalog::ObjectVersion& current);
+  };
+
+  /**
+   * The record of a catalog which registerCatalog() inserts into the
+   * system catalog.
+   **/
+  class XmlObjectCatalogEntry : public XmlObjectInterface
+  {
+    XmlObjectNode* _xi;
+
+  public:
+    XmlObjectMember<string> Name;
+    XmlObjectMember<string> Path;
+
+    XmlObjectCatalogEntry() :
+      _xi (newNode("xmlobjectcatalog")),
+      Name (_xi, "name"),
+      Path (_xi, "path")
+    {}
+  };
+
+  struct XmlObjectCatalogP
+  {
+    string _name;
+    string _path;
+    XmlObjectCatalog* _that;
+
+    // Note that root is not preserved, so that root can change as the
+    // catalog is migrated between systems, and since specifying root would
+    // be superfluous, as its already known by the time the catalog is
+    // opened.
+    string _root;
+    logx::EventSource<XmlObjectCatalogP> failures;
+
+    // Current state, which determines which operations are allowed.
+    enum { CLOSED, OPEN } _state;
+
+    // Durability policy and the state of the background sync thread used
+    // by SYNC_PERIODIC.  The lock protects _dirty and _syncing.
+    XmlObjectCatalog::EnumDurability _durability;
+    unsigned int _sync_period;
+    bool _dirty;
+    bool _syncing;
+    pthread_t _syncer;
+    pthread_mutex_t _sync_lock;
+    pthread_cond_t _sync_cond;
+
+    // Cleared the first time the catalog filesystem refuses O_TMPFILE or
+    // an anonymous file cannot be linked, after which named temporary
+    // files are used instead.  Concurrent inserts may clear it at once,
+    // so it is only read and written with useTmpfile() and noTmpfile().
+    bool _use_tmpfile;
+
+    // Whether inserts of unchanged objects are skipped, and whether the
+    // filesystem takes the fingerprint attribute, cleared the first time
+    // it refuses one, through useXattr() and noXattr() like the flag
+    // above.
+    bool _skip_unchanged;
+    bool _use_xattr;
+
+    bool
+    useTmpfile ()
+    {
+      return __atomic_load_n (&_use_tmpfile, __ATOMIC_RELAXED);
+    }
+
+    void
+    noTmpfile ()
+    {
+      __atomic_store_n (&_use_tmpfile, false, __ATOMIC_RELAXED);
+    }
+
+    bool
+    useXattr ()
+    {
+      return __atomic_load_n (&_use_xattr, __ATOMIC_RELAXED);
+    }
+
+    void
+    noXattr ()
+    {
+      __atomic_store_n (&_use_xattr, false, __ATOMIC_RELAXED);
+    }
+
+    // The open catalog directory.  All file operations are relative to
+    // it, so they need no path building or lookups of the full path, and
+    // they keep working if the root is renamed while the catalog is open.
+    // The descriptor belongs to the process-wide directory cache and is
+    // shared with every other catalog open on the same directory.
+    int _dirfd;
+    string _directory;
+
+    // Descriptors for the shard directories, empty for a flat catalog,
+    // and the cache entry they came from.  The partition descriptors stay
+    // in the cache entry.
+    std::vector<int> _shards;
+    XmlObjectCatalog::EnumPartitioning _partitioning;
+    CatalogDirectory* _cache;
+
+    // Where the objects are stored while the catalog is open.  In segment
+    // storage, _segments is the same backend, and the compactor thread
+    // compacts its segments in the background.  The sync lock protects the
+    // compaction flags.
+    CatalogBackend* _backend;
+    CatalogSegments* _segments;
+    pthread_t _compactor;
+    bool _compacting;
+    bool _compacted;
+
+    // The change journal, opened for appending while the catalog keeps
+    // one, otherwise -1.  The flock on the journal only keeps other
+    // processes out, so the journal lock serializes the appends of the
+    // background insert thread with those of the caller.  It also guards
+    // the last sequence number appended and the size of the file after
+    // it, or -1, so the end of the file is only read again once another
+    // process has appended to it.
+    int _journal_fd;
+    pthread_mutex_t _journal_lock;
+    unsigned long long _journal_sequence;
+    off_t _journal_size;
+
+    // The summary log, opened for appending while the catalog keeps a
+    // summary, otherwise -1, and the lock which serializes its users in
+    // this process, as for the journal.  The folder thread folds the log
+    // into the summary in the background, with its flags protected by the
+    // sync lock like those of the compactor.
+    int _summary_fd;
+    pthread_mutex_t _summary_lock;
+    pthread_t _folder;
+    bool _folding;
+    bool _folded;
+
+    // The directory of indexes while the catalog has one, otherwise -1,
+    // and the indexes last listed from it, with the modification time of
+    // the directory then and when they were listed.  Other processes add
+    // and drop indexes, so the list is read again when the directory
+    // changes.  The index lock only protects the list, since each index
+    // is locked through its own log.
+    int _index_fd;
+    long long _index_mtime;
+    time_t _index_listed;
+    std::vector<CatalogIndex> _indexes;
+    pthread_mutex_t _index_lock;
+
+    // The merger thread merges index logs into their sorted files in the
+    // background, with its flags protected by the sync lock like those of
+    // the folder.
+    pthread_t _merger;
+    bool _merging;
+    bool _merged;
+
+    // Inserts queued by setAsyncInsert(), with the latest text of each key
+    // and when it is due, and the writer thread which writes them.  The
+    // insert lock protects the queue and the writer state, and _flushing
+    // counts the callers waiting in flushInserts(), which makes every
+    // queued insert due.
+    unsigned int _async_window;
+    std::map<string, AsyncInsert> _async_queue;
+    bool _async_running;
+    bool _async_writing;
+    bool _async_failed;
+    unsigned int _flushing;
+    pthread_t _async_writer;
+    pthread_mutex_t _insert_lock;
+    pthread_cond_t _insert_cond;
+    pthread_cond_t _insert_idle;
+
+    // The read lock serializes reads from the threads of loadMany() when
+    // the backend cannot take concurrent readers.  The error lock guards
+    // the error queue, which those threads share.
+    pthread_mutex_t _read_lock;
+    pthread_mutex_t _error_lock;
+
+    XmlObjectCatalogP (XmlObjectCatalog* that) :
+      _that (that),
+      failures (this, &XmlObjectCatalogP::fail),
+      _durability (XmlObjectCatalog::SYNC_NONE),
+      _sync_period (1),
+      _dirty (false),
+      _syncing (false),
+      _use_tmpfile (true),
+      _skip_unchanged (false),
+      _use_xattr (true),
+      _dirfd (-1),
+      _partitioning (XmlObjectCatalog::PARTITION_NONE),
+      _cache (0),
+      _backend (0),
+      _segments (0),
+      _compacting (false),
+      _compacted (false),
+      _journal_fd (-1),
+      _journal_sequence (0),
+      _journal_size (-1),
+      _summary_fd (-1),
+      _folding (false),
+      _folded (false),
+      _index_fd (-1),
+      _index_mtime (-1),
+      _index_listed (0),
+      _merging (false),
+      _merged (false),
+      _async_window (0),
+      _async_running (false),
+      _async_writing (false),
+      _async_failed (false),
+      _flushing (0)
+    {
+      _state = CLOSED;
+      pthread_mutex_init (&_sync_lock, 0);
+      pthread_cond_init (&_sync_cond, 0);
+      pthread_mutex_init (&_insert_lock, 0);
+      pthread_mutex_init (&_journal_lock, 0);
+      pthread_mutex_init (&_summary_lock, 0);
+      pthread_mutex_init (&_index_lock, 0);
+      pthread_cond_init (&_insert_cond, 0);
+      pthread_cond_init (&_insert_idle, 0);
+      pthread_mutex_init (&_read_lock, 0);
+      pthread_mutex_init (&_error_lock, 0);
+    }
+
+    ~XmlObjectCatalogP ()
+    {
+      stopWriter();
+      stopSyncer();
+      stopCompactor();
+      stopFolder();
+      stopMerger();
+      closeDirectory();
+      pthread_cond_destroy (&_insert_idle);
+      pthread_cond_destroy (&_insert_cond);
+      pthread_mutex_destroy (&_insert_lock);
+      pthread_mutex_destroy (&_journal_lock);
+      pthread_mutex_destroy (&_summary_lock);
+      pthread_mutex_destroy (&_index_lock);
+      pthread_cond_destroy (&_sync_cond);
+      pthread_mutex_destroy (&_sync_lock);
+      pthread_mutex_destroy (&_read_lock);
+      pthread_mutex_destroy (&_error_lock);
+    }
+
+    void
+    setPath (const std::string& path)
+    {
+      // Keep the fully qualified path as the name.
+      _path = path;
+      _name = path;
+      _root = XmlObjectCatalog::rootCatalogDirectory();
+      _directory = _root + "/" + path;
+    }
+
+    void
+    closeDirectory ();
+
+    bool
+    isOpen ()
+    {
+      return _state == OPEN;
+    }
+
+    void
+    fail (const std::string& msg);
+
+    bool
+    openDirectory ();
+
+    bool
+    loadLayout (CatalogDirectory* cd);
+
+    bool
+    openShards (int dirfd, unsigned int nshards, std::vector<int>& shards);
+
+    int
+    partitionDir (const std::string& name, bool create);
+
+    bool
+    partitionDirs (const std::string& from, const std::string& to,
+		   std::vector<int>& dirs);
+
+    bool
+    listEntries (int dirfd, const std::string& prefix,
+		 std::vector<std::string>& names);
+
+    bool
+    migrate (unsigned int nshards, XmlObjectCatalog::EnumPartitioning mode);
+
+    bool
+    writeLayout (const char* filename, const std::string& text);
+
+    bool
+    scanDirectory (int dirfd, XmlObjectCatalog::key_set_t& kset,
+		   std::string& error);
+
+    bool
+    scanDirectories (const std::vector<int>& dirs,
+		     XmlObjectCatalog::key_set_t& kset);
+
+    static void*
+    scanMain (void* arg);
+
+    static void
+    removeDirectory (int dirfd, const std::string& name);
+
+    static void*
+    removeMain (void* arg);
+
+    bool
+    serialize (const std::string& id, XmlObjectInterface* object,
+	       std::string& text);
+
+    bool
+    putObjects (const XmlObjectCatalog::object_list_t& objects, bool batch,
+		bool absent, const XmlObjectCatalog::ObjectVersion* expected);
+
+    bool
+    putTexts (const CatalogBackend::text_list_t& texts, bool batch,
+	      bool absent, const XmlObjectCatalog::ObjectVersion* expected);
+
+    bool
+    queueInsert (const std::string& id, XmlObjectInterface* object);
+
+    bool
+    flushInserts ();
+
+    void
+    settleInsert (const std::string& id, bool discard);
+
+    void
+    stopWriter ();
+
+    static void*
+    writerMain (void* arg);
+
+    bool
+    openJournal ();
+
+    bool
+    lockJournal ();
+
+    void
+    unlockJournal ();
+
+    bool
+    lastSequence (unsigned long long& sequence);
+
+    bool
+    journal (XmlObjectCatalog::EnumJournalOp op,
+	     const std::vector<std::string>& keys,
+	     const std::string& destination = "");
+
+    bool
+    readJournal (unsigned long long after, unsigned long long& base,
+		 XmlObjectCatalog::journal_t& entries);
+
+    typedef std::map<string, string> summary_t;
+
+    bool
+    openSummary ();
+
+    bool
+    lockSummary ();
+
+    void
+    unlockSummary ();
+
+    bool
+    summarize (char op, const std::vector<std::string>& keys);
+
+    bool
+    summarize (char op, const CatalogBackend::text_list_t& changes,
+	       const std::vector<XmlObjectCatalog::ObjectVersion>& versions);
+
+    bool
+    foldSummary (bool rebuild, CatalogBackend* backend, bool wait);
+
+    void
+    startFolder ();
+
+    void
+    stopFolder ();
+
+    static void*
+    folderMain (void* arg);
+
+    CatalogBackend*
+    readerBackend ();
+
+    bool
+    readSummary (summary_t& objects, unsigned long long& changes);
+
+    bool
+    writeSummary (const summary_t& objects, unsigned long long changes,
+		  CatalogTempFile& tmp);
+
+    // The lines of an index by key, and the versions of an object which
+    // had a value.
+    typedef std::map<string, string> index_entries_t;
+    typedef std::vector<XmlObjectCatalog::ObjectVersion> index_versions_t;
+
+    bool
+    openIndexes (bool create);
+
+    void
+    closeIndexes ();
+
+    bool
+    currentIndexes (std::vector<CatalogIndex>& indexes);
+
+    bool
+    findIndex (const std::string& path, CatalogIndex& index, bool& found);
+
+    int
+    lockIndex (const CatalogIndex& index, int operation, bool writing);
+
+    bool
+    appendIndex (const CatalogIndex& index, const std::string& records);
+
+    bool
+    readIndexed (const std::string& key, std::string& text,
+		 XmlObjectCatalog::ObjectVersion& version,
+		 CatalogBackend* backend = 0);
+
+    bool
+    indexTexts (const CatalogBackend::text_list_t& texts,
+		const std::vector<XmlObjectCatalog::ObjectVersion>& versions);
+
+    bool
+    indexKeys (const std::vector<std::string>& keys);
+
+    bool
+    readIndex (const CatalogIndex& index, const std::string& value,
+	       std::map<std::string, index_versions_t>& found);
+
+    bool
+    snapshotIndex (const CatalogIndex& index, index_entries_t& entries);
+
+    bool
+    mergeDue (const CatalogIndex& index, off_t logsize);
+
+    bool
+    compactIndex (const CatalogIndex& index, const index_entries_t* snapshot,
+		  bool wait, CatalogBackend* backend = 0);
+
+    bool
+    mergeIndex (const CatalogIndex& index, const index_entries_t* snapshot,
+		CatalogBackend* backend);
+
+    void
+    startMerger ();
+
+    void
+    stopMerger ();
+
+    static void*
+    mergerMain (void* arg);
+
+    bool
+    dropIndex (const CatalogIndex& index);
+
+    static bool
+    indexElements (const std::string& path,
+		   std::vector<std::string>& elements);
+
+    static string
+    indexName (const std::string& text);
+
+    static string
+    escapeField (const std::string& text);
+
+    static string
+    unescapeField (const std::string& name);
+
+    static string
+    indexLine (const std::string& value, const std::string& key,
+	       const XmlObjectCatalog::ObjectVersion& v);
+
+    static bool
+    parseIndexLine (const std::string& line, std::string& value,
+		    std::string& key, XmlObjectCatalog::ObjectVersion& v);
+
+    static bool
+    readLine (int fd, off_t offset, std::string& line);
+
+    static bool
+    searchIndex (int fd, const std::string& prefix,
+		 std::vector<std::string>& lines);
+
+    static string
+    lineEnds (const std::string& text);
+
+    static bool
+    memberText (const std::string& text, const std::vector<std::string>& path,
+		std::string& value);
+
+    bool
+    convertStorage (XmlObjectCatalog::EnumStorage mode);
+
+    void
+    startCompactor ();
+
+    void
+    stopCompactor ();
+
+    static void*
+    compactorMain (void* arg);
+
+    bool
+    writeText (const std::string& id, const std::string& text,
+	       CatalogTempFile& tmp);
+
+    bool
+    openNamedTemp (const std::string& filename, CatalogTempFile& tmp);
+
+    bool
+    writeData (CatalogTempFile& tmp);
+
+    bool
+    syncTemp (CatalogTempFile& tmp, bool dataonly);
+
+    bool
+    publishTemp (CatalogTempFile& tmp, const std::string& filename);
+
+    void
+    discardTemp (CatalogTempFile& tmp);
+
+    static string
+    uniqueSuffix ();
+
+    bool
+    publishNew (CatalogTempFile& tmp, const std::string& filename,
+		bool& existed);
+
+    int
+    renameNoReplace (int dirfd, const std::string& from,
+		     const std::string& to);
+
+    bool
+    linkAnonymous (CatalogTempFile& tmp, const std::string& filename);
+
+    bool
+    rewriteNamed (CatalogTempFile& tmp, const std::string& filename);
+
+    void
+    stampTemp (CatalogTempFile& tmp);
+
+    static void
+    toVersion (const struct stat& sbuf, XmlObjectCatalog::ObjectVersion& v);
+
+    bool
+    readObject (const std::string& id, std::string& text,
+		XmlObjectCatalog::ObjectVersion* version);
+
+    bool
+    statObject (const std::string& id,
+		XmlObjectCatalog::ObjectVersion& version);
+
+    bool
+    parseObject (const std::string& id, const std::string& text,
+		 const XmlObjectCatalog::ObjectVersion& current,
+		 XmlObjectInterface* object,
+		 XmlObjectCatalog::ObjectVersion* version);
+
+    void
+    readFiles (std::vector<CatalogRead>& reads, unsigned int begin,
+	       unsigned int end, CatalogRing& ring);
+
+#ifdef DOMX_HAVE_LIBURING
+    static bool
+    uringRead (struct io_uring& ring, std::vector<CatalogRead>& reads,
+	       unsigned int begin, unsigned int end);
+
+    static bool
+    uringRun (struct io_uring& ring, unsigned int count,
+	      std::vector<int>& results);
+#endif
+
+    static void*
+    loadMain (void* arg);
+
+    bool
+    loadObject (const std::string& id, XmlObjectInterface* object,
+		XmlObjectCatalog::ObjectVersion* version);
+
+    bool
+    readFile (int dirfd, const std::string& filename, std::string& text,
+	      XmlObjectCatalog::ObjectVersion* version);
+
+    bool
+    syncDirectory (int dirfd);
+
+    bool
+    syncDirectories (const std::vector<int>& dirs);
+
+    bool
+    syncFilesystem ();
+
+    void
+    markDirty ();
+
+    void
+    startSyncer ();
+
+    void
+    stopSyncer ();
+
+    static void*
+    syncerMain (void* arg);
+
+    // The value of the fingerprint attribute for an object file holding
+    // @p text whose status is @p sbuf.
+    static string
+    fingerprint(const std::string& text, const struct stat& sbuf)
+    {
+      char value[128];
+      snprintf (value, sizeof(value), "%llx:%016llx:%llx:%llx.%lx",
+		(unsigned long long)text.length(), textChecksum (text),
+		(unsigned long long)sbuf.st_size,
+		(unsigned long long)sbuf.st_mtim.tv_sec,
+		(long)sbuf.st_mtim.tv_nsec);
+      return value;
+    }
+
+    // The name of an object file relative to the catalog directory.
+    static string
+    objectName(const std::string& id)
+    {
+      return id + ".xml";
+    }
+
+    // The full path to a file in the catalog directory, for messages.
+    string
+    fullPath(const std::string& filename)
+    {
+      return _directory + "/" + filename;
+    }
+
+    // The full path to the catalog directory or the shard directory
+    // @p dirfd, for messages.
+    string
+    dirPath(int dirfd)
+    {
+      for (unsigned int i = 0; i < _shards.size(); ++i)
+      {
+	if (_shards[i] == dirfd)
+	  return fullPath (shardName(i));
+      }
+      return _directory;
+    }
+
+    string
+    fullPath(int dirfd, const std::string& filename)
+    {
+      return dirPath(dirfd) + "/" + filename;
+    }
+
+    // The directory which holds the object @p id.  In a partitioned
+    // catalog, the partition is created if @p create is true, otherwise a
+    // missing partition means the object cannot exist, and the catalog
+    // directory is returned for the lookup to fail in.  Returns -1 if the
+    // partition could not be created.
+    int
+    objectDir(const std::string& id, bool create = false)
+    {
+      if (! _shards.empty())
+	return _shards[textChecksum(id) % _shards.size()];
+      string part = partitionName (_partitioning, id);
+      if (part.empty())
+	return _dirfd;
+      int fd = partitionDir (part, create);
+      if (fd < 0 && ! create)
+	return _dirfd;
+      return fd;
+    }
+
+    // The partition directory for @p id, from the YYYYMMDDTHH prefix of
+    // an XmlTime key, or empty if the key has no time prefix.
+    static string
+    partitionName(XmlObjectCatalog::EnumPartitioning mode,
+		  const std::string& id)
+    {
+      string::size_type len = 0;
+      if (mode == XmlObjectCatalog::PARTITION_DAY)
+	len = 8;
+      else if (mode == XmlObjectCatalog::PARTITION_HOUR)
+	len = 11;
+      if (len == 0 || id.length() < len)
+	return "";
+      for (string::size_type i = 0; i < len; ++i)
+      {
+	if (i == 8 ? id[i] != 'T' : (id[i] < '0' || id[i] > '9'))
+	  return "";
+      }
+      return ".part-" + id.substr (0, len);
+    }
+
+    static string
+    shardName(unsigned int i)
+    {
+      char name[32];
+      snprintf (name, sizeof(name), ".shard-%03x", i);
+      return name;
+    }
+
+    string
+    getDirectory()
+    {
+      return _directory;
+    }
+
+    // Error queue.
+    std::vector<string> _errors;
+
+  };
+
+}
+
+#endif // _domx_XmlObjectCatalogP_h_
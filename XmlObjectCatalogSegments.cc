@@ -0,0 +1,952 @@
+//
+// $Id$
+//
+
+#include "XmlObjectCatalogP.h"
+
+#include "logx/Logging.h"
+#include "logx/system_error.h"
+
+LOGGING("XmlObjectCatalog");
+
+using namespace domx;
+using std::string;
+
+using logx::system_error;
+
+
+CatalogSegments::
+CatalogSegments (XmlObjectCatalogP* cp_, int dirfd_,
+		 const std::string& path_) :
+  CatalogBackend (cp_),
+  dirfd (dirfd_),
+  path (path_),
+  lockfd (-1),
+  manifest (0),
+  live (0),
+  total (0)
+{
+}
+
+
+CatalogSegments::
+~CatalogSegments ()
+{
+  reset();
+  if (lockfd >= 0)
+    close (lockfd);
+}
+
+
+template <typename T>
+void
+CatalogSegments::
+fail (const T& msg)
+{
+  std::ostringstream text;
+  text << msg;
+  if (cp)
+    cp->failures() << text.str();
+  else
+    ELOG << text.str();
+}
+
+
+void
+CatalogSegments::
+reset ()
+{
+  for (unsigned int i = 0; i < segments.size(); ++i)
+  {
+    close (segments[i].fd);
+  }
+  segments.clear();
+  index.clear();
+  manifest = 0;
+  live = 0;
+  total = 0;
+}
+
+
+bool
+CatalogSegments::
+open ()
+{
+  // The lock file only needs to be readable to be locked.
+  lockfd = openat (dirfd, SEGMENT_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (lockfd < 0 && errno == EACCES)
+    lockfd = openat (dirfd, SEGMENT_LOCK, O_RDONLY | O_CLOEXEC);
+  if (lockfd < 0)
+  {
+    fail (system_error("opening", path + "/" + SEGMENT_LOCK));
+    return false;
+  }
+  return refresh (false);
+}
+
+
+bool
+CatalogSegments::
+create ()
+{
+  lockfd = openat (dirfd, SEGMENT_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (lockfd < 0)
+  {
+    fail (system_error("creating", path + "/" + SEGMENT_LOCK));
+    return false;
+  }
+  if (! lock())
+    return false;
+  bool ok;
+  struct stat sbuf;
+  if (fstatat (dirfd, SEGMENT_FILE, &sbuf, 0) == 0)
+  {
+    ok = refresh (true);
+  }
+  else
+  {
+    ok = openSegment (1, true);
+    ok = ok && writeManifest (std::vector<unsigned int> (1, 1));
+  }
+  unlock();
+  return ok;
+}
+
+
+bool
+CatalogSegments::
+lock ()
+{
+  while (flock (lockfd, LOCK_EX) < 0)
+  {
+    if (errno != EINTR)
+    {
+      fail (system_error("locking", path + "/" + SEGMENT_LOCK));
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void
+CatalogSegments::
+unlock ()
+{
+  flock (lockfd, LOCK_UN);
+}
+
+
+bool
+CatalogSegments::
+get (const std::string& id, std::string& text,
+     XmlObjectCatalog::ObjectVersion* version)
+{
+  if (! refresh (false))
+    return false;
+  index_t::iterator it = index.find (id);
+  if (it == index.end())
+  {
+    errno = ENOENT;
+    return false;
+  }
+  // Even if a compaction removes the segment now, the open descriptor
+  // keeps it readable.
+  text.resize (it->second.length);
+  if (! readAt (segmentFd (it->second.segment), it->second.offset, text))
+  {
+    fail (system_error("loading", path + "/" + id));
+    return false;
+  }
+  if (version)
+    toVersion (it->second, *version);
+  return true;
+}
+
+
+bool
+CatalogSegments::
+stat (const std::string& id, XmlObjectCatalog::ObjectVersion& version)
+{
+  if (! refresh (false))
+    return false;
+  index_t::iterator it = index.find (id);
+  if (it == index.end())
+  {
+    errno = ENOENT;
+    return false;
+  }
+  toVersion (it->second, version);
+  return true;
+}
+
+
+bool
+CatalogSegments::
+unchanged (const std::string& id, const std::string& text)
+{
+  // The index has the checksum of each record, which covers the key too.
+  XmlObjectCatalog::ObjectVersion version;
+  if (! cp->statObject (id, version))
+    return false;
+  return version.size == (long long)text.length() &&
+    version.checksum == textChecksum (id + text);
+}
+
+
+bool
+CatalogSegments::
+put (const text_list_t& objects, bool /*batch*/, bool absent,
+     const XmlObjectCatalog::ObjectVersion* expected,
+     std::vector<XmlObjectCatalog::ObjectVersion>* versions)
+{
+  // Every put is one record, so a batch needs nothing more.
+  bool conflict = false;
+  if (objects.empty())
+    return true;
+  if (! lock())
+    return false;
+  bool ok = refresh (true);
+  for (unsigned int i = 0; ok && absent && i < objects.size(); ++i)
+  {
+    conflict = conflict || index.count (objects[i].first);
+  }
+  if (ok && expected)
+  {
+    index_t::iterator it = index.find (objects[0].first);
+    XmlObjectCatalog::ObjectVersion current;
+    if (it != index.end())
+      toVersion (it->second, current);
+    conflict = (it == index.end() || current != *expected);
+  }
+  if (ok && ! conflict)
+  {
+    // A batch is one record, so it becomes visible all at once.
+    string records;
+    for (unsigned int i = 0; i < objects.size(); ++i)
+    {
+      records += record ('P', objects[i].first, objects[i].second);
+    }
+    if (objects.size() > 1)
+    {
+      char head[80];
+      snprintf (head, sizeof(head), "@B %lu %lu %llx\n",
+		(unsigned long)objects.size(), (unsigned long)records.size(),
+		textChecksum (records));
+      records.insert (0, head);
+    }
+    ok = append (records);
+  }
+  // The index now holds the records just appended.
+  for (unsigned int i = 0; ok && ! conflict && versions &&
+	 i < objects.size(); ++i)
+  {
+    XmlObjectCatalog::ObjectVersion version;
+    index_t::iterator it = index.find (objects[i].first);
+    if (it != index.end())
+      toVersion (it->second, version);
+    versions->push_back (version);
+  }
+  unlock();
+  return ok && ! conflict;
+}
+
+
+bool
+CatalogSegments::
+remove (const std::string& id)
+{
+  if (! lock())
+    return false;
+  bool ok = refresh (true);
+  if (ok && index.count (id))
+    ok = append (record ('D', id, ""));
+  unlock();
+  return ok;
+}
+
+
+bool
+CatalogSegments::
+list (const std::string& from, const std::string& to,
+      XmlObjectCatalog::key_set_t& kset)
+{
+  if (! refresh (false))
+    return false;
+  index_t::iterator it = index.lower_bound (from);
+  index_t::iterator end = to.length() ? index.lower_bound (to) : index.end();
+  for ( ; it != end; ++it)
+  {
+    kset.insert (kset.end(), it->first);
+  }
+  return true;
+}
+
+
+bool
+CatalogSegments::
+exists (const std::string& id, bool& found)
+{
+  found = false;
+  if (! refresh (false))
+    return false;
+  found = (index.count (id) > 0);
+  return true;
+}
+
+
+bool
+CatalogSegments::
+rename (const XmlObjectCatalog::key_set_t& names, CatalogBackend* dest)
+{
+  if (dest->storage() == XmlObjectCatalog::STORAGE_SEGMENTS &&
+      static_cast<CatalogSegments*>(dest)->dirfd == dirfd)
+  {
+    return true;
+  }
+  return CatalogBackend::rename (names, dest);
+}
+
+
+bool
+CatalogSegments::
+needsCompaction ()
+{
+  return total > COMPACT_MIN && live * 2 < total;
+}
+
+
+bool
+CatalogSegments::
+refresh (bool writer)
+{
+  struct stat sbuf;
+  if (fstatat (dirfd, SEGMENT_FILE, &sbuf, 0) < 0)
+  {
+    fail (system_error("reading", path + "/" + SEGMENT_FILE));
+    return false;
+  }
+  if (sbuf.st_ino == manifest && ! segments.empty())
+    return scan (segments.back(), writer);
+
+  // When the new manifest just adds segments, the index so far is still
+  // good, and only the old active segment may have grown before it was
+  // sealed.  Otherwise a compaction has moved things, so start over.  A
+  // compaction unlinks the segments it replaced as soon as its manifest
+  // is in place, so a segment missing from a manifest which has since
+  // been replaced just means reading the new one.
+  std::vector<unsigned int> numbers;
+  std::vector<unsigned int> missing;
+  unsigned int gone = 0;
+  ino_t ino;
+  unsigned int first;
+  while (true)
+  {
+    numbers.clear();
+    if (! readManifest (numbers, ino))
+      return false;
+    if (! missing.empty() && numbers == missing)
+    {
+      errno = ENOENT;
+      fail (system_error("opening segment", path + "/" + segmentName (gone)));
+      return false;
+    }
+    bool prefix = (numbers.size() >= segments.size());
+    for (unsigned int i = 0; prefix && i < segments.size(); ++i)
+    {
+      prefix = (numbers[i] == segments[i].number);
+    }
+    if (! prefix)
+      reset();
+    first = segments.size();
+    if (first > 0)
+      --first;
+    unsigned int i = segments.size();
+    while (i < numbers.size() && openSegment (numbers[i], false))
+      ++i;
+    if (i == numbers.size())
+      break;
+    if (errno != ENOENT)
+      return false;
+    missing = numbers;
+    gone = numbers[i];
+    reset();
+  }
+  manifest = ino;
+  for (unsigned int i = first; i < segments.size(); ++i)
+  {
+    if (! scan (segments[i], writer))
+      return false;
+  }
+  return true;
+}
+
+
+bool
+CatalogSegments::
+readManifest (std::vector<unsigned int>& numbers, ino_t& ino)
+{
+  int fd = openat (dirfd, SEGMENT_FILE, O_RDONLY | O_CLOEXEC);
+  struct stat sbuf;
+  bool ok = (fd >= 0 && fstat (fd, &sbuf) == 0);
+  string text;
+  if (ok)
+  {
+    ino = sbuf.st_ino;
+    text.resize (sbuf.st_size);
+    ok = readAt (fd, 0, text);
+  }
+  if (fd >= 0)
+    close (fd);
+  if (! ok)
+  {
+    fail (system_error("reading", path + "/" + SEGMENT_FILE));
+    return false;
+  }
+  std::istringstream in (text);
+  string line;
+  while (std::getline (in, line))
+  {
+    unsigned int number;
+    if (sscanf (line.c_str(), ".seg-%x", &number) != 1)
+    {
+      fail ("bad segment name in " + path + "/" + SEGMENT_FILE + ": " + line);
+      return false;
+    }
+    numbers.push_back (number);
+  }
+  if (numbers.empty())
+  {
+    fail ("no segments listed in " + path + "/" + SEGMENT_FILE);
+    return false;
+  }
+  return true;
+}
+
+
+bool
+CatalogSegments::
+writeManifest (const std::vector<unsigned int>& numbers)
+{
+  // The lock must be held.
+  std::ostringstream text;
+  for (unsigned int i = 0; i < numbers.size(); ++i)
+  {
+    text << segmentName (numbers[i]) << "\n";
+  }
+  if (! writeFile (SEGMENT_FILE, text.str()))
+    return false;
+  struct stat sbuf;
+  if (fstatat (dirfd, SEGMENT_FILE, &sbuf, 0) == 0)
+    manifest = sbuf.st_ino;
+  return true;
+}
+
+
+bool
+CatalogSegments::
+openSegment (unsigned int number, bool create)
+{
+  string name = segmentName (number);
+  int flags = O_RDWR | O_CLOEXEC;
+  if (create)
+    flags |= O_CREAT | O_TRUNC;
+  int fd = openat (dirfd, name.c_str(), flags, 0666);
+  if (fd < 0 && errno == EACCES && ! create)
+    fd = openat (dirfd, name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    // A missing segment is left to the caller, which may find it has
+    // just been compacted away.
+    if (create || errno != ENOENT)
+      fail (system_error("opening segment", path + "/" + name));
+    return false;
+  }
+  Segment seg;
+  seg.number = number;
+  seg.fd = fd;
+  seg.scanned = 0;
+  segments.push_back (seg);
+  return create || loadIndex (segments.back());
+}
+
+
+bool
+CatalogSegments::
+loadIndex (Segment& seg)
+{
+  // A compacted segment comes with the index of its records, so it does
+  // not have to be scanned.
+  string name = segmentName (seg.number) + ".idx";
+  int fd = openat (dirfd, name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT)
+    return true;
+  struct stat sbuf;
+  bool ok = (fd >= 0 && fstat (fd, &sbuf) == 0);
+  string text;
+  if (ok)
+  {
+    text.resize (sbuf.st_size);
+    ok = readAt (fd, 0, text);
+  }
+  if (fd >= 0)
+    close (fd);
+  if (! ok)
+  {
+    fail (system_error("reading", path + "/" + name));
+    return false;
+  }
+
+  std::istringstream in (text);
+  string line;
+  long long covered = -1;
+  if (std::getline (in, line))
+    covered = atoll (line.c_str());
+  while (ok && std::getline (in, line))
+  {
+    long long offset;
+    unsigned long length;
+    unsigned long long sum;
+    int n = 0;
+    ok = (sscanf (line.c_str(), "%lld %lu %llx %n",
+		  &offset, &length, &sum, &n) == 3 && n > 0);
+    if (ok)
+    {
+      string key = line.substr (n);
+      Entry entry;
+      entry.segment = seg.number;
+      entry.offset = offset;
+      entry.length = length;
+      entry.checksum = sum;
+      entry.size = headerSize ('P', key.length(), length, sum) +
+	key.length() + length;
+      update (key, 'P', entry);
+    }
+  }
+  if (! ok || covered < 0)
+  {
+    fail ("bad index file " + path + "/" + name);
+    return false;
+  }
+  seg.scanned = covered;
+  total += covered;
+  return true;
+}
+
+
+bool
+CatalogSegments::
+scan (Segment& seg, bool writer)
+{
+  struct stat sbuf;
+  if (fstat (seg.fd, &sbuf) < 0)
+  {
+    fail (system_error("reading", path + "/" + segmentName (seg.number)));
+    return false;
+  }
+  if (sbuf.st_size <= seg.scanned)
+    return true;
+  string buf (sbuf.st_size - seg.scanned, '\0');
+  if (! readAt (seg.fd, seg.scanned, buf))
+  {
+    fail (system_error("reading", path + "/" + segmentName (seg.number)));
+    return false;
+  }
+  string::size_type p = 0;
+  string::size_type end;
+  while (p < buf.size() && parse (buf, p, seg.scanned, seg.number, end, false))
+  {
+    p = end;
+  }
+  seg.scanned += p;
+  total += p;
+
+  // A record which is still incomplete while we hold the lock belongs to
+  // a writer which died part way through it.
+  if (p < buf.size() && writer)
+  {
+    ELOG << "discarding " << (buf.size() - p)
+	 << " bytes of incomplete record at the end of "
+	 << path << "/" << segmentName (seg.number);
+    if (ftruncate (seg.fd, seg.scanned) < 0)
+    {
+      fail (system_error("truncating",
+			 path + "/" + segmentName (seg.number)));
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool
+CatalogSegments::
+parse (const std::string& buf, std::string::size_type p, off_t base,
+       unsigned int number, std::string::size_type& end, bool nested)
+{
+  // Each record is a header line followed by the key and the object
+  // text: "@<op> <keylength> <textlength> <checksum>\n".  A batch record
+  // has the count of records and the length of its body instead.
+  string::size_type nl = buf.find ('\n', p);
+  if (nl == string::npos || nl - p > 80)
+    return false;
+  char op;
+  unsigned long a, b;
+  unsigned long long sum;
+  if (sscanf (buf.substr (p, nl - p).c_str(), "@%c %lu %lu %llx",
+	      &op, &a, &b, &sum) != 4)
+    return false;
+  string::size_type body = nl + 1;
+  if (op == 'B' && ! nested)
+  {
+    if (buf.size() - body < b || textChecksum (buf.substr (body, b)) != sum)
+      return false;
+    string::size_type q = body;
+    for (unsigned long i = 0; i < a; ++i)
+    {
+      if (! parse (buf, q, base, number, q, true))
+	return false;
+    }
+    end = body + b;
+    return true;
+  }
+  if ((op != 'P' && op != 'D') || buf.size() - body < a + b)
+    return false;
+  if (textChecksum (buf.substr (body, a + b)) != sum)
+    return false;
+  Entry entry;
+  entry.segment = number;
+  entry.offset = base + body + a;
+  entry.length = b;
+  entry.checksum = sum;
+  entry.size = body - p + a + b;
+  update (buf.substr (body, a), op, entry);
+  end = body + a + b;
+  return true;
+}
+
+
+void
+CatalogSegments::
+update (const std::string& key, char op, const Entry& entry)
+{
+  index_t::iterator it = index.find (key);
+  if (it != index.end())
+  {
+    live -= it->second.size;
+    if (op == 'D')
+      index.erase (it);
+  }
+  if (op == 'P')
+  {
+    index[key] = entry;
+    live += entry.size;
+  }
+}
+
+
+bool
+CatalogSegments::
+append (const std::string& records)
+{
+  // The lock is held and the index is up to date.
+  if (segments.back().scanned >= SEGMENT_SIZE && ! roll())
+    return false;
+  Segment& seg = segments.back();
+  off_t base = seg.scanned;
+  if (! writeAt (seg.fd, base, records))
+  {
+    fail (system_error("appending to", path + "/" + segmentName (seg.number)));
+    if (ftruncate (seg.fd, base) < 0)
+      ELOG << system_error("truncating", segmentName (seg.number));
+    return false;
+  }
+
+  XmlObjectCatalog::EnumDurability mode = XmlObjectCatalog::SYNC_FULL;
+  if (cp)
+    mode = cp->_durability;
+  if ((mode == XmlObjectCatalog::SYNC_DATA ||
+       mode == XmlObjectCatalog::SYNC_FULL) && fdatasync (seg.fd) < 0)
+  {
+    fail (system_error("fdatasync", path + "/" + segmentName (seg.number)));
+    return false;
+  }
+  if (mode == XmlObjectCatalog::SYNC_PERIODIC)
+    cp->markDirty();
+
+  string::size_type end;
+  parse (records, 0, base, seg.number, end, false);
+  seg.scanned = base + records.size();
+  total += records.size();
+  return true;
+}
+
+
+bool
+CatalogSegments::
+roll ()
+{
+  // Seal the active segment and start a new one.  The lock is held.  A
+  // compacted segment comes first but has the highest number so far.
+  std::vector<unsigned int> numbers;
+  unsigned int number = 0;
+  for (unsigned int i = 0; i < segments.size(); ++i)
+  {
+    numbers.push_back (segments[i].number);
+    number = std::max (number, segments[i].number + 1);
+  }
+  if (! openSegment (number, true))
+    return false;
+  numbers.push_back (number);
+  if (! writeManifest (numbers))
+  {
+    close (segments.back().fd);
+    segments.pop_back();
+    unlinkat (dirfd, segmentName (number).c_str(), 0);
+    return false;
+  }
+  return true;
+}
+
+
+bool
+CatalogSegments::
+compact ()
+{
+  // Only one compaction runs at a time, and if one is already running
+  // anywhere then there is nothing to do.
+  int cfd = openat (dirfd, COMPACT_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (cfd < 0)
+  {
+    fail (system_error("opening", path + "/" + COMPACT_LOCK));
+    return false;
+  }
+  if (flock (cfd, LOCK_EX | LOCK_NB) < 0)
+  {
+    close (cfd);
+    return true;
+  }
+
+  // Seal everything written so far behind a new active segment and note
+  // the live objects in the sealed segments.
+  std::vector<unsigned int> sealed;
+  std::vector<std::pair<string, Entry> > entries;
+  bool ok = lock();
+  if (ok)
+  {
+    ok = refresh (true) && (segments.back().scanned == 0 || roll());
+    for (unsigned int i = 0; ok && i+1 < segments.size(); ++i)
+    {
+      sealed.push_back (segments[i].number);
+    }
+    index_t::iterator it;
+    for (it = index.begin(); ok && it != index.end(); ++it)
+    {
+      if (it->second.segment != segments.back().number)
+	entries.push_back (*it);
+    }
+    unlock();
+  }
+  if (! ok || sealed.empty())
+  {
+    close (cfd);
+    return ok;
+  }
+
+  // Copy the live objects without holding up writers.  Anything written
+  // meanwhile goes to the active segment, which still comes after the
+  // compacted one, so newer records still win.
+  string tmpname = string(".seg-compact") + XmlObjectCatalogP::uniqueSuffix() +
+    "-temp";
+  ok = writeCompacted (tmpname, entries);
+
+  // Then replace the sealed segments with the compacted one.
+  if (ok && (ok = lock()))
+  {
+    ok = refresh (true);
+    std::vector<unsigned int> numbers (1, 0);
+    for (unsigned int i = 0; i < segments.size(); ++i)
+    {
+      numbers[0] = std::max (numbers[0], segments[i].number + 1);
+      if (std::find (sealed.begin(), sealed.end(), segments[i].number) ==
+	  sealed.end())
+	numbers.push_back (segments[i].number);
+    }
+    string name = segmentName (numbers[0]);
+    ok = ok &&
+      renameat (dirfd, (tmpname + ".idx").c_str(),
+		dirfd, (name + ".idx").c_str()) == 0 &&
+      renameat (dirfd, tmpname.c_str(), dirfd, name.c_str()) == 0;
+    if (! ok)
+      fail (system_error("compacting", path + "/" + name));
+    ok = ok && writeManifest (numbers);
+    if (ok)
+    {
+      for (unsigned int i = 0; i < sealed.size(); ++i)
+      {
+	unlinkat (dirfd, segmentName (sealed[i]).c_str(), 0);
+	unlinkat (dirfd, (segmentName (sealed[i]) + ".idx").c_str(), 0);
+      }
+      // Everything moved, so reload on the next refresh.
+      reset();
+    }
+    unlock();
+  }
+  if (! ok)
+  {
+    unlinkat (dirfd, tmpname.c_str(), 0);
+    unlinkat (dirfd, (tmpname + ".idx").c_str(), 0);
+  }
+  close (cfd);
+  return ok;
+}
+
+
+bool
+CatalogSegments::
+writeCompacted (const std::string& tmpname,
+		const std::vector<std::pair<string, Entry> >& entries)
+{
+  int fd = openat (dirfd, tmpname.c_str(),
+		   O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0)
+  {
+    fail (system_error("compacting into", path + "/" + tmpname));
+    return false;
+  }
+  std::ostringstream idx;
+  string buf;
+  off_t at = 0;
+  bool ok = true;
+  for (unsigned int i = 0; ok && i < entries.size(); ++i)
+  {
+    const string& key = entries[i].first;
+    const Entry& entry = entries[i].second;
+    string data (entry.length, '\0');
+    ok = readAt (segmentFd (entry.segment), entry.offset, data);
+    if (! ok)
+      break;
+    string rec = record ('P', key, data);
+    idx << (at + buf.size() + rec.size() - data.size()) << " "
+	<< data.size() << " " << std::hex << entry.checksum << std::dec
+	<< " " << key << "\n";
+    buf += rec;
+    if (buf.size() >= (1 << 20))
+    {
+      ok = writeAt (fd, at, buf);
+      at += buf.size();
+      buf.clear();
+    }
+  }
+  ok = ok && writeAt (fd, at, buf) && fsync (fd) == 0;
+  at += buf.size();
+  if (! ok)
+    fail (system_error("compacting into", path + "/" + tmpname));
+  close (fd);
+  if (ok)
+  {
+    std::ostringstream head;
+    head << at << "\n";
+    ok = writeFile (tmpname + ".idx", head.str() + idx.str());
+  }
+  return ok;
+}
+
+
+int
+CatalogSegments::
+segmentFd (unsigned int number)
+{
+  for (unsigned int i = 0; i < segments.size(); ++i)
+  {
+    if (segments[i].number == number)
+      return segments[i].fd;
+  }
+  return -1;
+}
+
+
+bool
+CatalogSegments::
+writeAt (int fd, off_t offset, const std::string& text)
+{
+  size_t done = 0;
+  while (done < text.length())
+  {
+    ssize_t n = pwrite (fd, text.data() + done, text.length() - done,
+			offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+
+bool
+CatalogSegments::
+writeFile (const std::string& filename, const std::string& text)
+{
+  // Replace the file atomically and durably.
+  string tmpname = filename + XmlObjectCatalogP::uniqueSuffix() + "-temp";
+  int fd = openat (dirfd, tmpname.c_str(),
+		   O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  bool ok = (fd >= 0 && writeAt (fd, 0, text) && fsync (fd) == 0);
+  if (fd >= 0)
+    close (fd);
+  ok = ok && renameat (dirfd, tmpname.c_str(), dirfd, filename.c_str()) == 0;
+  ok = ok && fsync (dirfd) == 0;
+  if (! ok)
+  {
+    fail (system_error("writing", path + "/" + filename));
+    unlinkat (dirfd, tmpname.c_str(), 0);
+  }
+  return ok;
+}
+
+
+string
+CatalogSegments::
+segmentName (unsigned int number)
+{
+  char name[32];
+  snprintf (name, sizeof(name), ".seg-%08x", number);
+  return name;
+}
+
+
+size_t
+CatalogSegments::
+headerSize (char op, unsigned long a, unsigned long b, unsigned long long sum)
+{
+  char head[80];
+  return snprintf (head, sizeof(head), "@%c %lu %lu %llx\n", op, a, b, sum);
+}
+
+
+string
+CatalogSegments::
+record (char op, const std::string& key, const std::string& data)
+{
+  char head[80];
+  snprintf (head, sizeof(head), "@%c %lu %lu %llx\n", op,
+	    (unsigned long)key.length(), (unsigned long)data.length(),
+	    textChecksum (key + data));
+  return head + key + data;
+}
+
+
+void
+CatalogSegments::
+toVersion (const Entry& entry, XmlObjectCatalog::ObjectVersion& v)
+{
+  // The location of the record identifies the version, as the inode does
+  // for an object file.
+  v.device = 0;
+  v.inode = entry.segment;
+  v.mtime_ns = entry.offset;
+  v.size = entry.length;
+  v.checksum = entry.checksum;
+}
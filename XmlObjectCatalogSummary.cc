@@ -0,0 +1,510 @@
+//
+// $Id$
+//
+
+#include "XmlObjectCatalogP.h"
+
+#include "logx/system_error.h"
+
+using namespace domx;
+using std::string;
+
+using logx::system_error;
+
+
+bool
+XmlObjectCatalogP::
+openSummary ()
+{
+  // A catalog keeps a summary if the summary log exists.
+  _summary_fd = openat (_dirfd, SUMMARY_LOG, O_RDWR | O_APPEND | O_CLOEXEC);
+  if (_summary_fd < 0 && errno != ENOENT)
+  {
+    failures() << system_error("opening summary log", fullPath(SUMMARY_LOG));
+    return false;
+  }
+  return true;
+}
+
+
+bool
+XmlObjectCatalogP::
+lockSummary ()
+{
+  // A fold replaces the log, so once the lock is held check that it is
+  // still the current log, and otherwise open the new one and try again.
+  // If the log has been removed altogether the catalog no longer keeps a
+  // summary.  Returns false with the descriptor closed in that case, and
+  // false with an error queued if the lock fails.
+  pthread_mutex_lock (&_summary_lock);
+  while (_summary_fd >= 0)
+  {
+    if (flock (_summary_fd, LOCK_EX) < 0)
+    {
+      failures() << system_error("locking summary log",
+				 fullPath(SUMMARY_LOG));
+      break;
+    }
+    struct stat locked, current;
+    if (fstat (_summary_fd, &locked) == 0 &&
+	fstatat (_dirfd, SUMMARY_LOG, &current, 0) == 0 &&
+	locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+    {
+      return true;
+    }
+    close (_summary_fd);
+    _summary_fd = -1;
+    if (! openSummary())
+      break;
+  }
+  pthread_mutex_unlock (&_summary_lock);
+  return false;
+}
+
+
+void
+XmlObjectCatalogP::
+unlockSummary ()
+{
+  flock (_summary_fd, LOCK_UN);
+  pthread_mutex_unlock (&_summary_lock);
+}
+
+
+bool
+XmlObjectCatalogP::
+summarize (char op, const std::vector<std::string>& keys)
+{
+  CatalogBackend::text_list_t changes;
+  for (unsigned int i = 0; i < keys.size(); ++i)
+  {
+    changes.push_back (std::make_pair (keys[i], string()));
+  }
+  return summarize (op, changes,
+		    std::vector<XmlObjectCatalog::ObjectVersion>());
+}
+
+
+bool
+XmlObjectCatalogP::
+summarize (char op, const CatalogBackend::text_list_t& changes,
+	   const std::vector<XmlObjectCatalog::ObjectVersion>& versions)
+{
+  // Append a record for each change once it has been made: 'I' for an
+  // insert with its text and the version it was stored as, 'K' for a key
+  // whose object is looked up again when the log is folded, and 'S' for
+  // keys which may have gone, when the summary is checked against the
+  // key list.  Records of changes to the same key may land out of order,
+  // which the fold sorts out by the current version of the object.
+  if (_summary_fd < 0 || changes.empty())
+    return true;
+  string data;
+  for (unsigned int i = 0; i < changes.size(); ++i)
+  {
+    XmlObjectCatalog::ObjectVersion v;
+    if (i < versions.size())
+      v = versions[i];
+    char head[160];
+    snprintf (head, sizeof(head), "@%c %lu %lu %llx %llx %llx %llx %llx\n",
+	      op, (unsigned long)changes[i].first.length(),
+	      (unsigned long)changes[i].second.length(), v.device, v.inode,
+	      (unsigned long long)v.mtime_ns, (unsigned long long)v.size,
+	      v.checksum);
+    data += head + changes[i].first + changes[i].second;
+  }
+  if (! lockSummary())
+    return _summary_fd < 0;
+  bool ok = (write (_summary_fd, data.data(), data.length()) ==
+	     (ssize_t)data.length());
+  if (! ok)
+    failures() << system_error("appending to summary log",
+			       fullPath(SUMMARY_LOG));
+
+  // Fold the log into the summary in the background once that is cheap
+  // compared to the summary, or the summary has gone stale.
+  struct stat log, summary;
+  bool fold = (ok && fstat (_summary_fd, &log) == 0 &&
+	       (fstatat (_dirfd, SUMMARY_FILE, &summary, 0) < 0 ||
+		log.st_size * 4 >= summary.st_size ||
+		time (0) - summary.st_mtime >= SUMMARY_PERIOD));
+  unlockSummary();
+  if (fold)
+    startFolder();
+  return ok;
+}
+
+
+bool
+XmlObjectCatalogP::
+foldSummary (bool rebuild, CatalogBackend* backend, bool wait)
+{
+  // Apply the log to the published summary and publish the result.
+  // Folds are serialized by a lock of their own, so each one starts from
+  // the last, and a fold which would have to wait for another is skipped
+  // unless @p wait.  The log is only held exclusively for two moments: to
+  // mark the end of the records this fold takes, and to publish the new
+  // summary together with a new log of the records appended since.  A
+  // missing or damaged summary is rebuilt from every object in the
+  // catalog, which already includes the changes in the marked records.
+  int lfd = openat (_dirfd, SUMMARY_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (lfd < 0)
+  {
+    failures() << system_error("opening", fullPath(SUMMARY_LOCK));
+    return false;
+  }
+  int result;
+  while ((result = flock (lfd, wait ? LOCK_EX : LOCK_EX | LOCK_NB)) < 0 &&
+	 errno == EINTR)
+    ;
+  if (result < 0)
+  {
+    bool busy = (errno == EWOULDBLOCK);
+    if (! busy)
+      failures() << system_error("locking", fullPath(SUMMARY_LOCK));
+    close (lfd);
+    return busy;
+  }
+  if (! lockSummary())
+  {
+    close (lfd);
+    return _summary_fd < 0;
+  }
+  struct stat marked;
+  int fd = dup (_summary_fd);
+  bool ok = (fd >= 0 && fstat (fd, &marked) == 0);
+  unlockSummary();
+  string log;
+  if (ok)
+  {
+    log.resize (marked.st_size);
+    ok = readAt (fd, 0, log);
+  }
+  if (! ok)
+    failures() << system_error("reading summary log", fullPath(SUMMARY_LOG));
+
+  summary_t objects;
+  unsigned long long changes = 0;
+  if (ok && ! rebuild && ! readSummary (objects, changes))
+    rebuild = true;
+  XmlObjectCatalog::key_set_t keys;
+  if (ok && rebuild)
+  {
+    objects.clear();
+    ok = backend->list ("", "", keys);
+    XmlObjectCatalog::key_set_t::const_iterator it;
+    for (it = keys.begin(); ok && it != keys.end(); ++it)
+    {
+      string text;
+      if (backend->get (*it, text, 0))
+	objects[*it].swap (text);
+      else
+	ok = (errno == ENOENT);
+    }
+  }
+
+  // Apply the log, up to any record torn by a crash.  Each key changed
+  // by an insert or named by a key record is settled afterwards, with the
+  // text of whichever insert record has the version the object has now,
+  // or else by reading the object again.
+  typedef std::pair<XmlObjectCatalog::ObjectVersion, string> stored_t;
+  std::map<string, std::vector<stored_t> > changed;
+  string::size_type pos = 0;
+  while (ok && pos < log.length())
+  {
+    char op;
+    unsigned long klen, tlen;
+    unsigned long long mtime, size;
+    XmlObjectCatalog::ObjectVersion v;
+    int n = 0;
+    string::size_type eol = log.find ('\n', pos);
+    if (eol == string::npos ||
+	sscanf (log.c_str() + pos, "@%c %lu %lu %llx %llx %llx %llx %llx\n%n",
+		&op, &klen, &tlen, &v.device, &v.inode, &mtime, &size,
+		&v.checksum, &n) != 8 || pos + n + klen + tlen > log.length())
+    {
+      break;
+    }
+    v.mtime_ns = mtime;
+    v.size = size;
+    string key = log.substr (pos + n, klen);
+    pos += n + klen + tlen;
+    ++changes;
+    if (rebuild)
+      continue;
+    if (op == 'I')
+    {
+      changed[key].push_back (stored_t (v, log.substr (pos - tlen, tlen)));
+    }
+    else if (op == 'K')
+    {
+      changed[key];
+    }
+    else if (op == 'S')
+    {
+      if (keys.empty())
+	ok = backend->list ("", "", keys);
+      summary_t::iterator it = objects.begin();
+      while (ok && it != objects.end())
+      {
+	if (keys.count (it->first))
+	  ++it;
+	else
+	  objects.erase (it++);
+      }
+    }
+  }
+
+  std::map<string, std::vector<stored_t> >::iterator ct;
+  for (ct = changed.begin(); ok && ct != changed.end(); ++ct)
+  {
+    const string& key = ct->first;
+    XmlObjectCatalog::ObjectVersion current;
+    if (! backend->stat (key, current))
+    {
+      if (errno == ENOENT)
+	objects.erase (key);
+      else
+	ok = false;
+      continue;
+    }
+    unsigned int i = 0;
+    while (i < ct->second.size() && ct->second[i].first != current)
+      ++i;
+    string text;
+    if (i < ct->second.size())
+      objects[key].swap (ct->second[i].second);
+    else if (backend->get (key, text, 0))
+      objects[key].swap (text);
+    else if (errno == ENOENT)
+      objects.erase (key);
+    else
+      ok = false;
+  }
+
+  CatalogTempFile tmp;
+  tmp.dirfd = _dirfd;
+  ok = ok && writeSummary (objects, changes, tmp);
+
+  // Publish the summary, then a log of just the records appended since
+  // the mark, unless the summary has been stopped meanwhile.  A crash in
+  // between leaves the whole old log, whose records are settled again by
+  // the next fold.  The new log is not synced, any more than appends are.
+  CatalogTempFile tail;
+  tail.dirfd = _dirfd;
+  bool dropped = false;
+  if (ok && lockSummary())
+  {
+    struct stat locked;
+    dropped = (fstat (_summary_fd, &locked) < 0 ||
+	       locked.st_dev != marked.st_dev ||
+	       locked.st_ino != marked.st_ino);
+    if (! dropped)
+    {
+      tail.data.resize (locked.st_size - marked.st_size);
+      ok = readAt (fd, marked.st_size, tail.data);
+      if (! ok)
+	failures() << system_error("reading summary log",
+				   fullPath(SUMMARY_LOG));
+      ok = ok && openNamedTemp (SUMMARY_LOG, tail) && writeData (tail) &&
+	publishTemp (tmp, SUMMARY_FILE) && publishTemp (tail, SUMMARY_LOG);
+    }
+    unlockSummary();
+  }
+  else if (ok)
+  {
+    dropped = ok = (_summary_fd < 0);
+  }
+  if (fd >= 0)
+    close (fd);
+  close (lfd);
+  discardTemp (tmp);
+  discardTemp (tail);
+  return ok && (dropped || syncDirectory (_dirfd));
+}
+
+
+bool
+XmlObjectCatalogP::
+readSummary (summary_t& objects, unsigned long long& changes)
+{
+  // Returns false without an error if the summary is missing or not as
+  // writeSummary() left it.
+  string text;
+  if (! readFile (_dirfd, SUMMARY_FILE, text, 0))
+    return false;
+  const string object = "<object key='";
+  string::size_type pos = text.find ("\n<summary ");
+  string::size_type end = text.rfind ("</summary>\n");
+  if (pos == string::npos || end == string::npos)
+    return false;
+  pos = text.find ("changes='", pos);
+  if (pos == string::npos)
+    return false;
+  changes = strtoull (text.c_str() + pos + 9, 0, 10);
+  pos = text.find ('\n', pos) + 1;
+  while (pos < end)
+  {
+    string::size_type quote = text.find ('\'', pos + object.length());
+    unsigned long length;
+    int n = 0;
+    if (text.compare (pos, object.length(), object) != 0 ||
+	quote == string::npos ||
+	sscanf (text.c_str() + quote, "' length='%lu'>\n%n", &length,
+		&n) != 1 || n == 0 || quote + n + length > end)
+    {
+      return false;
+    }
+    string key = unescapeText (text.substr (pos + object.length(),
+					     quote - pos - object.length()));
+    objects[key] = text.substr (quote + n, length);
+    pos = quote + n + length;
+    if (text.compare (pos, 10, "</object>\n") != 0)
+      return false;
+    pos += 10;
+  }
+  return pos == end;
+}
+
+
+bool
+XmlObjectCatalogP::
+writeSummary (const summary_t& objects, unsigned long long changes,
+	      CatalogTempFile& tmp)
+{
+  // Write the summary to a temporary file for the fold to publish.  It
+  // must be on disk before the log records it includes are dropped.
+  std::ostringstream out;
+  out << "<?xml version='1.0'?>\n"
+      << "<summary catalog='" << attributeText (_name) << "' changes='"
+      << changes << "'>\n";
+  summary_t::const_iterator it;
+  for (it = objects.begin(); it != objects.end(); ++it)
+  {
+    out << "<object key='" << attributeText (it->first) << "' length='"
+	<< it->second.length() << "'>\n" << it->second << "</object>\n";
+  }
+  out << "</summary>\n";
+  tmp.data = out.str();
+  return openNamedTemp (SUMMARY_FILE, tmp) && writeData (tmp) &&
+    syncTemp (tmp, true);
+}
+
+
+bool
+XmlObjectCatalog::
+setSummary (bool enable)
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  if (storage() == STORAGE_MEMORY)
+  {
+    _mp->failures() << "setSummary: memory catalog " << name()
+		    << " cannot keep a summary";
+    return false;
+  }
+  if (! enable)
+  {
+    _mp->stopFolder();
+    if (_mp->_summary_fd >= 0)
+      close (_mp->_summary_fd);
+    _mp->_summary_fd = -1;
+    return _mp->writeLayout (SUMMARY_LOG, "") &&
+      _mp->writeLayout (SUMMARY_FILE, "");
+  }
+  if (_mp->_summary_fd >= 0)
+    return true;
+
+  // Another process may have just started the summary, so only create
+  // the log if it is still missing, then build the summary with a fold
+  // which waits for any other.
+  CatalogTempFile tmp;
+  tmp.dirfd = _mp->_dirfd;
+  bool existed = false;
+  if (! _mp->openNamedTemp (SUMMARY_LOG, tmp) ||
+      ! _mp->syncTemp (tmp, false) ||
+      (! _mp->publishNew (tmp, SUMMARY_LOG, existed) && ! existed))
+  {
+    return false;
+  }
+  if (! _mp->openSummary() || _mp->_summary_fd < 0)
+    return false;
+  return _mp->foldSummary (! existed, _mp->_backend, true) &&
+    _mp->_summary_fd >= 0;
+}
+
+
+bool
+XmlObjectCatalog::
+updateSummary ()
+{
+  if (! isOpen())
+    return false;
+  _mp->flushInserts();
+  bool ok = (_mp->_summary_fd >= 0 &&
+	     _mp->foldSummary (false, _mp->_backend, true));
+  if (_mp->_summary_fd < 0)
+  {
+    _mp->failures() << "catalog " << name() << " does not keep a summary";
+    return false;
+  }
+  return ok;
+}
+
+
+std::string
+XmlObjectCatalog::
+summaryPath ()
+{
+  return _mp->fullPath (SUMMARY_FILE);
+}
+
+
+void
+XmlObjectCatalogP::
+startFolder ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  if (_folding && _folded)
+  {
+    pthread_join (_folder, 0);
+    _folding = false;
+  }
+  if (! _folding)
+  {
+    _folded = false;
+    _folding = (pthread_create (&_folder, 0, folderMain, this) == 0);
+  }
+  pthread_mutex_unlock (&_sync_lock);
+}
+
+
+void
+XmlObjectCatalogP::
+stopFolder ()
+{
+  pthread_mutex_lock (&_sync_lock);
+  bool running = _folding;
+  _folding = false;
+  pthread_mutex_unlock (&_sync_lock);
+  if (running)
+  {
+    pthread_join (_folder, 0);
+  }
+}
+
+
+void*
+XmlObjectCatalogP::
+folderMain (void* arg)
+{
+  XmlObjectCatalogP* cp = static_cast<XmlObjectCatalogP*>(arg);
+  CatalogBackend* backend = cp->readerBackend();
+  if (backend)
+    cp->foldSummary (false, backend, false);
+  delete backend;
+  pthread_mutex_lock (&cp->_sync_lock);
+  cp->_folded = true;
+  pthread_mutex_unlock (&cp->_sync_lock);
+  return 0;
+}
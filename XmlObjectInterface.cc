@@ -2,6 +2,7 @@
 //
 
 #include "domx/XmlObjectNode.h"
+#include "XmlObjectReaderP.h"
 
 #include "logx/Logging.h"
 #include "logx/system_error.h"
@@ -13,6 +14,9 @@ LOGGING("XmlObject");
 #include <xercesc/framework/LocalFileInputSource.hpp>
 
 #include <fstream>
+#include <vector>
+#include <string.h>
+#include <pthread.h>
 
 using namespace xercesc;
 using namespace domx;
@@ -38,20 +42,44 @@ namespace
   }
 
 
+  // Each thread parses with its own parser, since a parser can only
+  // parse one document at a time.  The parser goes when the thread ends.
+  pthread_key_t PARSER_KEY;
+  pthread_once_t PARSER_ONCE = PTHREAD_ONCE_INIT;
+
+  void
+  deleteParser (void* arg)
+  {
+    XercesDOMParser* parser = (XercesDOMParser*)arg;
+    ErrorHandler* handler = parser->getErrorHandler();
+    delete parser;
+    delete handler;
+  }
+
+  void
+  createParserKey ()
+  {
+    pthread_key_create (&PARSER_KEY, deleteParser);
+  }
+
   DOMDocument*
   parse (const InputSource& source)
   {
     domx::xmlInitialize();
-    static XercesDOMParser *parser = 0;
-    if (!parser && !(parser = domx::createDefaultParser()))
+    pthread_once (&PARSER_ONCE, createParserKey);
+    XercesDOMParser *parser = (XercesDOMParser*)pthread_getspecific (PARSER_KEY);
+    if (!parser)
     {
-      return 0;
+      if (!(parser = domx::createDefaultParser()))
+	return 0;
+      pthread_setspecific (PARSER_KEY, parser);
     }
 
     try
     {
+      // The document belongs to the caller, so it outlives the parser.
       parser->parse (source);
-      DOMDocument* doc = parser->getDocument ();
+      DOMDocument* doc = parser->adoptDocument ();
       return doc;
     }
     catch (const XMLException& e)
@@ -70,6 +98,137 @@ namespace
     }
     return 0;
   }
+
+
+  // The flat form written by toFlat() starts with this tag and the size
+  // of XMLCh, followed by one record per node in document order.  An
+  // element record holds the name and attributes, and is followed by the
+  // records of its children and then an end record.  Counts are native
+  // unsigned ints and strings are raw XMLCh, so nothing is transcoded
+  // when the document is rebuilt.
+  const char FLAT_TAG[] = "domxflat";
+
+  void
+  putCount (std::string& out, unsigned int n)
+  {
+    out.append ((const char*)&n, sizeof(n));
+  }
+
+  void
+  putString (std::string& out, const XMLCh* s)
+  {
+    unsigned int n = s ? XMLString::stringLen (s) : 0;
+    putCount (out, n);
+    out.append ((const char*)s, n * sizeof(XMLCh));
+  }
+
+  bool
+  flatten (DOMNode* node, std::string& out)
+  {
+    switch (node->getNodeType())
+    {
+    case DOMNode::ELEMENT_NODE:
+      {
+	out += 'E';
+	putString (out, node->getNodeName());
+	DOMNamedNodeMap* attrs = node->getAttributes();
+	unsigned int nattrs = attrs ? attrs->getLength() : 0;
+	putCount (out, nattrs);
+	for (unsigned int i = 0; i < nattrs; ++i)
+	{
+	  putString (out, attrs->item(i)->getNodeName());
+	  putString (out, attrs->item(i)->getNodeValue());
+	}
+	DOMNode* child = node->getFirstChild();
+	for ( ; child; child = child->getNextSibling())
+	{
+	  if (! flatten (child, out))
+	    return false;
+	}
+	out += 'e';
+	return true;
+      }
+    case DOMNode::TEXT_NODE:
+      out += 'T';
+      putString (out, node->getNodeValue());
+      return true;
+    case DOMNode::CDATA_SECTION_NODE:
+      out += 'C';
+      putString (out, node->getNodeValue());
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  struct FlatReader
+  {
+    const char* p;
+    const char* end;
+
+    bool
+    getCount (unsigned int& n)
+    {
+      if (end - p < (long)sizeof(n))
+	return false;
+      memcpy (&n, p, sizeof(n));
+      p += sizeof(n);
+      return true;
+    }
+
+    // Strings come back null-terminated for the DOM calls.
+    bool
+    getString (std::vector<XMLCh>& s)
+    {
+      unsigned int n;
+      if (! getCount (n) || (unsigned long)(end - p) / sizeof(XMLCh) < n)
+	return false;
+      s.resize (n + 1);
+      memcpy (&s[0], p, n * sizeof(XMLCh));
+      s[n] = 0;
+      p += n * sizeof(XMLCh);
+      return true;
+    }
+  };
+
+  // Rebuild the children of @p parent, up to its end record, or up to
+  // the end of the data for the document itself.
+  bool
+  unflatten (DOMDocument* doc, DOMNode* parent, FlatReader& in)
+  {
+    std::vector<XMLCh> name;
+    std::vector<XMLCh> value;
+    while (in.p < in.end)
+    {
+      char type = *in.p++;
+      if (type == 'e')
+	return parent != doc;
+      if (type == 'T' || type == 'C')
+      {
+	if (! in.getString (value))
+	  return false;
+	if (type == 'T')
+	  parent->appendChild (doc->createTextNode (&value[0]));
+	else
+	  parent->appendChild (doc->createCDATASection (&value[0]));
+	continue;
+      }
+      unsigned int nattrs;
+      if (type != 'E' || ! in.getString (name) || ! in.getCount (nattrs))
+	return false;
+      DOMElement* element = doc->createElement (&name[0]);
+      parent->appendChild (element);
+      for (unsigned int i = 0; i < nattrs; ++i)
+      {
+	if (! in.getString (name) || ! in.getString (value))
+	  return false;
+	element->setAttribute (&name[0], &value[0]);
+      }
+      if (! unflatten (doc, element, in))
+	return false;
+    }
+    return parent == doc;
+  }
 }
 
 
@@ -267,6 +426,35 @@ assume (const XmlObjectInterface& rhs)
 }
 
 
+bool
+XmlObjectInterface::
+copyDocument (const XmlObjectInterface& rhs)
+{
+  if (rhs._xo && (rhs._xo == this->_xo))
+  {
+    return true;
+  }
+  DOMElement* root = 0;
+  if (rhs._xo && rhs._xo->_doc)
+  {
+    root = rhs._xo->_doc->getDocumentElement();
+  }
+  if (! root)
+  {
+    return false;
+  }
+  // Import into a fresh document so nothing of the old one lingers.
+  if (!_xo) _xo = new XmlObject(this);
+  if (! _xo->createDocument())
+  {
+    return false;
+  }
+  _xo->_doc->appendChild (_xo->_doc->importNode (root, /*deep*/true));
+  updateInterfaces();
+  return true;
+}
+
+
 bool
 XmlObjectInterface::
 createDocument()
@@ -495,13 +683,22 @@ getInterface (const std::string& name)
 bool
 XmlObjectInterface::
 toXML (std::ostream& out)
+{
+  XmlWriter writer (out);
+  return toXML (writer) && writer.flush();
+}
+
+
+bool
+XmlObjectInterface::
+toXML (XmlWriter& out)
 {
   if (! createDocument())
   {
     return false;
   }
-  domToStream (out, _xo->_doc, _nodes[0]->_element, 0);
-  return true;
+  out.node (_nodes[0]->_element);
+  return ! out.error();
 }
 
 
@@ -509,10 +706,11 @@ std::string
 XmlObjectInterface::
 toString ()
 {
-  std::ostringstream out;
-  if (! toXML(out))
+  std::string text;
+  XmlWriter writer (text);
+  if (! toXML(writer))
     return "";
-  return out.str();
+  return text;
 }
 
 
@@ -542,6 +740,69 @@ fromXML (std::istream& in)
 }
 
 
+bool
+XmlObjectInterface::
+toFlat (std::string& out)
+{
+  if (! createDocument())
+  {
+    return false;
+  }
+  out.assign (FLAT_TAG, sizeof(FLAT_TAG) - 1);
+  out += char(sizeof(XMLCh));
+  DOMNode* child = _xo->_doc->getFirstChild();
+  for ( ; child; child = child->getNextSibling())
+  {
+    if (! flatten (child, out))
+      return false;
+  }
+  return true;
+}
+
+
+bool
+XmlObjectInterface::
+fromFlat (const std::string& in)
+{
+  std::string tag (FLAT_TAG, sizeof(FLAT_TAG) - 1);
+  tag += char(sizeof(XMLCh));
+  if (in.compare (0, tag.length(), tag) != 0)
+  {
+    return false;
+  }
+  domx::xmlInitialize();
+  DOMImplementation *impl = 
+    DOMImplementationRegistry::getDOMImplementation(0);
+  DOMDocument* doc = impl ? impl->createDocument (0, 0, 0) : 0;
+  if (! doc)
+  {
+    return false;
+  }
+  FlatReader reader;
+  reader.p = in.data() + tag.length();
+  reader.end = in.data() + in.length();
+  bool ok = false;
+  try
+  {
+    ok = unflatten (doc, doc, reader);
+  }
+  catch (const xercesc::DOMException& e)
+  {
+    ELOG << "An error occurred rebuilding a flat document\n   Message: "
+	 << xstring(e.msg);
+  }
+  if (! ok)
+  {
+    doc->release();
+    return false;
+  }
+  if (!_xo) _xo = new XmlObject (this);
+  _xo->replaceDocument (doc);
+  updateInterfaces();
+  return true;
+}
+
+
 bool
 XmlObjectInterface::
 load (const std::string &filepath)
@@ -657,3 +918,94 @@ XmlObjectMemberBase::
 {
 }
 
+
+XmlObjectReader::
+XmlObjectReader (std::istream& in) :
+  _rp (new XmlObjectReaderP (in))
+{
+}
+
+
+XmlObjectReader::
+~XmlObjectReader()
+{
+  delete _rp;
+}
+
+
+bool
+XmlObjectReader::
+next (XmlObjectInterface* object)
+{
+  // Find the start of the next object, keeping track of the wrapper
+  // elements on the way.
+  _rp->error = false;
+  std::string token;
+  while (true)
+  {
+    if (! _rp->copyText (0))
+      return false;
+    token = "<";
+    if (! _rp->readMarkup (token))
+    {
+      ELOG << "XmlObjectReader: stream ends inside markup";
+      _rp->error = true;
+      return false;
+    }
+    if (! XmlObjectReaderP::isTag (token))
+      continue;
+    if (XmlObjectReaderP::isEndTag (token))
+    {
+      if (! _rp->keys.empty())
+	_rp->keys.pop_back();
+      continue;
+    }
+    if (XmlObjectReaderP::tagName (token) == "xmlobject")
+      break;
+    if (! XmlObjectReaderP::isEmptyTag (token))
+      _rp->keys.push_back (XmlObjectReaderP::attribute (token, "key"));
+  }
+  _rp->key = _rp->keys.empty() ? "" : _rp->keys.back();
+
+  // Collect the text of the object up to its end tag and parse it.
+  std::string text = token;
+  int depth = XmlObjectReaderP::isEmptyTag (token) ? 0 : 1;
+  while (depth > 0)
+  {
+    token = "<";
+    if (! _rp->copyText (&text) || ! _rp->readMarkup (token))
+    {
+      ELOG << "XmlObjectReader: stream ends inside an object";
+      _rp->error = true;
+      return false;
+    }
+    text += token;
+    if (XmlObjectReaderP::isEndTag (token))
+      --depth;
+    else if (XmlObjectReaderP::isTag (token) &&
+	     ! XmlObjectReaderP::isEmptyTag (token))
+      ++depth;
+  }
+  if (! object->fromXML (text))
+  {
+    _rp->error = true;
+    return false;
+  }
+  return true;
+}
+
+
+std::string
+XmlObjectReader::
+key ()
+{
+  return _rp->key;
+}
+
+
+bool
+XmlObjectReader::
+error ()
+{
+  return _rp->error;
+}
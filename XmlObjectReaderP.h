@@ -0,0 +1,207 @@
+// -*- C++ -*-
+//
+// $Id$
+//
+
+#ifndef _domx_XmlObjectReaderP_h_
+#define _domx_XmlObjectReaderP_h_
+
+#include "domx/XML.h"
+
+#include <istream>
+#include <string>
+#include <vector>
+#include <string.h>
+
+namespace domx
+{
+  /**
+   * The state of an XmlObjectReader: the current block of the stream, and
+   * the key attributes of the wrapper elements the scan is inside.  The
+   * catalog scans stored objects for index values with it too, with a
+   * block just big enough for the text.
+   **/
+  struct XmlObjectReaderP
+  {
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    std::istream& in;
+    std::vector<char> block;
+    size_t pos;
+    size_t len;
+    std::vector<std::string> keys;
+    std::string key;
+    bool error;
+
+    XmlObjectReaderP (std::istream& in_, size_t size = BLOCK_SIZE) :
+      in (in_),
+      block (size ? size : 1),
+      pos (0),
+      len (0),
+      error (false)
+    {}
+
+    bool
+    fill ()
+    {
+      if (pos < len)
+	return true;
+      in.read (&block[0], block.size());
+      len = in.gcount();
+      pos = 0;
+      return len > 0;
+    }
+
+    bool
+    get (char& c)
+    {
+      if (! fill())
+	return false;
+      c = block[pos++];
+      return true;
+    }
+
+    // Skip to the next '<' and past it, adding the text in between to @p
+    // text unless it is null.  Returns false at the end of the stream.
+    bool
+    copyText (std::string* text)
+    {
+      while (fill())
+      {
+	const char* start = &block[pos];
+	const char* lt = (const char*)memchr (start, '<', len - pos);
+	size_t n = lt ? lt - start : len - pos;
+	if (text)
+	  text->append (start, n);
+	pos += n;
+	if (lt)
+	{
+	  ++pos;
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    bool
+    readUntil (std::string& token, const char* end)
+    {
+      size_t n = strlen (end);
+      char c;
+      while (get (c))
+      {
+	token += c;
+	if (token.length() >= n &&
+	    token.compare (token.length() - n, n, end) == 0)
+	  return true;
+      }
+      return false;
+    }
+
+    // Read the rest of the markup which starts with the '<' already in @p
+    // token: a tag, a comment, a CDATA section, a processing instruction
+    // or a declaration.
+    bool
+    readMarkup (std::string& token)
+    {
+      char c;
+      if (! get (c))
+	return false;
+      token += c;
+      if (c == '?')
+	return readUntil (token, "?>");
+      if (c == '!')
+      {
+	if (! get (c))
+	  return false;
+	token += c;
+	if (c == '-')
+	  return readUntil (token, "-->");
+	if (c == '[')
+	  return readUntil (token, "]]>");
+	// A declaration, which may have an internal subset in brackets.
+	int brackets = 0;
+	while (get (c))
+	{
+	  token += c;
+	  if (c == '[')
+	    ++brackets;
+	  else if (c == ']')
+	    --brackets;
+	  else if (c == '>' && brackets <= 0)
+	    return true;
+	}
+	return false;
+      }
+      // A tag ends at the first '>' outside an attribute value.
+      char quote = 0;
+      while (true)
+      {
+	if (c == '>' && ! quote)
+	  return true;
+	if (! get (c))
+	  return false;
+	token += c;
+	if (quote && c == quote)
+	  quote = 0;
+	else if (! quote && (c == '"' || c == '\''))
+	  quote = c;
+      }
+    }
+
+    static bool
+    isTag (const std::string& token)
+    {
+      return token.length() > 1 && token[1] != '?' && token[1] != '!';
+    }
+
+    static bool
+    isEndTag (const std::string& token)
+    {
+      return token.length() > 1 && token[1] == '/';
+    }
+
+    static bool
+    isEmptyTag (const std::string& token)
+    {
+      return token.length() > 2 && token[token.length() - 2] == '/';
+    }
+
+    static std::string
+    tagName (const std::string& token)
+    {
+      std::string::size_type start = isEndTag (token) ? 2 : 1;
+      std::string::size_type end = token.find_first_of (" \t\r\n/>", start);
+      return token.substr (start, end - start);
+    }
+
+    static std::string
+    attribute (const std::string& token, const std::string& name)
+    {
+      // Walk the attributes after the tag name, unescaping the value of
+      // the one asked for.
+      std::string::size_type pos = token.find_first_of (" \t\r\n/>", 1);
+      while (pos != std::string::npos)
+      {
+	pos = token.find_first_not_of (" \t\r\n", pos);
+	std::string::size_type eq = token.find ('=', pos);
+	if (pos == std::string::npos || eq == std::string::npos)
+	  break;
+	std::string aname = token.substr (pos, eq - pos);
+	aname.erase (aname.find_last_not_of (" \t\r\n") + 1);
+	std::string::size_type open = token.find_first_of ("\"'", eq);
+	if (open == std::string::npos)
+	  break;
+	std::string::size_type close = token.find (token[open], open + 1);
+	if (close == std::string::npos)
+	  break;
+	if (aname == name)
+	  return unescapeText (token.substr (open + 1, close - open - 1));
+	pos = close + 1;
+      }
+      return "";
+    }
+  };
+}
+
+#endif // _domx_XmlObjectReaderP_h_
@@ -9,6 +9,7 @@
 
 #include <string>
 #include <sstream>
+#include <vector>
 
 // Includes for Xerces-C
 #include <xercesc/dom/DOM.hpp>
@@ -335,6 +336,153 @@ namespace domx
   void
   pruneWhitespace (DOMNode* node);
 
+  /**
+   * Append the character @p c to @p buf encoded as UTF-8, and return the
+   * number of bytes appended.  Surrogates and values beyond Unicode
+   * become the replacement character.
+   **/
+  std::string::size_type
+  appendUtf8 (std::string& buf, unsigned int c);
+
+  /**
+   * Return the text or attribute value @p value with the predefined
+   * entities and numeric character references replaced by the characters
+   * they stand for, encoded as UTF-8, the same as the parser reads them.
+   * Any other '&' is kept as it is.
+   **/
+  std::string
+  unescapeText (const std::string& value);
+
+  /**
+   * Write XML text straight to a string, a stream or a file descriptor
+   * without building or serializing a DOM.  Names are written as given,
+   * while attribute values and text are escaped, and XMLCh strings are
+   * encoded as UTF-8 without any transcoding copies.  The layout is the
+   * same as domToStream(): each element starts on its own line, indented
+   * two spaces per level, and short text stays on the line with its tags.
+   *
+   * Output collects in a block which is written whenever it fills, when
+   * flush() is called and when the writer is destroyed.  A string target
+   * is appended to directly.
+   **/
+  class XmlWriter
+  {
+  public:
+
+    explicit
+    XmlWriter (std::string& out);
+
+    explicit
+    XmlWriter (std::ostream& out);
+
+    /**
+     * Write to the file descriptor @p fd, which the writer does not close.
+     **/
+    explicit
+    XmlWriter (int fd);
+
+    ~XmlWriter ();
+
+    XmlWriter&
+    startElement (const std::string& name);
+
+    XmlWriter&
+    startElement (const XMLCh* name);
+
+    /**
+     * Add an attribute to the element just started.  Attributes must come
+     * before any text or child elements.
+     **/
+    XmlWriter&
+    attribute (const std::string& name, const std::string& value);
+
+    XmlWriter&
+    attribute (const XMLCh* name, const XMLCh* value);
+
+    XmlWriter&
+    text (const std::string& text);
+
+    XmlWriter&
+    text (const XMLCh* text);
+
+    /**
+     * Close the innermost open element.
+     **/
+    XmlWriter&
+    endElement ();
+
+    /**
+     * Write the element @p node and everything under it, or the document
+     * element if @p node is a document.  Text and CDATA sections are
+     * written as escaped text, while comments and processing instructions
+     * are skipped.
+     **/
+    XmlWriter&
+    node (DOMNode* node);
+
+    /**
+     * Write out everything buffered so far.  Returns false if any write
+     * has failed.
+     **/
+    bool
+    flush ();
+
+    /**
+     * Return true if writing to the target has failed, or if an attribute
+     * or end tag came where it could not be written.
+     **/
+    bool
+    error () const
+    {
+      return _error;
+    }
+
+  private:
+
+    std::string&
+    buffer ()
+    {
+      return _string ? *_string : _block;
+    }
+
+    std::string&
+    nameSlot ();
+
+    XmlWriter&
+    openElement ();
+
+    void
+    indent (std::string& buf, unsigned int depth);
+
+    void
+    finishText (std::string::size_type start, std::string::size_type length);
+
+    void
+    checkBlock ()
+    {
+      if (! _string && _block.length() >= BLOCK_SIZE)
+	flush();
+    }
+
+    XmlWriter (const XmlWriter&);
+    XmlWriter& operator= (const XmlWriter&);
+
+    static const std::string::size_type BLOCK_SIZE = 64*1024;
+
+    std::string _block;
+    std::string* _string;
+    std::ostream* _stream;
+    int _fd;
+
+    // Names of the open elements, kept so their storage is reused.
+    std::vector<std::string> _open;
+    unsigned int _depth;
+    bool _pending;
+    bool _inline;
+    bool _error;
+  };
+
+
   class ErrorFormatter
   {
   public:
@@ -9,12 +9,15 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <utility>
 
 namespace domx
 {
 
   class XmlObjectInterface;
   class XmlObjectCatalogP;
+  class XmlObjectCatalogIteratorP;
+  class XmlObjectCatalogWatchP;
 
   /**
    * An XmlObjectCatalog is a cheap but reliable storage mechanism for
@@ -29,7 +32,9 @@ namespace domx
    * MAX_PENDING_ERRORS.
    *
    * Catalogs are hierarchical: one catalog can contain other catalogs.
-   * All catalogs reside under a default root directory.
+   * All catalogs reside under a default root directory.  Objects can
+   * also be packed into segment files or kept only in memory, as listed
+   * by EnumStorage, without changing how the catalog is used.
    **/
   class XmlObjectCatalog
   {
@@ -37,8 +42,111 @@ namespace domx
 
     typedef std::set<std::string> key_set_t;
 
+    typedef std::pair<std::string, XmlObjectInterface*> object_entry_t;
+    typedef std::vector<object_entry_t> object_list_t;
+
+    /**
+     * Identifies one stored version of an object.  Every insert creates a
+     * new file, so the inode together with the modification time and size
+     * changes whenever the object is replaced.  Since an inode number can
+     * be reused within the resolution of the modification time, the
+     * version also carries a checksum of the stored text.  See version()
+     * and replaceIfUnchanged().
+     **/
+    struct ObjectVersion
+    {
+      unsigned long long device;
+      unsigned long long inode;
+      long long mtime_ns;
+      long long size;
+      unsigned long long checksum;
+
+      ObjectVersion() :
+	device (0), inode (0), mtime_ns (0), size (0), checksum (0)
+      {}
+
+      bool
+      operator== (const ObjectVersion& v) const
+      {
+	return device == v.device && inode == v.inode &&
+	  mtime_ns == v.mtime_ns && size == v.size && checksum == v.checksum;
+      }
+
+      bool
+      operator!= (const ObjectVersion& v) const
+      {
+	return ! (*this == v);
+      }
+    };
+
     static const unsigned int MAX_PENDING_ERRORS = 10;
 
+    /**
+     * Counters for the load() cache, to help size it.  See
+     * setLoadCacheSize().
+     **/
+    struct LoadCacheStats
+    {
+      unsigned long long hits;
+      unsigned long long misses;
+      unsigned int entries;
+      unsigned long long shared_hits;
+      unsigned long long shared_misses;
+
+      LoadCacheStats() :
+	hits (0), misses (0), entries (0), shared_hits (0), shared_misses (0)
+      {}
+    };
+
+    /**
+     * How much effort insert() and remove() spend making changes durable
+     * against a crash, from cheapest to safest:
+     *
+     * @c SYNC_NONE: nothing is synced.  A crash soon after an insert can
+     * leave the renamed object file empty.  This is the default.
+     *
+     * @c SYNC_DATA: the object data are synced with fdatasync() before
+     * the object is renamed into place, so a visible object is never
+     * empty, but the rename itself may be lost in a crash.
+     *
+     * @c SYNC_FULL: the object file and then the catalog directory are
+     * synced, so the insert or remove is durable when the call returns.
+     *
+     * @c SYNC_PERIODIC: nothing is synced by the caller, but a background
+     * thread syncs the catalog filesystem every period if there have been
+     * changes since the last sync.
+     **/
+    typedef enum { SYNC_NONE, SYNC_DATA, SYNC_FULL, SYNC_PERIODIC }
+      EnumDurability;
+
+    /**
+     * How a catalog whose keys start with XmlTime::key() is split into
+     * time partitions, one subdirectory per day or per hour of the key's
+     * time prefix.  Keys without a time prefix stay in the catalog
+     * directory.  See repartition().
+     **/
+    typedef enum { PARTITION_NONE, PARTITION_DAY, PARTITION_HOUR }
+      EnumPartitioning;
+
+    /**
+     * How a catalog stores its objects.
+     *
+     * @c STORAGE_FILES: one xml file per object, named by its key.  This
+     * is the default.
+     *
+     * @c STORAGE_SEGMENTS: objects are appended to shared segment files,
+     * with a tombstone record for each remove, and an index of the latest
+     * record for each key is kept in memory.  Small objects then cost a
+     * few bytes of overhead instead of an inode and a block, and an
+     * insert is a single append.  Dead records are reclaimed by a
+     * background compaction.  See setStorage().
+     *
+     * @c STORAGE_MEMORY: objects are kept in the memory of this process
+     * and are lost when it exits.  See openMemory().
+     **/
+    typedef enum { STORAGE_FILES, STORAGE_SEGMENTS, STORAGE_MEMORY }
+      EnumStorage;
+
     /**
      * Set the path to the root catalog directory under which all catalogs
      * will be opened.  The default is '/var/xmlobjects'.
@@ -50,6 +158,57 @@ namespace domx
     std::string
     rootCatalogDirectory();
 
+    /**
+     * Keep up to @p entries parsed objects in a cache shared by every
+     * catalog in the process, so that loading an object which has not
+     * changed since it was last loaded copies the cached document instead
+     * of reading and parsing the object again.  Every load() still checks
+     * the stored version of the object, with one fstatat() for an object
+     * file, so a replaced object is never served from the cache.  The
+     * check leaves out the checksum of the ObjectVersion, so an object
+     * file replaced by one with the same inode, modification time and
+     * size would not be noticed.  The least recently loaded objects are
+     * dropped first.  Zero disables the cache, which is the default.
+     **/
+    static void
+    setLoadCacheSize (unsigned int entries);
+
+    /**
+     * Share parsed objects between the processes on this host through
+     * the directory @p dir, best placed on tmpfs such as under /dev/shm.
+     * When load() has to read an object, it also stores it there in the
+     * flat form of XmlObjectInterface::toFlat(), in one of @p slots files
+     * chosen by a hash of the catalog and key.  Any process which uses
+     * the same directory can then rebuild the object from the flat form
+     * instead of parsing it again.  The same version check applies as
+     * for setLoadCacheSize(), and this cache is checked after that one.
+     * Colliding keys replace each other, so @p slots bounds the space
+     * used.  An empty @p dir turns the shared cache off again.  Returns
+     * false if the directory cannot be created or opened.
+     **/
+    static bool
+    setSharedLoadCache (const std::string& dir, unsigned int slots);
+
+    /**
+     * When domx is built with liburing, loadMany() on catalogs stored in
+     * files reads the objects in batches through io_uring, which opens,
+     * stats, reads and closes a whole batch of files with a few system
+     * calls, while its threads parse the objects already read.  Any file
+     * io_uring cannot read, such as on a kernel without io_uring, is read
+     * the usual way instead.  Pass false to always read the usual way.
+     * Returns true if io_uring is used from now on.
+     **/
+    static bool
+    setIoUring (bool enable);
+
+    /**
+     * Return the hits and misses of the load() cache and the shared cache
+     * since the process started, and the number of objects the load()
+     * cache holds now.
+     **/
+    static LoadCacheStats
+    loadCacheStats ();
+
     /**
      * Construct a closed, empty catalog.  Nothing can be inserted until a
      * call to open() succeeds.  Until then the catalog appears empty.
@@ -62,6 +221,18 @@ namespace domx
      * exist, it will be created.  If the path includes parent catalog
      * paths, then those will be created as well as necessary.
      *
+     * An open catalog holds a descriptor for its directory, and every
+     * object operation is relative to that descriptor.  Renaming the root
+     * directory does not affect catalogs which are already open.  The
+     * directories are created or verified with one pass down the path,
+     * and the process remembers each verified directory, so opening a
+     * catalog which has been opened before is just a cache lookup and a
+     * check that the path still names the same directory.
+     *
+     * A catalog directory may be sharded by reshard(), in which case the
+     * objects are spread over hashed subdirectories and the layout is
+     * picked up here.  Every other method works the same either way.
+     *
      * See setRootCatalogDirectory().
      **/
     bool
@@ -77,6 +248,18 @@ namespace domx
     open (XmlObjectCatalog& parent, const std::string& path);
 
 
+    /**
+     * Open a catalog which is only kept in the memory of this process,
+     * such as for tests or for a scratch queue which never needs to
+     * outlive the process.  Every catalog opened on the same @p name in
+     * this process shares the same objects, and they are gone when the
+     * process exits.  Nothing touches the filesystem, so it cannot be
+     * sharded, partitioned or converted with setStorage().
+     **/
+    bool
+    openMemory (const std::string& name);
+
+
     /**
      * Register this catalog in the system catalog.
      **/
@@ -109,12 +292,139 @@ namespace domx
     bool
     isOpen();
 
+    /**
+     * Set the durability policy for changes made through this catalog
+     * instance.  See EnumDurability.  For @c SYNC_PERIODIC, @p seconds is
+     * the interval between background syncs.  Changing the policy away
+     * from @c SYNC_PERIODIC stops the background thread after a final sync.
+     **/
+    void
+    setDurability (EnumDurability mode, unsigned int seconds = 1);
+
+    /**
+     * Return the current durability policy.
+     **/
+    EnumDurability
+    durability();
+
+    /**
+     * Skip an insert() through this catalog instance when the object
+     * stored under the name already has exactly the same text, so an
+     * unchanged object is not rewritten, its modification time stays put,
+     * and catalog watchers are not woken.  Every object file records the
+     * size and checksum of its text, along with the size and
+     * modification time of the file itself, in the user.domx.fingerprint
+     * extended attribute when it is written.  The comparison reads only
+     * that attribute and the status of the open file, so a file changed
+     * in place outside the catalog no longer matches its attribute and is
+     * rewritten.  Where the filesystem has no user attributes the file
+     * is read instead and compared by size and checksum.  Segment and
+     * memory catalogs compare against the checksum they already keep.  A
+     * skipped insert is not journaled.  Off by default.
+     **/
+    void
+    setSkipUnchanged (bool enable);
+
+    /**
+     * Queue inserts through this catalog instance and write them from a
+     * background thread, for an object which is updated many times a
+     * second.  insert() serializes the object and returns at once, and
+     * the object is written @p window_ms milliseconds later, with the
+     * latest of any inserts of the same name in the meantime, so a busy
+     * object is written at most once per window.  Every other operation
+     * on this instance first writes the queue, so it sees the queued
+     * objects, except that remove() discards a queued insert of the same
+     * name.  Errors from the background writes are queued as usual, and
+     * flush() reports them.  A window of zero, the default, writes the
+     * queue and returns to synchronous inserts.  Catalogs in segment
+     * storage always insert synchronously.
+     **/
+    void
+    setAsyncInsert (unsigned int window_ms);
+
+    /**
+     * Write any inserts still queued by setAsyncInsert(), under the
+     * durability policy, before returning.  Returns false if a background
+     * insert has failed since the last flush.
+     **/
+    bool
+    flush();
+
     /**
      * Insert the given @p object into this catalog under the given @p name.
+     * The object is serialized in memory and written with a single write()
+     * to an unnamed O_TMPFILE file in the catalog directory, which is then
+     * linked into place, so a failed insert leaves nothing behind.  On
+     * filesystems without O_TMPFILE a temporary file named with a "-temp"
+     * suffix is written and renamed instead.
+     *
+     * Any number of processes, and threads with their own catalog
+     * instances, may insert into the same catalog, even under the same
+     * name, without external locking.  Each writer uses its own temporary
+     * file, and concurrent inserts of the same name resolve as last writer
+     * wins: the object left in the catalog is always one complete object
+     * from one of the writers, never a mix.
      **/
     bool
     insert (const std::string& name, XmlObjectInterface* object);
 
+    /**
+     * Insert each object in @p objects under the name paired with it.  All
+     * of the objects are first written to temporary files and synced to
+     * disk in one pass, then each is renamed to its key and the catalog
+     * directory is synced once, so the cost of making the inserts durable
+     * is shared by the whole batch rather than paid for each object.
+     *
+     * The batch succeeds or fails as a group.  If any object cannot be
+     * written or renamed, the objects already renamed are rolled back to
+     * their previous contents (or removed if they did not exist before),
+     * none of the batch remains in the catalog, and this method returns
+     * false.  The batch is always synced as if the durability policy were
+     * @c SYNC_FULL.  A batch may not contain the same name twice.  Note that
+     * readers scanning the catalog while the renames are in progress may
+     * see some of the batch before the rest.  Each object holds an open
+     * file until the batch is published, so very large batches should be
+     * split to stay within the process file limit.
+     **/
+    bool
+    insertBatch (const object_list_t& objects);
+
+    /**
+     * Insert @p object under @p name only if no object by that name
+     * exists.  The object is published with a link() or a no-replace
+     * rename, so of several concurrent callers exactly one succeeds.
+     * Returns false without queuing an error if the name already exists.
+     **/
+    bool
+    insertIfAbsent (const std::string& name, XmlObjectInterface* object);
+
+    /**
+     * Replace the object stored under @p name with @p object, but only if
+     * the stored object is still the version @p expected, as returned by
+     * version() or load().  This allows an optimistic read-modify-write
+     * cycle: load the object and its version, change it, and retry from
+     * the load if this method returns false.
+     *
+     * Readers never wait.  Every write of an existing object, whether
+     * insert(), remove(), move() or this method, holds an flock() on the
+     * object file while it replaces it, so no other write can land
+     * between the version check and the rename.  The lock is advisory,
+     * so it only orders writers using this class, and on NFS it relies on
+     * the server's lock support.  Returns false without queuing an error
+     * if the object has changed or no longer exists.
+     **/
+    bool
+    replaceIfUnchanged (const std::string& name, XmlObjectInterface* object,
+			const ObjectVersion& expected);
+
+    /**
+     * Fill in @p version for the object currently stored under @p name.
+     * The object text is read to compute the checksum but not parsed.
+     * Returns false without queuing an error if the object does not exist.
+     **/
+    bool
+    version (const std::string& name, ObjectVersion& version);
+
     /**
      * Remove the object named @p name from this catalog.  This method
      * still returns true if the object does not exist.  It only returns
@@ -123,17 +433,29 @@ namespace domx
     bool
     remove (const std::string& name);
 
-#ifdef notdef
     /**
      * Move the object with the given @p name from this catalog to @p dest.
      * Note this uses the filesystem atomic rename() call, so the move
      * either succeeds or the object remains in this catalog.  If the
      * move fails, return false and queue the reason for the failure
-     * in the error queue.
+     * in the error queue.  The object is never parsed.  When the two
+     * catalogs are on different filesystems, the object text is copied
+     * into @p dest with the same atomic insert as insert(), and then
+     * removed from this catalog, so for a moment the object can be seen
+     * in both catalogs.  Any object by the same name in @p dest is
+     * replaced.
      **/
     bool
     move (const std::string& name, XmlObjectCatalog* dest);
-#endif
+
+    /**
+     * Move each of the objects in @p names to @p dest, as with move().
+     * Every object is attempted even if some fail, and the method returns
+     * false if any of them failed.  Under the @c SYNC_FULL durability
+     * policy, each directory is synced once for the whole batch.
+     **/
+    bool
+    move (const key_set_t& names, XmlObjectCatalog* dest);
 
     /**
      * This loads the given @p object from key @p name in this catalog.
@@ -144,6 +466,43 @@ namespace domx
     bool
     load (const std::string& name, XmlObjectInterface* object);
 
+    /**
+     * Like load(), but also return the version of the object which was
+     * loaded, for use with replaceIfUnchanged().
+     **/
+    bool
+    load (const std::string& name, XmlObjectInterface* object,
+	  ObjectVersion& version);
+
+    /**
+     * Called by loadMany() as each object is done, with @p loaded false
+     * if it could not be loaded, and the @p arg given to loadMany().
+     **/
+    typedef void (*load_callback_t)(const object_entry_t& entry, bool loaded,
+				    void* arg);
+
+    /**
+     * Load each object in @p objects from its key, like load(), but spread
+     * the reads and the parsing over @p nthreads threads, or one per
+     * processor if @p nthreads is zero.  The objects must all be
+     * distinct.  Every object is attempted even if some fail, and the
+     * method returns false if any of them failed.  For a very long list
+     * of keys, such as a whole backlog from keys(), call this for a few
+     * thousand objects at a time to bound the memory used.
+     **/
+    bool
+    loadMany (const object_list_t& objects, unsigned int nthreads = 0);
+
+    /**
+     * Like loadMany() above, but call @p callback for each object as soon
+     * as it is done, in the order they finish.  The callback runs in the
+     * calling thread, one object at a time, while the other objects keep
+     * loading.
+     **/
+    bool
+    loadMany (const object_list_t& objects, load_callback_t callback,
+	      void* arg, unsigned int nthreads = 0);
+
     /**
      * Return the set of keys in this catalog.  This is a snapshot of the
      * keys made when this method is called, and the set of keys will not
@@ -172,7 +531,16 @@ namespace domx
     bool
     keys(key_set_t& kset);
 
-#ifdef notdef
+    /**
+     * Like keys(), but only return the keys @p k where @p from <= @p k <
+     * @p to.  An empty @p to has no upper limit.  In a partitioned
+     * catalog only the partitions which can hold keys in the range are
+     * read, so a query on recent times stays cheap however much history
+     * the catalog holds.
+     **/
+    bool
+    keys (const std::string& from, const std::string& to, key_set_t& kset);
+
     /**
      * Return true if an object by this name exists in this catalog,
      * otherwise return false.  The object is not instantiated, so this can
@@ -182,7 +550,241 @@ namespace domx
      **/
     bool
     exists (const std::string& name);
-#endif
+
+    /**
+     * Check each of the objects in @p names for existence, and set @p
+     * found to the names which exist.  Returns false if any check failed
+     * with an error.
+     **/
+    bool
+    exists (const key_set_t& names, key_set_t& found);
+
+    /**
+     * Spread the objects in this catalog over @p nshards hashed
+     * subdirectories, or gather them back into the catalog directory
+     * when @p nshards is zero.  Directory operations on very large flat
+     * catalogs get slow, and keys() scans the shards in parallel.
+     *
+     * The objects are moved in place with rename(), and the new layout
+     * is recorded only once they have all been moved.  This is an offline
+     * operation: nothing else may use the catalog meanwhile, and other
+     * processes must reopen it afterwards.  If it is interrupted, calling
+     * it again with the same count finishes the job.
+     **/
+    bool
+    reshard (unsigned int nshards);
+
+    /**
+     * Change the time partitioning of this catalog, moving the objects
+     * in place like reshard() and with the same offline restrictions.  A
+     * catalog may be sharded or partitioned, but not both.
+     **/
+    bool
+    repartition (EnumPartitioning mode);
+
+    /**
+     * Return the time partitioning of this catalog as of when it was
+     * opened.
+     **/
+    EnumPartitioning
+    partitioning();
+
+    /**
+     * Drop every partition whose keys all sort before @p key, such as
+     * XmlTime(t).key() to drop everything older than time t.  The keys in
+     * the partition which holds @p key itself are kept.  Each partition is
+     * renamed out of the catalog at once and its files are removed by a
+     * background thread, so the call costs a rename per partition rather
+     * than an unlink per object.  Removals cut short by the process exiting
+     * are finished by the next call.  Nothing may still be writing to the
+     * dropped partitions.
+     **/
+    bool
+    dropBefore (const std::string& key);
+
+    /**
+     * Convert this catalog to the given storage, moving every object
+     * over.  Like reshard(), this is an offline operation which can be
+     * run again to finish an interrupted conversion.  Segment storage
+     * cannot be combined with shards or partitions.
+     *
+     * Every method works the same with either storage, including the
+     * atomic visibility of inserts and batches, but objects in segment
+     * storage are only visible through the catalog API.
+     **/
+    bool
+    setStorage (EnumStorage mode);
+
+    /**
+     * Return the storage of this catalog as of when it was opened.
+     **/
+    EnumStorage
+    storage();
+
+    /**
+     * Compact the segments of a catalog in segment storage now rather
+     * than waiting for the background compaction.  Does nothing for a
+     * catalog stored in files.
+     **/
+    bool
+    compact();
+
+    /**
+     * The kinds of change recorded in a catalog journal.  A move is
+     * recorded as JOURNAL_MOVE in the journal of the catalog the objects
+     * left, with the destination catalog, and as JOURNAL_INSERT in the
+     * journal of the destination.  JOURNAL_DROP records a dropBefore(),
+     * with its key, since the keys it removes are not listed.
+     **/
+    typedef enum { JOURNAL_INSERT, JOURNAL_REMOVE, JOURNAL_MOVE, JOURNAL_DROP }
+    EnumJournalOp;
+
+    struct JournalEntry
+    {
+      unsigned long long sequence;
+      EnumJournalOp op;
+      std::string key;
+      std::string destination;
+    };
+
+    typedef std::vector<JournalEntry> journal_t;
+
+    /**
+     * Start or stop keeping a journal of the changes to this catalog.
+     * While a catalog keeps a journal, every insert, remove, move and
+     * dropBefore() from any process appends a record with the next
+     * sequence number, after the change itself succeeds.  A consumer can
+     * then resume from the last sequence number it processed with tail()
+     * instead of listing the whole catalog again.  Like the layout,
+     * whether a catalog keeps a journal is stored in the catalog, and
+     * other processes must reopen the catalog to notice a change.  A
+     * memory catalog cannot keep a journal.
+     **/
+    bool
+    setJournal (bool enable);
+
+    /**
+     * Set @p sequence to the sequence number of the last change recorded
+     * in the journal, to pass to tail() later.  Take it before listing
+     * the keys to start from, so no change is missed in between.
+     **/
+    bool
+    journalSequence (unsigned long long& sequence);
+
+    /**
+     * Replace the contents of @p entries with the journal records after
+     * sequence number @p after, in order.  Only those records are read,
+     * so a consumer which keeps up reads little of a long journal.
+     * Returns false with an error queued if the journal no longer holds
+     * all of them because it has been compacted since, in which case the
+     * consumer must list the keys and start over from journalSequence().
+     **/
+    bool
+    tail (unsigned long long after, journal_t& entries);
+
+    /**
+     * Discard the journal records before sequence number @p before, such
+     * as once every consumer has processed them.  Sequence numbers carry
+     * on from where they were.
+     **/
+    bool
+    compactJournal (unsigned long long before);
+
+    /**
+     * Start or stop keeping a summary of this catalog: one xml document,
+     * at summaryPath(), holding the text of every object, so a reader can
+     * take in the whole catalog with one sequential read instead of
+     * opening and parsing each object.  Each object appears in an
+     * <object> element with its key and the length of its text, inside a
+     * <summary> element which counts the changes folded in so far.
+     *
+     * Changes from every process are appended to a log next to the
+     * summary once they are made, each insert with the version of the
+     * object it stored, so records which land out of order are settled
+     * by the version each object has when the log is folded.  A
+     * background thread folds the log into the summary once the log is a
+     * quarter the size of the summary or the summary is a few seconds
+     * old, when the summary is rewritten and atomically renamed into
+     * place.  Only one fold runs at a time, starting from the summary
+     * last published, so a race can never publish an older state over a
+     * newer one, and a fold holds the log lock only long enough to mark
+     * the records it takes and then to swap in the new summary, so
+     * changes are not held up while it runs.  The summary can therefore
+     * lag the catalog by the changes since the last fold; see
+     * updateSummary().  Like the journal, whether a catalog keeps a
+     * summary is stored in the catalog, and a memory catalog cannot keep
+     * one.
+     **/
+    bool
+    setSummary (bool enable);
+
+    /**
+     * Fold any changes still in the summary log into the summary now,
+     * such as after a burst of inserts or before reading the summary,
+     * first waiting for any fold already running.
+     **/
+    bool
+    updateSummary ();
+
+    /**
+     * Return the path of the summary file kept by setSummary().
+     **/
+    std::string
+    summaryPath ();
+
+    /**
+     * Start or stop keeping an index of the member at @p path, given as
+     * the element names below the document element separated by slashes,
+     * such as "xmlfileobject/md5".  An index maps the text of that member
+     * to the keys of the objects which have it, so lookup() can answer
+     * without loading any objects.  Starting an index builds it from the
+     * objects already in the catalog, and from then on insert(), remove()
+     * and move() keep it current.  Objects without the member are not in
+     * the index.
+     *
+     * An index is a file in the catalog of lines sorted by value, each
+     * with a key and the version of the object it was read from, and a
+     * log of changes which writers append to under a shared lock.  A
+     * background thread merges the log into the sorted file once it has
+     * grown to a fraction of it, holding the log exclusively only to mark
+     * where the merge starts and to swap in the new files.  The text of the member is read as the parser reads it,
+     * with references decoded and CDATA sections included, and trimmed
+     * of surrounding whitespace.  Only the merges are synced, since an
+     * index can always be rebuilt from the objects; see rebuildIndex().
+     * Like the summary, the indexes are stored in the catalog, and a
+     * memory catalog cannot keep one.  A path too long to name an index
+     * file is refused.
+     **/
+    bool
+    setIndex (const std::string& path, bool enable = true);
+
+    /**
+     * Rebuild the index of @p path from the objects, such as after a
+     * crash or after objects were changed outside the catalog.  The new
+     * sorted file, with the changes logged while it was built, replaces
+     * the old one in one rename.
+     **/
+    bool
+    rebuildIndex (const std::string& path);
+
+    /**
+     * Fill @p kset with the keys of the objects whose member at @p path
+     * has the text @p value.  Lookups share the index lock with writers,
+     * and each key found is checked against the current version of its
+     * object, which is only read when the version has changed since it
+     * was indexed.  Keys of objects which have left the catalog without
+     * a remove(), such as through dropBefore(), are left out and logged
+     * as removed.  Returns false if there is no index of @p path.
+     **/
+    bool
+    lookup (const std::string& path, const std::string& value,
+	    key_set_t& kset);
+
+    /**
+     * Fill @p paths with the member paths this catalog keeps indexes of.
+     **/
+    bool
+    indexes (std::vector<std::string>& paths);
 
     /**
      * Return the number of accumulated error messages.
@@ -215,6 +817,8 @@ namespace domx
   private:
 
     friend class XmlObjectCatalogP;
+    friend class XmlObjectCatalogIterator;
+    friend class XmlObjectCatalogWatch;
 
     XmlObjectCatalogP* _mp;
 
@@ -225,6 +829,128 @@ namespace domx
 
   };
 
+
+  /**
+   * Walk the objects of a catalog in key order, such as to work through a
+   * queue, while a background thread reads and parses the next few
+   * objects ahead.  The read of each object then overlaps the processing
+   * of the ones before it, which hides the latency of a catalog on NFS.
+   * The keys are taken when the iterator is created, and a key whose
+   * object is removed before it is read is skipped, so objects can be
+   * removed from the catalog as they are processed.  The catalog must
+   * stay open while the iterator is in use.  Catalogs in segment storage
+   * are read as next() is called, without reading ahead.
+   **/
+  class XmlObjectCatalogIterator
+  {
+  public:
+
+    /**
+     * Iterate over the keys of @p catalog from @p from up to but not
+     * including @p to, or to the end if @p to is empty, keeping up to
+     * @p window objects read ahead.
+     **/
+    XmlObjectCatalogIterator (XmlObjectCatalog& catalog,
+			      const std::string& from = "",
+			      const std::string& to = "",
+			      unsigned int window = 8);
+
+    /**
+     * Load the next object into @p object and set @p key to its key.
+     * An object which cannot be read or parsed is skipped, with the error
+     * queued on the catalog.  Returns false when there are no more
+     * objects.
+     **/
+    bool
+    next (std::string& key, XmlObjectInterface* object);
+
+    /**
+     * Change how many objects are kept read ahead.  A window of zero
+     * stops reading ahead.
+     **/
+    void
+    setWindow (unsigned int window);
+
+    ~XmlObjectCatalogIterator();
+
+  private:
+
+    XmlObjectCatalogIteratorP* _ip;
+
+    XmlObjectCatalogIterator& 
+    operator= (const XmlObjectCatalogIterator&);
+
+    XmlObjectCatalogIterator (const XmlObjectCatalogIterator&);
+  };
+
+
+  /**
+   * Subscribe to the keys inserted, removed and replaced in a catalog,
+   * instead of polling keys() and comparing the results.  The watch uses
+   * inotify on the catalog directories, so it sees changes made by any
+   * process within milliseconds and costs nothing while the catalog is
+   * idle.  Only the names of objects are watched, so temporary files
+   * never show up.  If the kernel drops events, the watch lists the keys
+   * again and reports the difference, in which case replacements in the
+   * meantime go unreported.  Only catalogs stored in files can be
+   * watched, and the catalog must stay open while it is watched.
+   **/
+  class XmlObjectCatalogWatch
+  {
+  public:
+
+    typedef enum { KEY_INSERTED, KEY_REMOVED, KEY_REPLACED } EnumChange;
+
+    struct Change
+    {
+      EnumChange change;
+      std::string key;
+    };
+
+    typedef std::vector<Change> change_list_t;
+
+    /**
+     * Construct a watch which is not watching anything yet.
+     **/
+    XmlObjectCatalogWatch ();
+
+    /**
+     * Start watching @p catalog, from its keys as of now.  Returns false
+     * with an error queued on the catalog if it cannot be watched.
+     **/
+    bool
+    watch (XmlObjectCatalog& catalog);
+
+    /**
+     * Wait up to @p timeout_ms milliseconds, or forever if it is
+     * negative, for the catalog to change, and replace the contents of @p
+     * changes with what changed since the last call, in key order.  An
+     * object which changes more than once between calls is reported once.
+     * Returns false if there is an error, otherwise true, even if @p
+     * changes is empty because nothing changed in time.
+     **/
+    bool
+    wait (change_list_t& changes, int timeout_ms = -1);
+
+    /**
+     * The descriptor which becomes readable when there are changes, for
+     * waiting on several things at once with poll().
+     **/
+    int
+    fd ();
+
+    ~XmlObjectCatalogWatch();
+
+  private:
+
+    XmlObjectCatalogWatchP* _wp;
+
+    XmlObjectCatalogWatch& 
+    operator= (const XmlObjectCatalogWatch&);
+
+    XmlObjectCatalogWatch (const XmlObjectCatalogWatch&);
+  };
+
 }
 
 #endif // _domx_XmlObjectCatalog_h_
@@ -17,6 +17,8 @@ namespace domx
   class XmlObject;
   class XmlObjectNode;
   class XmlObjectNodeImpl;
+  class XmlObjectReaderP;
+  class XmlWriter;
 
   class XmlObjectInterface
   {
@@ -34,6 +36,15 @@ namespace domx
     bool
     toXML (std::ostream& out);
 
+    /**
+     * Write this object through the streaming writer @p out, such as to
+     * add it to a large export.  The member values are written straight
+     * from this object's document; no other document or text copy is
+     * made.  Returns false if there is no document or the writer fails.
+     **/
+    bool
+    toXML (XmlWriter& out);
+
     /**
      * Translate this object to a string in XML format.  If the translation
      * fails, the returned string is empty.
@@ -52,11 +63,31 @@ namespace domx
 
     /**
      * Load an object from the given input stream @p in.  Returns true
-     * on success and false otherwise.
+     * on success and false otherwise.  The whole stream is read as one
+     * document; see XmlObjectReader for a stream of many objects.
      **/
     bool
     fromXML (std::istream& in);
 
+    /**
+     * Write the document of this object to @p out in a compact flat form
+     * which fromFlat() turns back into a document without parsing any
+     * XML, such as to share parsed objects between processes.  The form
+     * is only meant to be read back on the same host by the same version
+     * of this library.  Returns false if the document holds anything but
+     * elements, attributes, text and CDATA sections.
+     **/
+    bool
+    toFlat (std::string& out);
+
+    /**
+     * Replace the document of this object with the one in the flat form
+     * @p in written by toFlat().  Returns false and leaves this object
+     * unchanged if @p in is not a valid flat document.
+     **/
+    bool
+    fromFlat (const std::string& in);
+
     /**
      * Load this object from the XML file located at @p filepath.  
      * If the file cannot be read or the XML document cannot be parsed,
@@ -92,6 +123,17 @@ namespace domx
      **/
     XmlObjectInterface& assume (const XmlObjectInterface& rhs);
 
+    /**
+     * Replace the document of this object with a copy of the document of
+     * @p rhs, cloning the nodes directly rather than going through text
+     * like the assignment operator, so nothing is serialized or parsed.
+     * The interfaces attached to this object are extended onto the copy
+     * like assume().  Returns false and leaves this object unchanged if @p
+     * rhs has no document.
+     **/
+    bool
+    copyDocument (const XmlObjectInterface& rhs);
+
     /**
      * Create an empty XML object.  The creation of the implementation (the
      * XML document) is deferred until actually needed, so that it's cheap
@@ -242,6 +284,62 @@ namespace domx
   }
 
 
+  /**
+   * Read the objects in a stream one at a time, such as a concatenation
+   * of object documents, a catalog summary, or a bulk export.  Each
+   * <xmlobject> element which is not inside another one is an object,
+   * and any wrapper elements around the objects, the xml declarations,
+   * comments and the like are skipped.  The stream is scanned in blocks,
+   * and only the text of the object being read is kept and parsed, so
+   * memory use is bounded by the largest object rather than the stream.
+   **/
+  class XmlObjectReader
+  {
+  public:
+
+    /**
+     * Read objects from @p in, which must outlive the reader.
+     **/
+    XmlObjectReader (std::istream& in);
+
+    /**
+     * Load the next object in the stream into @p object, replacing its
+     * document, so the same object can be reused for every call.  Returns
+     * false at the end of the stream, or if the object cannot be parsed
+     * or the stream ends in the middle of one, in which case error() is
+     * true.  Reading can carry on with the next object after a parse
+     * error.
+     **/
+    bool
+    next (XmlObjectInterface* object);
+
+    /**
+     * Return the key attribute of the nearest wrapper element around the
+     * last object read, such as the <object> elements of a catalog
+     * summary, or an empty string if there is none.
+     **/
+    std::string
+    key ();
+
+    /**
+     * True if the last call to next() failed on an error rather than at
+     * the end of the stream.
+     **/
+    bool
+    error ();
+
+    ~XmlObjectReader();
+
+  private:
+
+    XmlObjectReaderP* _rp;
+
+    XmlObjectReader& 
+    operator= (const XmlObjectReader&);
+
+    XmlObjectReader (const XmlObjectReader&);
+  };
+
 }
 
 #endif // _domx_XmlObject_h_
@@ -0,0 +1,146 @@
+// Measure XmlObjectCatalog insert throughput under each durability policy.
+//
+// Usage: catalogbench [-n <count>] [-s] [<directory> ...]
+//
+// Each directory is used as a catalog root, so list one on tmpfs and one
+// on a real disk to compare them.  The default is /dev/shm and the current
+// directory.  With -s the catalogs use segment storage instead of one
+// file per object.
+
+#include "Car.h"
+
+#include "domx/XmlObjectCatalog.h"
+
+#include <logx/Logging.h>
+
+LOGGING("catalogbench");
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using namespace domx;
+using std::cout;
+using std::cerr;
+using std::string;
+
+
+namespace
+{
+  double
+  now()
+  {
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+  const char*
+  modeName (XmlObjectCatalog::EnumDurability mode)
+  {
+    switch (mode)
+    {
+    case XmlObjectCatalog::SYNC_NONE: return "none";
+    case XmlObjectCatalog::SYNC_DATA: return "data";
+    case XmlObjectCatalog::SYNC_FULL: return "full";
+    case XmlObjectCatalog::SYNC_PERIODIC: return "periodic";
+    }
+    return "unknown";
+  }
+}
+
+
+int
+bench (const string& root, XmlObjectCatalog::EnumDurability mode, int count,
+       XmlObjectCatalog::EnumStorage storage)
+{
+  XmlObjectCatalog::setRootCatalogDirectory (root);
+  XmlObjectCatalog catalog;
+  string name = string("catalogbench-") + modeName(mode);
+  if (storage == XmlObjectCatalog::STORAGE_SEGMENTS)
+    name += "-segments";
+  if (! catalog.open (name) || ! catalog.setStorage (storage))
+  {
+    cerr << root << ": could not open catalog " << name << ": "
+	 << catalog.lastError() << "\n";
+    return 1;
+  }
+  catalog.setDurability (mode);
+
+  Car car;
+  car.setMake ("honda");
+  car.setModel ("odyssey");
+  std::vector<string> keys;
+  for (int i = 0; i < count; ++i)
+  {
+    std::ostringstream key;
+    key << "car-" << i;
+    keys.push_back (key.str());
+  }
+
+  int errors = 0;
+  double start = now();
+  for (int i = 0; i < count; ++i)
+  {
+    car.Year = 2000 + i % 20;
+    if (! catalog.insert (keys[i], &car))
+      ++errors;
+  }
+  // Include the final background sync in the periodic measurement.
+  catalog.setDurability (XmlObjectCatalog::SYNC_NONE);
+  double elapsed = now() - start;
+
+  cout << root << "  " << modeName(mode)
+       << (storage == XmlObjectCatalog::STORAGE_SEGMENTS ? " segments" : "")
+       << "  " << count << " inserts in "
+       << elapsed << " s: " << (elapsed > 0 ? count / elapsed : 0)
+       << " inserts/sec\n";
+
+  for (int i = 0; i < count; ++i)
+  {
+    catalog.remove (keys[i]);
+  }
+  return errors;
+}
+
+
+int
+main (int argc, char* argv[])
+{
+  logx::ParseLogArgs (argc, argv);
+  int count = 1000;
+  XmlObjectCatalog::EnumStorage storage = XmlObjectCatalog::STORAGE_FILES;
+  std::vector<string> roots;
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg(argv[i]);
+    if (arg == "-n" && i+1 < argc)
+      count = atoi (argv[++i]);
+    else if (arg == "-s")
+      storage = XmlObjectCatalog::STORAGE_SEGMENTS;
+    else
+      roots.push_back (arg);
+  }
+  if (roots.empty())
+  {
+    roots.push_back ("/dev/shm");
+    roots.push_back (".");
+  }
+
+  XmlObjectCatalog::EnumDurability modes[] = {
+    XmlObjectCatalog::SYNC_NONE, XmlObjectCatalog::SYNC_DATA,
+    XmlObjectCatalog::SYNC_FULL, XmlObjectCatalog::SYNC_PERIODIC
+  };
+  int errors = 0;
+  for (unsigned int r = 0; r < roots.size(); ++r)
+  {
+    for (unsigned int m = 0; m < sizeof(modes)/sizeof(modes[0]); ++m)
+    {
+      errors += bench (roots[r], modes[m], count, storage);
+    }
+  }
+  return errors ? 1 : 0;
+}
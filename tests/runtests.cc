@@ -15,6 +15,11 @@ LOGGING("domx-tests");
 #include <sstream>
 #include <fstream>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
 
 using namespace domx;
 using std::endl;
@@ -243,6 +248,1005 @@ test_xmlobjectcatalog()
 }
 
 
+int
+test_insertbatch()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+
+  Car mazda, honda;
+  make_mazda(mazda);
+  make_honda(honda);
+  XmlObjectCatalog::object_list_t batch;
+  batch.push_back (std::make_pair(std::string("batch-mazda"), &mazda));
+  batch.push_back (std::make_pair(std::string("batch-honda"), &honda));
+  Check(vehicles.insertBatch (batch));
+
+  XmlObjectInterface xo;
+  Check(vehicles.load("batch-honda", &xo));
+  Car car;
+  car.assume (xo);
+  errors += compare_honda(car);
+
+  // A batch with a duplicate name fails without changing the catalog.
+  batch.push_back (std::make_pair(std::string("batch-mazda"), &honda));
+  Check(! vehicles.insertBatch (batch));
+  Check(vehicles.load("batch-mazda", &xo));
+  car.assume (xo);
+  Check(car.getMake() == "mazda");
+  vehicles.clearErrors();
+
+  Check(vehicles.remove ("batch-mazda"));
+  Check(vehicles.remove ("batch-honda"));
+  return errors;
+}
+
+
+int
+test_durability()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+  Check (vehicles.durability() == XmlObjectCatalog::SYNC_NONE);
+
+  Car c;
+  make_mazda(c);
+  XmlObjectCatalog::EnumDurability modes[] = {
+    XmlObjectCatalog::SYNC_DATA, XmlObjectCatalog::SYNC_FULL,
+    XmlObjectCatalog::SYNC_PERIODIC
+  };
+  for (unsigned int i = 0; i < sizeof(modes)/sizeof(modes[0]); ++i)
+  {
+    vehicles.setDurability (modes[i]);
+    Check (vehicles.durability() == modes[i]);
+    Check (vehicles.insert ("durable", &c));
+    Check (vehicles.remove ("durable"));
+  }
+  // Switching away from periodic stops the background thread.
+  vehicles.setDurability (XmlObjectCatalog::SYNC_NONE);
+  Check (vehicles.errorsPending() == 0);
+  return errors;
+}
+
+
+int
+test_concurrent_producers()
+{
+  int errors = 0;
+  const int nproducers = 8;
+  const int ninserts = 20;
+
+  // Every producer repeatedly inserts the same key and its own key.
+  std::vector<pid_t> pids;
+  for (int p = 0; p < nproducers; ++p)
+  {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      XmlObjectCatalog vehicles;
+      int failed = ! vehicles.open ("family-cars");
+      Car c;
+      make_honda(c);
+      c.Year = 2000 + p;
+      std::ostringstream own;
+      own << "producer-" << p;
+      for (int i = 0; i < ninserts; ++i)
+      {
+	failed += ! vehicles.insert ("shared", &c);
+	failed += ! vehicles.insert (own.str(), &c);
+      }
+      _exit (failed ? 1 : 0);
+    }
+    Check(pid > 0);
+    pids.push_back (pid);
+  }
+  for (unsigned int i = 0; i < pids.size(); ++i)
+  {
+    int status = 0;
+    Check(waitpid (pids[i], &status, 0) == pids[i]);
+    Check(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  // The shared key holds one complete object from one of the producers.
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+  XmlObjectInterface xo;
+  Check(vehicles.load("shared", &xo));
+  Car shared;
+  shared.assume (xo);
+  Check(shared.getMake() == "honda");
+  Check(shared.Year() >= 2000 && shared.Year() < 2000 + nproducers);
+  for (int p = 0; p < nproducers; ++p)
+  {
+    std::ostringstream own;
+    own << "producer-" << p;
+    Car c;
+    Check(vehicles.load(own.str(), &c));
+    Check(c.Year() == 2000 + p);
+    vehicles.remove (own.str());
+  }
+  vehicles.remove ("shared");
+
+  // No temporary or backup files are left behind.
+  std::string path = XmlObjectCatalog::rootCatalogDirectory() + "/family-cars";
+  DIR* dir = opendir (path.c_str());
+  Check(dir != 0);
+  struct dirent* entry;
+  while (dir && (entry = readdir(dir)) != 0)
+  {
+    std::string name (entry->d_name);
+    Check(name.find("-temp") == std::string::npos);
+    Check(name.find("-backup") == std::string::npos);
+  }
+  if (dir)
+    closedir (dir);
+  return errors;
+}
+
+
+int
+test_compare_and_swap()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+  vehicles.remove ("counter");
+
+  Car c;
+  make_mazda(c);
+  c.Year = 0;
+  Check(vehicles.insertIfAbsent ("counter", &c));
+  Check(! vehicles.insertIfAbsent ("counter", &c));
+
+  XmlObjectCatalog::ObjectVersion v1, v2;
+  Check(vehicles.load ("counter", &c, v1));
+  Check(vehicles.version ("counter", v2));
+  Check(v1 == v2);
+  c.Year = 1;
+  Check(vehicles.replaceIfUnchanged ("counter", &c, v1));
+  // The old version is now stale.
+  c.Year = 99;
+  Check(! vehicles.replaceIfUnchanged ("counter", &c, v1));
+  Check(vehicles.load ("counter", &c, v2));
+  Check(c.Year() == 1);
+  Check(v1 != v2);
+
+  // Several processes increment the same counter with retries, and no
+  // increment is lost.
+  const int nproducers = 4;
+  const int nincrements = 10;
+  std::vector<pid_t> pids;
+  for (int p = 0; p < nproducers; ++p)
+  {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      // Each increment gets a bounded number of tries, and a failed
+      // load fails the producer rather than spinning.
+      XmlObjectCatalog counters;
+      int failed = ! counters.open ("family-cars");
+      int tries = 0;
+      for (int i = 0; !failed && i < nincrements; )
+      {
+	Car car;
+	XmlObjectCatalog::ObjectVersion v;
+	failed = (++tries > 1000 || ! counters.load ("counter", &car, v));
+	if (failed)
+	  break;
+	car.Year = car.Year() + 1;
+	if (counters.replaceIfUnchanged ("counter", &car, v))
+	  ++i;
+	failed = counters.errorsPending();
+      }
+      _exit (failed ? 1 : 0);
+    }
+    Check(pid > 0);
+    pids.push_back (pid);
+  }
+  for (unsigned int i = 0; i < pids.size(); ++i)
+  {
+    int status = 0;
+    Check(waitpid (pids[i], &status, 0) == pids[i]);
+    Check(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  Check(vehicles.load ("counter", &c));
+  Check(c.Year() == 1 + nproducers * nincrements);
+  Check(vehicles.remove ("counter"));
+  Check(vehicles.errorsPending() == 0);
+  return errors;
+}
+
+
+int
+test_exists_and_move()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles, sold;
+  Check (vehicles.open ("family-cars"));
+  Check (sold.open ("family-cars/sold"));
+
+  Car c;
+  make_mazda(c);
+  Check(vehicles.insert ("mazda", &c));
+  Check(vehicles.insert ("civic", &c));
+  Check(vehicles.exists ("mazda"));
+  Check(! vehicles.exists ("nosuchcar"));
+
+  XmlObjectCatalog::key_set_t names, found;
+  names.insert ("mazda");
+  names.insert ("civic");
+  names.insert ("nosuchcar");
+  Check(vehicles.exists (names, found));
+  Check(found.size() == 2);
+  Check(found.count ("civic") == 1);
+
+  Check(vehicles.move ("mazda", &sold));
+  Check(! vehicles.exists ("mazda"));
+  Check(sold.exists ("mazda"));
+  Check(sold.load ("mazda", &c));
+  Check(c.getMake() == "mazda");
+
+  // Moving a missing object fails, but the rest of the batch still moves.
+  Check(! vehicles.move (names, &sold));
+  Check(sold.exists ("civic"));
+  Check(! vehicles.exists ("civic"));
+  vehicles.clearErrors();
+
+  Check(sold.remove ("mazda"));
+  Check(sold.remove ("civic"));
+  return errors;
+}
+
+
+int
+test_sharding()
+{
+  int errors = 0;
+
+  XmlObjectCatalog cars;
+  Check (cars.open ("sharded-cars"));
+  Check (cars.reshard (0));
+
+  Car c;
+  make_mazda(c);
+  XmlObjectCatalog::key_set_t names;
+  for (int i = 0; i < 40; ++i)
+  {
+    std::ostringstream key;
+    key << "car-" << i;
+    c.Year = 1990 + i;
+    Check(cars.insert (key.str(), &c));
+    names.insert (key.str());
+  }
+
+  // Migrate the flat catalog in place, then reshard again to a different
+  // count, and make sure nothing is lost either time.
+  Check(cars.reshard (8));
+  Check(access ("./sharded-cars/.shards", F_OK) == 0);
+  Check(access ("./sharded-cars/car-7.xml", F_OK) != 0);
+  XmlObjectCatalog::key_set_t kset;
+  Check(cars.keys (kset));
+  Check(kset == names);
+  Check(cars.reshard (3));
+  Check(access ("./sharded-cars/.shard-007", F_OK) != 0);
+
+  // A new catalog picks up the layout when it opens the directory.
+  XmlObjectCatalog reopened;
+  Check(reopened.open ("sharded-cars"));
+  Check(reopened.keys (kset));
+  Check(kset == names);
+  Check(reopened.load ("car-7", &c));
+  Check(c.Year() == 1997);
+  Check(reopened.exists ("car-39"));
+  Check(reopened.remove ("car-39"));
+  Check(! cars.exists ("car-39"));
+  Check(reopened.insert ("car-39", &c));
+
+  Check(cars.reshard (0));
+  Check(access ("./sharded-cars/.shards", F_OK) != 0);
+  Check(access ("./sharded-cars/car-7.xml", F_OK) == 0);
+  Check(cars.keys (kset));
+  Check(kset == names);
+
+  XmlObjectCatalog::key_set_t::iterator it;
+  for (it = names.begin(); it != names.end(); ++it)
+  {
+    Check(cars.remove (*it));
+  }
+  return errors;
+}
+
+
+int
+test_partitions()
+{
+  int errors = 0;
+
+  XmlObjectCatalog queue;
+  Check (queue.open ("queued-cars"));
+  Check (queue.repartition (XmlObjectCatalog::PARTITION_NONE));
+
+  // Four cars a day for five days, plus one key with no time prefix.
+  Car c;
+  make_mazda(c);
+  XmlObjectCatalog::key_set_t names;
+  time_t start = 1262304000;  // 2010-01-01 00:00 UTC
+  for (int i = 0; i < 20; ++i)
+  {
+    std::string key = XmlTime(start + i * 6 * 3600).key();
+    Check(queue.insert (key, &c));
+    names.insert (key);
+  }
+  Check(queue.insert ("undated", &c));
+  names.insert ("undated");
+
+  Check(queue.repartition (XmlObjectCatalog::PARTITION_DAY));
+  Check(queue.partitioning() == XmlObjectCatalog::PARTITION_DAY);
+  Check(access ("./queued-cars/.part-20100103", F_OK) == 0);
+  Check(access ("./queued-cars/undated.xml", F_OK) == 0);
+  XmlObjectCatalog::key_set_t kset;
+  Check(queue.keys (kset));
+  Check(kset == names);
+
+  // New objects go straight into their partitions.
+  std::string late = XmlTime(start + 10 * 24 * 3600).key();
+  Check(queue.insert (late, &c));
+  Check(access ("./queued-cars/.part-20100111", F_OK) == 0);
+  Check(queue.load (late, &c));
+  names.insert (late);
+
+  Check(queue.keys ("20100102", "20100104", kset));
+  Check(kset.size() == 8);
+  Check(*kset.begin() == "20100102T000000");
+
+  Check(queue.dropBefore (XmlTime(start + 2 * 24 * 3600 + 3600).key()));
+  Check(access ("./queued-cars/.part-20100102", F_OK) != 0);
+  Check(queue.keys (kset));
+  Check(kset.size() == names.size() - 8);
+  Check(! queue.exists ("20100101T060000"));
+  Check(queue.exists ("20100103T000000"));
+
+  XmlObjectCatalog::key_set_t::iterator it;
+  for (it = kset.begin(); it != kset.end(); ++it)
+  {
+    Check(queue.remove (*it));
+  }
+  Check(queue.repartition (XmlObjectCatalog::PARTITION_NONE));
+  Check(access ("./queued-cars/.part-20100103", F_OK) != 0);
+  return errors;
+}
+
+
+int
+test_segments()
+{
+  int errors = 0;
+
+  XmlObjectCatalog packed;
+  Check (packed.open ("packed-cars"));
+  Check (packed.setStorage (XmlObjectCatalog::STORAGE_SEGMENTS));
+  Check (packed.storage() == XmlObjectCatalog::STORAGE_SEGMENTS);
+  Check (access ("./packed-cars/.segments", F_OK) == 0);
+
+  Car mazda, honda;
+  make_mazda(mazda);
+  make_honda(honda);
+  Check(packed.insert ("mazda", &mazda));
+  Check(packed.insert ("honda", &honda));
+  Check(access ("./packed-cars/mazda.xml", F_OK) != 0);
+
+  // Another instance sees the writes, and an overwrite replaces the text.
+  XmlObjectCatalog other;
+  Check (other.open ("packed-cars"));
+  Car car;
+  Check(other.load ("honda", &car));
+  errors += compare_honda(car);
+  Check(packed.insert ("honda", &mazda));
+  Check(other.load ("honda", &car));
+  Check(car.getMake() == "mazda");
+
+  Check(packed.remove ("honda"));
+  Check(! other.exists ("honda"));
+  Check(other.exists ("mazda"));
+  XmlObjectCatalog::key_set_t kset;
+  Check(other.keys (kset));
+  Check(kset.size() == 1 && *kset.begin() == "mazda");
+
+  mazda.Year = 0;
+  Check(packed.insertIfAbsent ("counter", &mazda));
+  Check(! packed.insertIfAbsent ("counter", &mazda));
+  XmlObjectCatalog::ObjectVersion v1;
+  Check(packed.load ("counter", &car, v1));
+  mazda.Year = 1;
+  Check(packed.replaceIfUnchanged ("counter", &mazda, v1));
+  Check(! other.replaceIfUnchanged ("counter", &mazda, v1));
+
+  XmlObjectCatalog::object_list_t batch;
+  batch.push_back (std::make_pair(std::string("batch-mazda"), &mazda));
+  batch.push_back (std::make_pair(std::string("batch-honda"), &honda));
+  Check(packed.insertBatch (batch));
+  Check(other.load ("batch-honda", &car));
+  errors += compare_honda(car);
+
+  // Compaction drops the dead records but keeps every live object.
+  Check(packed.compact());
+  Check(other.keys (kset));
+  Check(kset.size() == 4);
+  Check(other.load ("counter", &car));
+  Check(car.Year() == 1);
+
+  // Converting back writes one file per object again.
+  Check(packed.setStorage (XmlObjectCatalog::STORAGE_FILES));
+  Check(access ("./packed-cars/.segments", F_OK) != 0);
+  Check(access ("./packed-cars/batch-mazda.xml", F_OK) == 0);
+  Check(other.open ("packed-cars"));
+  Check(other.storage() == XmlObjectCatalog::STORAGE_FILES);
+  Check(other.load ("batch-mazda", &car));
+
+  XmlObjectCatalog::key_set_t::iterator it;
+  for (it = kset.begin(); it != kset.end(); ++it)
+  {
+    Check(packed.remove (*it));
+  }
+  return errors;
+}
+
+
+int
+test_memory()
+{
+  int errors = 0;
+
+  XmlObjectCatalog scratch, shared;
+  Check (scratch.openMemory ("scratch-cars"));
+  Check (shared.openMemory ("scratch-cars"));
+  Check (scratch.storage() == XmlObjectCatalog::STORAGE_MEMORY);
+  Check (access ("./scratch-cars", F_OK) != 0);
+
+  Car mazda, honda, car;
+  make_mazda(mazda);
+  make_honda(honda);
+  Check(scratch.insert ("mazda", &mazda));
+  Check(shared.load ("mazda", &car));
+  Check(car.getMake() == "mazda");
+  Check(! shared.insertIfAbsent ("mazda", &honda));
+
+  XmlObjectCatalog::ObjectVersion v1;
+  Check(shared.version ("mazda", v1));
+  Check(scratch.replaceIfUnchanged ("mazda", &honda, v1));
+  Check(! shared.replaceIfUnchanged ("mazda", &mazda, v1));
+  Check(shared.load ("mazda", &car));
+  errors += compare_honda(car);
+
+  XmlObjectCatalog::object_list_t batch;
+  batch.push_back (std::make_pair(std::string("batch-mazda"), &mazda));
+  batch.push_back (std::make_pair(std::string("batch-honda"), &honda));
+  Check(scratch.insertBatch (batch));
+  XmlObjectCatalog::key_set_t kset;
+  Check(shared.keys ("batch", "batch~", kset));
+  Check(kset.size() == 2);
+
+  // Objects move between memory and files like between any catalogs.
+  XmlObjectCatalog vehicles;
+  Check(vehicles.open ("family-cars"));
+  Check(scratch.move ("batch-honda", &vehicles));
+  Check(! shared.exists ("batch-honda"));
+  Check(vehicles.load ("batch-honda", &car));
+  errors += compare_honda(car);
+  Check(vehicles.move ("batch-honda", &shared));
+  Check(scratch.exists ("batch-honda"));
+  Check(! scratch.setStorage (XmlObjectCatalog::STORAGE_FILES));
+  scratch.clearErrors();
+
+  Check(scratch.keys (kset));
+  XmlObjectCatalog::key_set_t::iterator it;
+  for (it = kset.begin(); it != kset.end(); ++it)
+  {
+    Check(scratch.remove (*it));
+  }
+  Check(shared.keys (kset));
+  Check(kset.empty());
+  return errors;
+}
+
+
+int
+test_load_cache()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+  XmlObjectCatalog::setLoadCacheSize (16);
+
+  Car mazda, honda, car;
+  make_mazda(mazda);
+  make_honda(honda);
+  Check(vehicles.insert ("cached", &mazda));
+  XmlObjectCatalog::LoadCacheStats before = XmlObjectCatalog::loadCacheStats();
+  Check(vehicles.load ("cached", &car));
+  Check(vehicles.load ("cached", &car));
+  XmlObjectCatalog::LoadCacheStats after = XmlObjectCatalog::loadCacheStats();
+  Check(after.misses == before.misses + 1);
+  Check(after.hits == before.hits + 1);
+  Check(car.getMake() == "mazda");
+
+  // A copy from the cache belongs to the caller, and a replaced object
+  // is read again.
+  car.setMake ("ford");
+  XmlObjectCatalog::ObjectVersion v1, v2;
+  Check(vehicles.load ("cached", &car, v1));
+  Check(car.getMake() == "mazda");
+  Check(vehicles.version ("cached", v2));
+  Check(v1 == v2);
+  Check(vehicles.insert ("cached", &honda));
+  Check(vehicles.load ("cached", &car));
+  errors += compare_honda(car);
+
+  Check(vehicles.remove ("cached"));
+  Check(! vehicles.load ("cached", &car));
+  XmlObjectCatalog::setLoadCacheSize (0);
+  Check(XmlObjectCatalog::loadCacheStats().entries == 0);
+  return errors;
+}
+
+
+int
+test_shared_cache()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+  Check (XmlObjectCatalog::setSharedLoadCache ("./shared-cache", 64));
+
+  // Without a local cache, the second load comes from the shared one.
+  Car mazda, honda, car;
+  make_mazda(mazda);
+  make_honda(honda);
+  Check(vehicles.insert ("shared", &mazda));
+  XmlObjectCatalog::LoadCacheStats before = XmlObjectCatalog::loadCacheStats();
+  Check(vehicles.load ("shared", &car));
+  car.setMake ("ford");
+  Check(vehicles.load ("shared", &car));
+  XmlObjectCatalog::LoadCacheStats after = XmlObjectCatalog::loadCacheStats();
+  Check(after.shared_misses == before.shared_misses + 1);
+  Check(after.shared_hits == before.shared_hits + 1);
+  Check(car.getMake() == "mazda");
+
+  // A replaced object does not match the slot any more.
+  Check(vehicles.insert ("shared", &honda));
+  Check(vehicles.load ("shared", &car));
+  errors += compare_honda(car);
+  Check(XmlObjectCatalog::loadCacheStats().shared_misses ==
+	after.shared_misses + 1);
+
+  Check(vehicles.remove ("shared"));
+  Check(! vehicles.load ("shared", &car));
+  Check (XmlObjectCatalog::setSharedLoadCache ("", 0));
+  return errors;
+}
+
+
+void
+count_loaded (const XmlObjectCatalog::object_entry_t&, bool loaded, void* arg)
+{
+  int* counts = static_cast<int*>(arg);
+  ++counts[loaded ? 0 : 1];
+}
+
+
+int
+test_load_many()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+
+  Car honda;
+  make_honda(honda);
+  const int ncars = 20;
+  Car cars[ncars];
+  XmlObjectCatalog::object_list_t objects;
+  for (int i = 0; i < ncars; ++i)
+  {
+    std::ostringstream key;
+    key << "many-" << i;
+    honda.Year = 2000 + i;
+    Check(vehicles.insert (key.str(), &honda));
+    objects.push_back (std::make_pair (key.str(), &cars[i]));
+  }
+  // Both with and without io_uring, when it is built in.
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    XmlObjectCatalog::setIoUring (pass == 1);
+    Check(vehicles.loadMany (objects, 4));
+    for (int i = 0; i < ncars; ++i)
+    {
+      Check(cars[i].getMake() == "honda");
+      Check(cars[i].Year() == 2000 + i);
+      cars[i].setMake ("");
+    }
+  }
+
+  // A missing key fails only its own object.
+  Car missing;
+  objects.push_back (std::make_pair (std::string("many-missing"), &missing));
+  int counts[2] = { 0, 0 };
+  Check(! vehicles.loadMany (objects, count_loaded, counts));
+  Check(counts[0] == ncars);
+  Check(counts[1] == 1);
+
+  for (int i = 0; i < ncars; ++i)
+  {
+    Check(vehicles.remove (objects[i].first));
+  }
+  return errors;
+}
+
+
+int
+test_iterator()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+
+  Car honda;
+  make_honda(honda);
+  for (int i = 0; i < 10; ++i)
+  {
+    std::ostringstream key;
+    key << "queue-" << i;
+    honda.Year = 2000 + i;
+    Check(vehicles.insert (key.str(), &honda));
+  }
+
+  // Work through the queue in key order, removing each object as it is
+  // done and one before it is reached.
+  XmlObjectCatalogIterator queue (vehicles, "queue-", "queue-~", 3);
+  Check(vehicles.remove ("queue-5"));
+  std::string key;
+  Car car;
+  int year = 2000;
+  while (queue.next (key, &car))
+  {
+    if (year == 2005)
+      ++year;
+    Check(car.Year() == year);
+    Check(vehicles.remove (key));
+    ++year;
+  }
+  Check(year == 2010);
+  Check(! vehicles.exists ("queue-9"));
+  return errors;
+}
+
+
+int
+test_watch()
+{
+  int errors = 0;
+
+  XmlObjectCatalog vehicles;
+  Check (vehicles.open ("family-cars"));
+  XmlObjectCatalogWatch watch;
+  Check (watch.watch (vehicles));
+
+  Car honda;
+  make_honda(honda);
+  XmlObjectCatalogWatch::change_list_t changes;
+  Check(vehicles.insert ("watched", &honda));
+  Check(vehicles.insert ("watched", &honda));
+  Check(watch.wait (changes, 1000));
+  Check(changes.size() == 1 && changes[0].key == "watched" &&
+	changes[0].change == XmlObjectCatalogWatch::KEY_INSERTED);
+
+  Check(vehicles.insert ("watched", &honda));
+  Check(watch.wait (changes, 1000));
+  Check(changes.size() == 1 &&
+	changes[0].change == XmlObjectCatalogWatch::KEY_REPLACED);
+
+  Check(vehicles.remove ("watched"));
+  Check(watch.wait (changes, 1000));
+  Check(changes.size() == 1 &&
+	changes[0].change == XmlObjectCatalogWatch::KEY_REMOVED);
+
+  // Nothing more happens.
+  Check(watch.wait (changes, 10));
+  Check(changes.empty());
+  return errors;
+}
+
+
+int
+test_journal()
+{
+  int errors = 0;
+
+  XmlObjectCatalog journaled;
+  Check (journaled.open ("journaled-cars"));
+  Check (journaled.setJournal (true));
+  unsigned long long start;
+  Check (journaled.journalSequence (start));
+
+  Car honda;
+  make_honda(honda);
+  Check(journaled.insert ("honda", &honda));
+  Check(journaled.insert ("mazda", &honda));
+  Check(journaled.remove ("honda"));
+
+  // A consumer resumes from where it left off.
+  XmlObjectCatalog::journal_t entries;
+  Check(journaled.tail (start, entries));
+  Check(entries.size() == 3);
+  if (entries.size() == 3)
+  {
+    Check(entries[0].sequence == start + 1);
+    Check(entries[0].op == XmlObjectCatalog::JOURNAL_INSERT);
+    Check(entries[0].key == "honda");
+    Check(entries[2].op == XmlObjectCatalog::JOURNAL_REMOVE);
+    Check(entries[2].key == "honda");
+  }
+  Check(journaled.tail (start + 2, entries));
+  Check(entries.size() == 1);
+
+  // Once compacted, older records are gone but the numbering goes on.
+  Check(journaled.compactJournal (start + 3));
+  Check(! journaled.tail (start, entries));
+  journaled.clearErrors();
+  Check(journaled.remove ("mazda"));
+  Check(journaled.tail (start + 2, entries));
+  Check(entries.size() == 2 && entries[1].sequence == start + 4);
+
+  Check(journaled.setJournal (false));
+  Check(! journaled.journalSequence (start));
+  journaled.clearErrors();
+  return errors;
+}
+
+
+int
+test_async_insert()
+{
+  int errors = 0;
+
+  XmlObjectCatalog async;
+  Check (async.open ("async-cars"));
+  async.setAsyncInsert (60000);
+
+  // Repeated inserts of one car are coalesced into a single write.
+  Car honda;
+  make_honda(honda);
+  for (int year = 1990; year < 2000; ++year)
+  {
+    honda.Year = year;
+    Check(async.insert ("honda", &honda));
+  }
+  XmlObjectCatalog other;
+  Check (other.open ("async-cars"));
+  Check (! other.exists ("honda"));
+
+  // This instance sees its own queued inserts.
+  Car car;
+  Check(async.load ("honda", &car));
+  Check(car.Year() == 1999);
+
+  Check(async.insert ("mazda", &honda));
+  Check(async.flush());
+  Check(other.exists ("mazda"));
+  Check(async.remove ("honda"));
+  Check(async.remove ("mazda"));
+  async.setAsyncInsert (0);
+  return errors;
+}
+
+
+int
+test_skip_unchanged()
+{
+  int errors = 0;
+
+  XmlObjectCatalog catalog;
+  Check (catalog.open ("unchanged-cars"));
+  catalog.setSkipUnchanged (true);
+
+  Car honda;
+  make_honda(honda);
+  XmlObjectCatalog::ObjectVersion first, second;
+  Check(catalog.insert ("honda", &honda));
+  Check(catalog.version ("honda", first));
+
+  // The object file carries its fingerprint, unless the filesystem has
+  // no user attributes, in which case the file itself is compared.
+  std::string path = XmlObjectCatalog::rootCatalogDirectory() +
+    "/unchanged-cars/honda.xml";
+  char value[128];
+  ssize_t n = getxattr (path.c_str(), "user.domx.fingerprint", value,
+			sizeof(value));
+  if (n >= 0 || errno != ENOTSUP)
+    Check(n > 0);
+
+  // The same car again leaves the stored object alone, a changed one
+  // replaces it.
+  Check(catalog.insert ("honda", &honda));
+  Check(catalog.version ("honda", second));
+  Check(first == second);
+  honda.Year = 1999;
+  Check(catalog.insert ("honda", &honda));
+  Check(catalog.version ("honda", second));
+  Check(first != second);
+  Check(catalog.remove ("honda"));
+  return errors;
+}
+
+
+int
+test_summary()
+{
+  int errors = 0;
+
+  XmlObjectCatalog catalog;
+  Check (catalog.open ("summarized-cars"));
+  Check (catalog.setSummary (true));
+
+  Car honda;
+  make_honda(honda);
+  Check(catalog.insert ("honda", &honda));
+  Check(catalog.insert ("mazda", &honda));
+  Check(catalog.remove ("honda"));
+  Check(catalog.updateSummary());
+
+  // The summary holds just the objects left in the catalog.
+  std::ifstream in (catalog.summaryPath().c_str());
+  std::ostringstream summary;
+  summary << in.rdbuf();
+  Check(summary.str().find ("<object key='mazda'") != std::string::npos);
+  Check(summary.str().find ("<object key='honda'") == std::string::npos);
+
+  Check(catalog.remove ("mazda"));
+  Check(catalog.setSummary (false));
+  return errors;
+}
+
+
+int
+test_index()
+{
+  int errors = 0;
+
+  XmlObjectCatalog catalog;
+  Check (catalog.open ("indexed-files"));
+  XmlFileObject one, two;
+  one.MD5 = "d41d8cd98f00b204e9800998ecf8427e";
+  one.setOpen();
+  two.MD5 = one.MD5();
+  Check(catalog.insert ("one", &one));
+  Check(catalog.setIndex ("xmlfileobject/md5"));
+  Check(catalog.setIndex ("xmlfileobject/state"));
+  Check(catalog.insert ("two", &two));
+
+  XmlObjectCatalog::key_set_t kset;
+  Check(catalog.lookup ("xmlfileobject/md5", one.MD5(), kset));
+  Check(kset.size() == 2);
+  Check(catalog.lookup ("xmlfileobject/state", "open", kset));
+  Check(kset.size() == 1 && kset.count ("one"));
+
+  // Updates and removes move keys between values.
+  one.setClosed();
+  Check(catalog.insert ("one", &one));
+  Check(catalog.remove ("two"));
+  Check(catalog.lookup ("xmlfileobject/state", "open", kset));
+  Check(kset.empty());
+  Check(catalog.rebuildIndex ("xmlfileobject/md5"));
+  Check(catalog.lookup ("xmlfileobject/md5", one.MD5(), kset));
+  Check(kset.size() == 1 && kset.count ("one"));
+
+  Check(catalog.remove ("one"));
+  Check(catalog.setIndex ("xmlfileobject/md5", false));
+  Check(catalog.setIndex ("xmlfileobject/state", false));
+  std::vector<std::string> paths;
+  Check(catalog.indexes (paths) && paths.empty());
+  return errors;
+}
+
+
+int
+test_object_reader()
+{
+  int errors = 0;
+
+  // A plain concatenation of two cars, then the same cars wrapped as in
+  // a catalog summary.
+  Car honda, mazda;
+  make_honda(honda);
+  make_mazda(mazda);
+  std::ostringstream out;
+  honda.toXML (out);
+  mazda.toXML (out);
+  out << "<summary>\n<object key='honda'>\n";
+  honda.toXML (out);
+  out << "</object>\n<object key='mazda'>\n";
+  mazda.toXML (out);
+  out << "</object>\n</summary>\n";
+
+  std::istringstream in (out.str());
+  XmlObjectReader reader (in);
+  Car car;
+  Check(reader.next (&car));
+  errors += compare_honda (car);
+  Check(reader.key() == "");
+  Check(reader.next (&car));
+  Check(car.Year() == 1986);
+  Check(reader.next (&car));
+  errors += compare_honda (car);
+  Check(reader.key() == "honda");
+  Check(reader.next (&car));
+  Check(reader.key() == "mazda");
+  Check(car.getMake() == "mazda");
+  Check(! reader.next (&car));
+  Check(! reader.error());
+  return errors;
+}
+
+
+int
+test_xml_writer()
+{
+  int errors = 0;
+
+  std::string text;
+  {
+    XmlWriter out (text);
+    out.startElement ("export").attribute ("note", "<'&'>")
+      .startElement ("empty").endElement()
+      .startElement ("name").text ("a < b & c").endElement()
+      .endElement();
+    Check(! out.error());
+  }
+  Check(text == "<export note='&lt;&apos;&amp;&apos;&gt;'>\n"
+	"  <empty/>\n"
+	"  <name>a &lt; b &amp; c</name>\n"
+	"</export>\n");
+
+  // Objects written through the writer match their own text, and text
+  // which needs escaping comes back unchanged.
+  Car honda, mazda;
+  make_honda(honda);
+  make_mazda(mazda);
+  mazda.setModel ("miata <mx-5> & more");
+  std::ostringstream stream;
+  {
+    XmlWriter out (stream);
+    out.startElement ("export");
+    Check(honda.toXML (out));
+    Check(mazda.toXML (out));
+    out.endElement();
+    Check(out.flush());
+  }
+  Check(stream.str().find (honda.toString()) != std::string::npos);
+
+  std::istringstream in (stream.str());
+  XmlObjectReader reader (in);
+  Car car;
+  Check(reader.next (&car));
+  errors += compare_honda (car);
+  Check(reader.next (&car));
+  Check(car.getModel() == "miata <mx-5> & more");
+  Check(! reader.next (&car));
+  Check(! reader.error());
+  return errors;
+}
+
+
 int
 test_xmltime()
 {
@@ -341,6 +1345,27 @@ main(int argc, char* argv[])
     int errors = 0;
     errors += test_xmlobject();
     errors += test_xmlobjectcatalog();
+    errors += test_insertbatch();
+    errors += test_durability();
+    errors += test_concurrent_producers();
+    errors += test_compare_and_swap();
+    errors += test_exists_and_move();
+    errors += test_sharding();
+    errors += test_partitions();
+    errors += test_segments();
+    errors += test_memory();
+    errors += test_load_cache();
+    errors += test_shared_cache();
+    errors += test_load_many();
+    errors += test_iterator();
+    errors += test_watch();
+    errors += test_journal();
+    errors += test_async_insert();
+    errors += test_skip_unchanged();
+    errors += test_summary();
+    errors += test_index();
+    errors += test_object_reader();
+    errors += test_xml_writer();
     errors += test_xmltime();
     errors += test_xmlfileobject();
     errors += test_xmlstring();
@@ -5,11 +5,24 @@ from SCons.Script import Environment, Export, SConscript
 # Need prefixoptions for Install methods.
 tools = ['xercesc', 'logx', 'doxygen', 'prefixoptions']
 env = Environment(tools=['default'] + tools)
+# The catalog uses a background thread for periodic syncs.
+env.AppendUnique(LIBS=['pthread'])
+
+# Bulk catalog reads use io_uring when liburing is installed.
+conf = env.Configure()
+have_liburing = conf.CheckLibWithHeader('uring', 'liburing.h', 'C')
+env = conf.Finish()
+if have_liburing:
+    env.AppendUnique(CPPDEFINES=['DOMX_HAVE_LIBURING'])
 
 domxdir = env.Dir('.')
 
 sources = env.Split("""
  XML.cc XmlObjectInterface.cc XmlObjectCatalog.cc XmlTime.cc XmlFileObject.cc
+ XmlObjectCatalogFiles.cc XmlObjectCatalogSegments.cc
+ XmlObjectCatalogMemory.cc XmlObjectCatalogJournal.cc
+ XmlObjectCatalogSummary.cc XmlObjectCatalogIndex.cc
+ XmlObjectCatalogLoadCache.cc
 """)
 
 headers = env.Split("""
@@ -30,6 +43,9 @@ env.Apidocs(sources + headers)
 
 def domx(env):
     env.Append(LIBS=lib)
+    env.AppendUnique(LIBS=['pthread'])
+    if have_liburing:
+        env.AppendUnique(LIBS=['uring'])
     env.AppendUnique(CPPPATH=domxdir)
     env.Require(tools)
 
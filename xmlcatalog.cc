@@ -11,6 +11,7 @@
 #include <string>
 #include <iostream>
 #include <iterator>
+#include <stdlib.h>
 
 using namespace domx;
 using std::runtime_error;
@@ -41,7 +42,7 @@ static void
 usage()
 {
     cerr << "Need at least one argument, the operation to perform:\n"
-	 << "xmlcatalog {insert|fetch} ...\n";
+	 << "xmlcatalog {insert|fetch|keys|reshard|storage|index|lookup} ...\n";
 }
 
 
@@ -106,6 +107,89 @@ keys (XmlObjectCatalog* catalog, int argc, char* /*argv*/[])
   
 
 
+int
+reshard (XmlObjectCatalog* catalog, int argc, char* argv[])
+{
+  if (argc != 2)
+  {
+    cerr << "Need the number of shards, or 0 for a flat catalog.\n"
+	 << "Usage: xmlcatalog reshard <catalog> <nshards>\n";
+    return 1;
+  }
+  int nshards = atoi (argv[1]);
+  if (nshards < 0 || ! catalog->reshard (nshards))
+  {
+    throw catalog_error (catalog->name(),
+			 "resharding: " + catalog->lastError());
+  }
+  return 0;
+}
+
+
+
+int
+storage (XmlObjectCatalog* catalog, int argc, char* argv[])
+{
+  string mode = (argc == 2) ? argv[1] : "";
+  if (mode != "files" && mode != "segments")
+  {
+    cerr << "Need the storage mode, files or segments.\n"
+	 << "Usage: xmlcatalog storage <catalog> {files|segments}\n";
+    return 1;
+  }
+  if (! catalog->setStorage (mode == "files" ?
+			     XmlObjectCatalog::STORAGE_FILES :
+			     XmlObjectCatalog::STORAGE_SEGMENTS))
+  {
+    throw catalog_error (catalog->name(),
+			 "converting storage: " + catalog->lastError());
+  }
+  return 0;
+}
+
+
+
+int
+index (XmlObjectCatalog* catalog, int argc, char* argv[])
+{
+  if (argc != 2 && ! (argc == 3 && string(argv[2]) == "drop"))
+  {
+    cerr << "Need the member path to index, such as xmlfileobject/md5.\n"
+	 << "Usage: xmlcatalog index <catalog> <path> [drop]\n";
+    return 1;
+  }
+  if (! catalog->setIndex (argv[1], argc == 2))
+  {
+    throw catalog_error (catalog->name(),
+			 "indexing: " + catalog->lastError());
+  }
+  return 0;
+}
+
+
+
+int
+lookup (XmlObjectCatalog* catalog, int argc, char* argv[])
+{
+  if (argc != 3)
+  {
+    cerr << "Need an indexed member path and the value to look up.\n"
+	 << "Usage: xmlcatalog lookup <catalog> <path> <value>\n";
+    return 1;
+  }
+  XmlObjectCatalog::key_set_t kset;
+  if (! catalog->lookup (argv[1], argv[2], kset))
+  {
+    throw catalog_error (catalog->name(),
+			 "lookup: " + catalog->lastError());
+  }
+  std::ostream_iterator<string,char> oi(cout, "\n");
+  std::copy (kset.begin(), kset.end(), oi);
+  return 0;
+}
+
+
+
 int 
 catalogMethod (int (*next)(XmlObjectCatalog*, int, char**),
 	       int argc, char* argv[])
@@ -147,6 +231,22 @@ xmlcatalog (int argc, char* argv[])
   {
     return catalogMethod (keys, argc-1, argv+1);
   }
+  else if (opt == "reshard")
+  {
+    return catalogMethod (reshard, argc-1, argv+1);
+  }
+  else if (opt == "storage")
+  {
+    return catalogMethod (storage, argc-1, argv+1);
+  }
+  else if (opt == "index")
+  {
+    return catalogMethod (index, argc-1, argv+1);
+  }
+  else if (opt == "lookup")
+  {
+    return catalogMethod (lookup, argc-1, argv+1);
+  }
   else 
   {
     usage();
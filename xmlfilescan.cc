@@ -64,6 +64,9 @@ main (int argc, char* argv[])
     ELOG << "Could not open catalog.";
     exit (1);
   }
+  // Rescanning the same files should not rewrite the ones which have not
+  // changed.
+  catalog.setSkipUnchanged (true);
 
   for (; i < argc; ++i)
   {